@@ -0,0 +1,339 @@
+#include "binary_log.h"
+
+#include "util.h"
+
+#include <chrono>
+#include <cstring>
+#include <functional>
+
+namespace logging {
+
+namespace {
+        constexpr char magic[] = "cpplog";
+        // Version 2 added fields, files of version 1 are read as well
+        constexpr char version = 2;
+
+        std::int64_t nanoseconds(std::chrono::system_clock::time_point time) {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+        }
+
+        void putVarint(std::string& out, std::uint64_t value) {
+                while (value >= 0x80) {
+                        out.push_back(static_cast<char>(value | 0x80));
+                        value >>= 7;
+                }
+                out.push_back(static_cast<char>(value));
+        }
+
+        void putZigzag(std::string& out, std::int64_t value) {
+                putVarint(out, (static_cast<std::uint64_t>(value) << 1) ^ static_cast<std::uint64_t>(value >> 63));
+        }
+
+        void putStr(std::string& out, std::string_view s) {
+                putVarint(out, s.size());
+                out.append(s.data(), s.size());
+        }
+
+        template<typename T>
+        void put(std::string& out, T value) {
+                out.append(reinterpret_cast<char const*>(&value), sizeof(value));
+        }
+
+        template<typename T>
+        T take(char const*& in) {
+                T res;
+                std::memcpy(&res, in, sizeof(res));
+                in += sizeof(res);
+                return res;
+        }
+
+        // Turn arguments as encoded by the deferred macros into the
+        // compact form of the file
+        void compactArgs(std::string_view args, std::string& out) {
+                char const* in = args.data();
+                char const* end = in + args.size();
+                while (in < end) {
+                        auto type = take<detail::ArgType>(in);
+                        put(out, type);
+                        switch (type) {
+                        case detail::ArgType::Int:
+                                putZigzag(out, take<std::int64_t>(in));
+                                break;
+                        case detail::ArgType::UInt:
+                                putVarint(out, take<std::uint64_t>(in));
+                                break;
+                        case detail::ArgType::Double:
+                                put(out, take<double>(in));
+                                break;
+                        case detail::ArgType::Bool:
+                        case detail::ArgType::Char:
+                                out.push_back(take<char>(in));
+                                break;
+                        case detail::ArgType::Str:
+                        case detail::ArgType::Key: {
+                                auto length = take<std::uint32_t>(in);
+                                putStr(out, std::string_view{in, length});
+                                in += length;
+                                break;
+                        }
+                        }
+                }
+        }
+
+        // Thrown when the file ends in the middle of a block
+        struct Truncated {};
+
+        // Reads the parts of blocks
+        class Cursor {
+        public:
+                Cursor(char const* pos, char const* end) : pos{pos}, end{end} {}
+
+                char const* position() const { return pos; }
+                bool done() const { return pos == end; }
+
+                void need(std::size_t n) const {
+                        if (static_cast<std::size_t>(end - pos) < n) {
+                                throw Truncated{};
+                        }
+                }
+
+                void skip(std::size_t n) {
+                        need(n);
+                        pos += n;
+                }
+
+                template<typename T>
+                T get() {
+                        need(sizeof(T));
+                        return take<T>(pos);
+                }
+
+                std::uint64_t varint() {
+                        std::uint64_t res{0};
+                        for (int shift = 0; shift < 64; shift += 7) {
+                                auto byte = static_cast<unsigned char>(get<char>());
+                                res |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+                                if (!(byte & 0x80)) {
+                                        return res;
+                                }
+                        }
+                        throw Error{"Corrupt varint in binary log"};
+                }
+
+                std::int64_t zigzag() {
+                        std::uint64_t value = varint();
+                        return static_cast<std::int64_t>((value >> 1) ^ (~(value & 1) + 1));
+                }
+
+                std::string_view str() {
+                        std::uint64_t length = varint();
+                        need(length);
+                        std::string_view res{pos, length};
+                        pos += length;
+                        return res;
+                }
+        private:
+                char const* pos;
+                char const* end;
+        };
+
+        // Turn the compact arguments of a message back into the form
+        // renderMessage() takes
+        void expandArgs(std::string_view args, std::string& out) {
+                Cursor in{args.data(), args.data() + args.size()};
+                while (!in.done()) {
+                        auto type = in.get<detail::ArgType>();
+                        put(out, type);
+                        switch (type) {
+                        case detail::ArgType::Int:
+                                put(out, in.zigzag());
+                                break;
+                        case detail::ArgType::UInt:
+                                put(out, in.varint());
+                                break;
+                        case detail::ArgType::Double:
+                                put(out, in.get<double>());
+                                break;
+                        case detail::ArgType::Bool:
+                        case detail::ArgType::Char:
+                                out.push_back(in.get<char>());
+                                break;
+                        case detail::ArgType::Str:
+                        case detail::ArgType::Key: {
+                                auto s = in.str();
+                                put(out, static_cast<std::uint32_t>(s.size()));
+                                out.append(s.data(), s.size());
+                                break;
+                        }
+                        default:
+                                throw Error{"Unknown argument type in binary log"};
+                        }
+                }
+        }
+}
+
+BinaryDest::BinaryDest(std::string const& fileName) {
+        file.open(fileName, std::ios::out | std::ios::app | std::ios::binary);
+        if (!file.is_open()) {
+                throw Error{util::format("Can't open `", fileName, "' for writing")};
+        }
+        lastTime = nanoseconds(std::chrono::system_clock::now());
+        out.push_back('L');
+        out.append(magic, sizeof(magic) - 1);
+        out.push_back(version);
+        put(out, lastTime);
+        file.write(out.data(), out.size());
+}
+
+std::size_t BinaryDest::SiteKeyHash::operator()(SiteKey const& key) const {
+        return std::hash<void const*>{}(key.where) ^ (static_cast<std::size_t>(key.line) << 4) ^
+                static_cast<std::size_t>(key.level);
+}
+
+std::uint32_t BinaryDest::siteId(Record const& record) {
+        SiteKey key{record.site ? static_cast<void const*>(record.site) : record.file,
+                    record.site ? 0 : record.line, record.site ? 0 : record.level.bits()};
+        auto& named = sites[key];
+        for (auto const& site : named) {
+                if (site.first == record.name) {
+                        return site.second;
+                }
+        }
+        std::uint32_t id = nextSite++;
+        named.emplace_back(std::string{record.name}, id);
+
+        out.clear();
+        out.push_back('S');
+        putVarint(out, id);
+        putVarint(out, static_cast<std::uint32_t>(record.level.bits()));
+        putVarint(out, static_cast<std::uint32_t>(record.line));
+        putStr(out, record.site ? record.site->format : "{}");
+        putStr(out, record.file);
+        putStr(out, record.func);
+        putStr(out, record.name);
+        file.write(out.data(), out.size());
+        return id;
+}
+
+void BinaryDest::writeMessage(std::uint32_t site, Record const& record, std::string_view args) {
+        std::int64_t time = nanoseconds(record.time);
+        out.clear();
+        out.push_back('R');
+        putVarint(out, site);
+        putZigzag(out, time - lastTime);
+        putVarint(out, record.thread);
+        putVarint(out, args.size());
+        out.append(args.data(), args.size());
+        file.write(out.data(), out.size());
+        lastTime = time;
+}
+
+bool BinaryDest::writeRecord(Record const& record) {
+        std::uint32_t site = siteId(record);
+        args.clear();
+        if (record.site) {
+                compactArgs(record.args, args);
+        } else {
+                put(args, detail::ArgType::Str);
+                putStr(args, record.msg);
+        }
+        writeMessage(site, record, args);
+        return true;
+}
+
+void BinaryDest::write(std::string_view message) {
+        Record record;
+        record.level = Level::Info;
+        record.msg = message;
+        record.time = std::chrono::system_clock::now();
+        writeRecord(record);
+}
+
+void BinaryDest::flush() {
+        file.flush();
+}
+
+BinaryLogReader::BinaryLogReader(std::string const& fileName) {
+        try {
+                contents = std::make_unique<util::MappedFile>(fileName);
+        } catch (util::IOError const& e) {
+                throw Error{e.what()};
+        }
+        begin = contents->data();
+        end = begin + contents->size();
+        if (begin != end && (end - begin < static_cast<std::ptrdiff_t>(sizeof(magic)) || *begin != 'L'
+                             || std::memcmp(begin + 1, magic, sizeof(magic) - 1) != 0)) {
+                throw Error{util::format("`", fileName, "' is not a binary log")};
+        }
+}
+
+bool BinaryLogReader::next(Record& record) {
+        try {
+                while (pos < static_cast<std::size_t>(end - begin)) {
+                        Cursor in{begin + pos, end};
+                        switch (in.get<char>()) {
+                        case 'L':
+                                in.need(sizeof(magic) - 1);
+                                if (std::memcmp(begin + pos + 1, magic, sizeof(magic) - 1) != 0) {
+                                        throw Error{"Corrupt session in binary log"};
+                                }
+                                in.skip(sizeof(magic) - 1);
+                                if (char v = in.get<char>(); v < 1 || v > version) {
+                                        throw Error{"Unsupported version of binary log"};
+                                }
+                                time = in.get<std::int64_t>();
+                                sites.clear();
+                                break;
+                        case 'S': {
+                                if (in.varint() != sites.size()) {
+                                        throw Error{"Site out of order in binary log"};
+                                }
+                                auto level = static_cast<int>(in.varint());
+                                if (level == 0) {
+                                        // Text written directly, older versions
+                                        // stored it without a level
+                                        level = Level::Info.bits();
+                                }
+                                auto line = static_cast<int>(in.varint());
+                                auto site = std::unique_ptr<Site>(new Site{CallSite{level, nullptr, nullptr, nullptr, line},
+                                                                           std::string{in.str()}, std::string{in.str()},
+                                                                           std::string{in.str()}, std::string{in.str()}});
+                                site->site.format = site->format.c_str();
+                                site->site.file = site->file.c_str();
+                                site->site.func = site->func.c_str();
+                                sites.push_back(std::move(site));
+                                break;
+                        }
+                        case 'R': {
+                                auto id = in.varint();
+                                if (id >= sites.size()) {
+                                        throw Error{"Message of a unknown site in binary log"};
+                                }
+                                std::int64_t messageTime = time + in.zigzag();
+                                auto thread = static_cast<std::uint32_t>(in.varint());
+                                auto compact = in.str();
+                                args.clear();
+                                expandArgs(compact, args);
+
+                                Site const& site = *sites[id];
+                                record = Record{site.site.level, site.site.line, site.site.file, site.site.func,
+                                                site.name, {},
+                                                std::chrono::system_clock::time_point{std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                                                        std::chrono::nanoseconds{messageTime})},
+                                                thread, &site.site, args};
+                                time = messageTime;
+                                pos = in.position() - begin;
+                                return true;
+                        }
+                        default:
+                                throw Error{"Unknown block in binary log"};
+                        }
+                        pos = in.position() - begin;
+                }
+        } catch (Truncated const&) {
+                pos = end - begin;
+        }
+        return false;
+}
+
+} /* namespace logging */
@@ -1,56 +1,903 @@
 #include "config.h"
 
-#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <future>
+#include <thread>
+#include <map>
+#include <set>
+#include <cerrno>
+#include <cstring>
 
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "json_binary.h"
 #include "util.h"
 
-Config::Config(std::string const& fileName)  {
-        std::fstream f{fileName};
-        if (!f.is_open()) {
-                throw ConfigError{util::format("Can't open configuration file `", fileName, "'")};
+// Watches the directories of the configuration files, watching the
+// files themselves would lose track of them as soon as a editor
+// replaces one by renaming a new file over it.
+class Config::Watcher {
+public:
+        Watcher(Config& cfg, std::vector<std::string> const& files, std::function<void(std::exception_ptr)> onError)
+                : cfg(cfg), onError{onError} {
+                inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+                if (inotifyFd < 0) {
+                        throw ConfigError{util::format("Can't initialize inotify: ", std::strerror(errno))};
+                }
+                try {
+                        watchFiles(files);
+                } catch (...) {
+                        close(inotifyFd);
+                        throw;
+                }
+                if (pipe(stopFds) != 0) {
+                        int err = errno;
+                        close(inotifyFd);
+                        throw ConfigError{util::format("Can't create pipe for config watcher: ", std::strerror(err))};
+                }
+                thread = std::thread{[this]() { run(); }};
+        }
+
+        ~Watcher() {
+                if (thread.joinable()) {
+                        char c{0};
+                        while (write(stopFds[1], &c, 1) < 0 && errno == EINTR) {}
+                        thread.join();
+                }
+                close(stopFds[0]);
+                close(stopFds[1]);
+                close(inotifyFd);
+        }
+
+        // Is this the thread that calls `onError`?
+        bool onOwnThread() const {
+                return std::this_thread::get_id() == thread.get_id();
+        }
+
+        // Stop once `onError` returns and delete ourselves, for when
+        // the callback unwatches. Joining the thread from itself would
+        // never finish.
+        void detachSelf() {
+                detached = true;
+                thread.detach();
+        }
+private:
+        // Watch the directories of `files`, forgetting about files that
+        // were watched before and removing the watches of directories
+        // that are no longer needed.
+        void watchFiles(std::vector<std::string> const& files) {
+                std::map<int, std::set<std::string>> next;
+                for (auto const& fileName : files) {
+                        auto slash = fileName.rfind('/');
+                        std::string dir = slash == std::string::npos ? "." : fileName.substr(0, slash + 1);
+                        // Files in the same directory share a watch,
+                        // adding it again gives back the same one
+                        int wd = inotify_add_watch(inotifyFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+                        if (wd < 0) {
+                                throw ConfigError{util::format("Can't watch `", dir, "': ", std::strerror(errno))};
+                        }
+                        next[wd].insert(slash == std::string::npos ? fileName : fileName.substr(slash + 1));
+                }
+                for (auto const& kv : bases) {
+                        if (!next.count(kv.first)) {
+                                inotify_rm_watch(inotifyFd, kv.first);
+                        }
+                }
+                bases = std::move(next);
+        }
+
+        void run() {
+                loop();
+                if (detached) {
+                        delete this;
+                }
+        }
+
+        void loop() {
+                pollfd fds[2] = {{inotifyFd, POLLIN, 0}, {stopFds[0], POLLIN, 0}};
+                alignas(inotify_event) char buf[4096];
+                while (true) {
+                        if (poll(fds, 2, -1) < 0) {
+                                if (errno == EINTR) {
+                                        continue;
+                                }
+                                report(std::make_exception_ptr(ConfigError{util::format("Config watcher failed: ", std::strerror(errno))}));
+                                return;
+                        }
+                        if (fds[1].revents) {
+                                return;
+                        }
+                        bool changed{false};
+                        ssize_t len;
+                        while ((len = read(inotifyFd, buf, sizeof(buf))) > 0) {
+                                for (char* p = buf; p < buf + len;) {
+                                        auto ev = reinterpret_cast<inotify_event*>(p);
+                                        auto it = bases.find(ev->wd);
+                                        if (ev->len > 0 && it != bases.end() && it->second.count(ev->name)) {
+                                                changed = true;
+                                        }
+                                        p += sizeof(inotify_event) + ev->len;
+                                }
+                        }
+                        if (changed) {
+                                try {
+                                        // A reload can change what
+                                        // the files include.
+                                        if (cfg.reload()) {
+                                                watchFiles(cfg.watchedFiles());
+                                        }
+                                } catch (...) {
+                                        report(std::current_exception());
+                                        if (detached) {
+                                                return;
+                                        }
+                                }
+                        }
+                }
+        }
+
+        void report(std::exception_ptr e) {
+                if (onError) {
+                        onError(e);
+                }
+        }
+
+        Config& cfg;
+        std::function<void(std::exception_ptr)> onError;
+        // Names of the files within each watched directory
+        std::map<int, std::set<std::string>> bases;
+        int inotifyFd{-1};
+        // Written to when the thread should stop
+        int stopFds[2]{-1, -1};
+        // Set by detachSelf(), only touched by our own thread
+        bool detached{false};
+        std::thread thread;
+};
+
+std::unique_ptr<Config::Snapshot const> Config::makeSnapshot(std::shared_ptr<json::Object const> root, std::uint64_t generation) {
+        return std::unique_ptr<Snapshot const>{new Snapshot{std::move(root), generation}};
+}
+
+std::string Config::readContents(std::string const& fileName) {
+        try {
+                return util::readFile(fileName);
+        } catch (util::IOError const& e) {
+                throw ConfigError{util::format("Can't open configuration file `", fileName, "': ", e.what())};
+        }
+}
+
+namespace {
+        // Merge `from` on top of `into`, objects are merged key by key,
+        // anything else in `from` replaces what is in `into`.
+        void deepMerge(json::Object& into, json::Object const& from) {
+                if (!into.is<json::Obj>() || !from.is<json::Obj>()) {
+                        into = from;
+                        return;
+                }
+                json::Obj& dst = into.into<json::Obj&>();
+                for (auto const& kv : from.into<json::Obj const&>()) {
+                        auto it = dst.find(kv.first);
+                        if (it == dst.end()) {
+                                dst.emplace(kv.first, kv.second);
+                        } else {
+                                deepMerge(it->second, kv.second);
+                        }
+                }
+        }
+
+        // Collect the shallowest paths below `prefix` where `a` and `b`
+        // differ into `out`.
+        void changedPaths(json::Object const& a, json::Object const& b, json::Path& prefix, std::vector<json::Path>& out) {
+                if (!a.is<json::Obj>() || !b.is<json::Obj>()) {
+                        if (a != b) {
+                                out.push_back(prefix);
+                        }
+                        return;
+                }
+                json::Obj const& lhs = a.into<json::Obj const&>();
+                json::Obj const& rhs = b.into<json::Obj const&>();
+                auto compare = [&](std::string const& key, json::Object const* x, json::Object const* y) {
+                        prefix.push_back(key);
+                        if (x && y) {
+                                changedPaths(*x, *y, prefix, out);
+                        } else {
+                                out.push_back(prefix);
+                        }
+                        prefix.pop_back();
+                };
+                for (auto const& kv : lhs) {
+                        auto it = rhs.find(kv.first);
+                        compare(kv.first, &kv.second, it == rhs.end() ? nullptr : &it->second);
+                }
+                for (auto const& kv : rhs) {
+                        if (lhs.find(kv.first) == lhs.end()) {
+                                compare(kv.first, nullptr, &kv.second);
+                        }
+                }
+        }
+
+        enum class Lookup {
+                // The layer doesn't say anything about the path
+                Absent,
+                // Something above the path isn't a object, hiding
+                // whatever lower layers have at the path
+                Hidden,
+                Found
+        };
+
+        Lookup lookup(json::Object const& root, json::Path const& path, json::Object const*& res) {
+                json::Object const* cur = &root;
+                for (auto const& key : path) {
+                        if (!cur->is<json::Obj>()) {
+                                return cur->blank() ? Lookup::Absent : Lookup::Hidden;
+                        }
+                        json::Obj const& obj = cur->into<json::Obj const&>();
+                        auto it = obj.find(key);
+                        if (it == obj.end()) {
+                                return Lookup::Absent;
+                        }
+                        cur = &it->second;
+                }
+                res = cur;
+                return Lookup::Found;
+        }
+}
+
+namespace {
+        using Sources = std::vector<std::pair<std::string, util::FileStamp>>;
+
+        // Written first in a startup cache. It is followed by the path,
+        // size, inode, modification and change time of every file the
+        // tree was read from, the configuration file first, and then the
+        // encoded tree.
+        struct CacheHeader {
+                char magic[8];
+                std::uint32_t version;
+                std::uint32_t sourceCount;
+                // Hash of the contents of all files
+                std::uint64_t hash;
+        };
+
+        struct CacheSource {
+                std::uint64_t size;
+                std::uint64_t inode;
+                std::int64_t mtime;
+                std::int64_t ctime;
+                std::uint32_t pathLength;
+        };
+
+        constexpr char cacheMagic[8] = {'c', 'f', 'g', 'c', 'a', 'c', 'h', 'e'};
+        constexpr std::uint32_t cacheVersion = 3;
+        // A file modified this recently might be modified again
+        // without its mtime changing, it is not cached until it has
+        // settled. The ctime can't be set back like the mtime, a file
+        // replaced after the cache was written has a different one.
+        constexpr std::int64_t racyNanoseconds = 2000000000;
+
+        // The cache for "dir/app.json" is "dir/.app.json.cache"
+        std::string cacheFileName(std::string const& fileName) {
+                auto slash = fileName.rfind('/');
+                if (slash == std::string::npos) {
+                        return "." + fileName + ".cache";
+                }
+                return fileName.substr(0, slash + 1) + "." + fileName.substr(slash + 1) + ".cache";
+        }
+
+        // Decode the startup cache of `fileName` if none of the files it
+        // was written for changed since. Any problem with the cache just
+        // means we have to parse the files.
+        std::shared_ptr<json::Object const> loadCache(std::string const& fileName, Sources& sources, std::uint64_t& hash) {
+                try {
+                        util::MappedFile cache{cacheFileName(fileName)};
+                        char const* pos = cache.data();
+                        char const* end = cache.data() + cache.size();
+                        CacheHeader header;
+                        if (cache.size() < sizeof(header)) {
+                                return nullptr;
+                        }
+                        std::memcpy(&header, pos, sizeof(header));
+                        pos += sizeof(header);
+                        if (std::memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) != 0
+                            || header.version != cacheVersion || header.sourceCount == 0) {
+                                return nullptr;
+                        }
+                        Sources res;
+                        for (std::uint32_t i = 0; i < header.sourceCount; ++i) {
+                                CacheSource source;
+                                if (static_cast<std::size_t>(end - pos) < sizeof(source)) {
+                                        return nullptr;
+                                }
+                                std::memcpy(&source, pos, sizeof(source));
+                                pos += sizeof(source);
+                                if (static_cast<std::size_t>(end - pos) < source.pathLength) {
+                                        return nullptr;
+                                }
+                                std::string path{pos, source.pathLength};
+                                pos += source.pathLength;
+                                if (i == 0 && path != fileName) {
+                                        return nullptr;
+                                }
+                                util::FileStamp stamp = util::stamp(path);
+                                if (stamp.size != source.size || stamp.inode != source.inode ||
+                                    stamp.mtime != source.mtime || stamp.ctime != source.ctime) {
+                                        return nullptr;
+                                }
+                                res.emplace_back(std::move(path), stamp);
+                        }
+                        auto root = std::make_shared<json::Object>(json::binary::decode(pos, end - pos));
+                        sources = std::move(res);
+                        hash = header.hash;
+                        return root;
+                } catch (std::exception const&) {
+                        return nullptr;
+                }
         }
-        // TODO: doing this in bulk would be better, find how, also,
-        // presize the string from the file size.
-        std::string contents;
-        char ch;
-        while (f.get(ch)) {
-                contents.push_back(ch);
+
+        // Write the startup cache for `fileName`, `sources` holds what
+        // the files looked like before they were read. Failing to write
+        // the cache is not a error, the next start just parses again.
+        void storeCache(std::string const& fileName, Sources const& sources, json::Object const& root, std::uint64_t hash) {
+                try {
+                        auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                std::chrono::system_clock::now().time_since_epoch()).count();
+                        CacheHeader header{};
+                        std::memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+                        header.version = cacheVersion;
+                        header.sourceCount = static_cast<std::uint32_t>(sources.size());
+                        header.hash = hash;
+                        std::string contents{reinterpret_cast<char const*>(&header), sizeof(header)};
+                        for (auto const& source : sources) {
+                                util::FileStamp const& stamp = source.second;
+                                if (now - stamp.mtime < racyNanoseconds ||
+                                    util::stamp(source.first) != stamp) {
+                                        return;
+                                }
+                                CacheSource s{stamp.size, stamp.inode, stamp.mtime, stamp.ctime,
+                                              static_cast<std::uint32_t>(source.first.size())};
+                                contents.append(reinterpret_cast<char const*>(&s), sizeof(s));
+                                contents += source.first;
+                        }
+                        contents += json::binary::encode(root);
+                        util::writeFileAtomically(cacheFileName(fileName), contents);
+                } catch (std::exception const&) {
+                }
         }
+
+        // `fileName` resolved to a path that is the same for every way
+        // of naming the file, used to find include cycles.
+        std::string canonical(std::string const& fileName) {
+                std::unique_ptr<char, decltype(&std::free)> res{::realpath(fileName.c_str(), nullptr), &std::free};
+                return res ? std::string{res.get()} : fileName;
+        }
+
+        // `include` as given in `fileName`, relative to the directory of
+        // `fileName` unless it is absolute.
+        std::string resolveInclude(std::string const& fileName, std::string const& include) {
+                auto slash = fileName.rfind('/');
+                if (include.empty() || include.front() == '/' || slash == std::string::npos) {
+                        return include;
+                }
+                return fileName.substr(0, slash + 1) + include;
+        }
+
+        // The files listed under "#include" in `root`, which is removed
+        // from `root`.
+        std::vector<std::string> takeIncludes(std::string const& fileName, json::Object& root) {
+                std::vector<std::string> res;
+                if (!root.is<json::Obj>()) {
+                        return res;
+                }
+                json::Obj& obj = root.into<json::Obj&>();
+                auto it = obj.find(std::string_view{"#include"});
+                if (it == obj.end()) {
+                        return res;
+                }
+                if (it->second.is<json::Str>()) {
+                        res.push_back(resolveInclude(fileName, it->second.into<json::Str const&>()));
+                } else if (it->second.is<json::Arr>()) {
+                        for (auto const& include : it->second.into<json::Arr const&>()) {
+                                if (!include.is<json::Str>()) {
+                                        throw ConfigError{util::format("\"#include\" in `", fileName, "' must only list file names")};
+                                }
+                                res.push_back(resolveInclude(fileName, include.into<json::Str const&>()));
+                        }
+                } else {
+                        throw ConfigError{util::format("\"#include\" in `", fileName, "' must be a file name or a list of them")};
+                }
+                obj.erase(it);
+                return res;
+        }
+}
+
+json::Object Config::loadTree(std::string const& fileName, std::vector<std::string> chain, Sources& sources,
+                              std::uint64_t& hash) {
+        std::string path = canonical(fileName);
+        if (std::find(chain.begin(), chain.end(), path) != chain.end()) {
+                throw ConfigError{util::format("`", fileName, "' includes itself")};
+        }
+        chain.push_back(path);
+
+        util::FileStamp stamp;
+        try {
+                stamp = util::stamp(fileName);
+        } catch (util::IOError const& e) {
+                throw ConfigError{util::format("Can't open configuration file `", fileName, "': ", e.what())};
+        }
+        std::string contents = readContents(fileName);
+        sources.emplace_back(fileName, stamp);
+        hash = util::hash(contents);
         // this can throw
-        cfg = json::Parser::parse(contents);
+        json::Object root = json::Parser::parse(contents);
+        std::vector<std::string> includes = takeIncludes(fileName, root);
+        if (includes.empty()) {
+                return root;
+        }
+
+        // Every include is loaded on its own thread, nested includes
+        // fan out further, so loading takes about as long as the
+        // slowest chain of files.
+        struct Include {
+                Sources sources;
+                std::uint64_t hash{0};
+                std::future<json::Object> tree;
+        };
+        std::vector<Include> loads(includes.size());
+        for (std::size_t i = 0; i < includes.size(); ++i) {
+                Include& load = loads[i];
+                load.tree = std::async(std::launch::async, [&load, &chain, include = includes[i]]() {
+                        return loadTree(include, chain, load.sources, load.hash);
+                });
+        }
+        // Wait for everything before throwing so that no thread is
+        // left using `loads`.
+        for (auto& load : loads) {
+                load.tree.wait();
+        }
+        json::Object merged;
+        for (auto& load : loads) {
+                deepMerge(merged, load.tree.get());
+                sources.insert(sources.end(), load.sources.begin(), load.sources.end());
+                hash = (hash ^ load.hash) * 1099511628211ull;
+        }
+        deepMerge(merged, root);
+        return merged;
+}
+
+Config::Layer Config::readLayer(std::string const& name, std::string const& fileName) {
+        Layer layer{name, nullptr, fileName, 0};
+        Sources sources;
+        layer.root = loadCache(fileName, sources, layer.contentHash);
+        if (!layer.root) {
+                sources.clear();
+                layer.root = std::make_shared<json::Object>(loadTree(fileName, {}, sources, layer.contentHash));
+                storeCache(fileName, sources, *layer.root, layer.contentHash);
+        }
+        for (std::size_t i = 1; i < sources.size(); ++i) {
+                layer.includes.push_back(sources[i].first);
+        }
+        return layer;
 }
 
-Config::Config(json::Object const& obj) {
-        cfg = obj;
+Config::Config(std::string const& fileName)
+        : current{makeSnapshot(nullptr, 0)}, layers{readLayer(fileName, fileName)} {
+        current.publish(makeSnapshot(layers.front().root, 0));
+}
+
+Config::Config(json::Object const& obj)
+        : current{makeSnapshot(nullptr, 0)}, layers{{"base", std::make_shared<json::Object>(obj)}} {
+        current.publish(makeSnapshot(layers.front().root, 0));
+}
+
+Config::Config(json::DocumentPtr const& doc)
+        : current{makeSnapshot(nullptr, 0)},
+          layers{{doc->path, std::shared_ptr<json::Object const>{doc, &doc->root}, doc->path, doc->hash}} {
+        current.publish(makeSnapshot(layers.front().root, 0));
+}
+
+Config::Config() : Config(json::Object{}) {}
+
+Config::Config(Config const& other) : current{makeSnapshot(nullptr, 0)} {
+        std::lock_guard<std::mutex> lock{other.writer};
+        layers = other.layers;
+        current.publish(makeSnapshot(other.snapshot(), 0));
+}
+
+Config& Config::operator=(Config const& other) {
+        if (this != &other) {
+                unwatch();
+                std::shared_ptr<json::Object const> root;
+                std::vector<Layer> copy;
+                {
+                        std::lock_guard<std::mutex> lock{other.writer};
+                        root = other.snapshot();
+                        copy = other.layers;
+                }
+                std::lock_guard<std::mutex> lock{writer};
+                layers = std::move(copy);
+                publish(root);
+        }
+        return *this;
+}
+
+Config::~Config() {
+        unwatch();
+}
+
+Config Config::cached(std::string const& fileName) {
+        try {
+                auto doc = json::DocumentCache::instance().get(fileName);
+                if (doc->root.is<json::Obj>() && doc->root.into<json::Obj const&>().count(std::string_view{"#include"})) {
+                        // The cached tree is the file on its own, the
+                        // includes have to be merged in.
+                        return Config{fileName};
+                }
+                return Config{doc};
+        } catch (util::IOError const& e) {
+                throw ConfigError{util::format("Can't open configuration file `", fileName, "': ", e.what())};
+        }
 }
 
 json::Object const& Config::toJson() const {
-        return cfg;
+        return *current.read()->root;
+}
+
+std::shared_ptr<json::Object const> Config::snapshot() const {
+        return current.read()->root;
+}
+
+std::uint64_t Config::generation() const {
+        return current.read()->generation;
+}
+
+json::MemoryUsage Config::memoryUsage() const {
+        return current.read()->root->memoryUsage();
+}
+
+void Config::publish(std::shared_ptr<json::Object const> root) {
+        std::uint64_t generation;
+        {
+                auto snapshot = current.read();
+                generation = snapshot->generation + 1;
+                if (!watching) {
+                        retired.clear();
+                }
+                retired.push_back(snapshot->root);
+        }
+        current.publish(makeSnapshot(std::move(root), generation));
+        latest.store(generation, std::memory_order_release);
+}
+
+bool Config::update(std::function<bool(json::Object&)> const& change, json::Path const* changed /* = nullptr */) {
+        std::lock_guard<std::mutex> lock{writer};
+        Layer& top = layers.back();
+        auto before = top.root;
+        auto root = std::make_shared<json::Object>(*before);
+        bool res = change(*root);
+        top.root = std::move(root);
+        if (changed) {
+                pathsChanged({*changed});
+        } else {
+                layersChanged({{before.get(), top.root.get()}});
+        }
+        return res;
+}
+
+void Config::modify(std::function<void(json::Object&)> const& change) {
+        update([&](json::Object& root) {
+                change(root);
+                return true;
+        });
+}
+
+std::vector<Config::Layer>::iterator Config::findLayer(std::string const& name) {
+        auto it = std::find_if(layers.begin(), layers.end(), [&](Layer const& l) { return l.name == name; });
+        if (it == layers.end()) {
+                throw ConfigError{util::format("No configuration layer named `", name, "'")};
+        }
+        return it;
+}
+
+void Config::remerge(json::Object& merged, json::Path const& path) const {
+        json::Object value;
+        for (auto const& layer : layers) {
+                json::Object const* found{nullptr};
+                switch (lookup(*layer.root, path, found)) {
+                case Lookup::Absent:
+                        break;
+                case Lookup::Hidden:
+                        value = json::Object{};
+                        break;
+                case Lookup::Found:
+                        deepMerge(value, *found);
+                        break;
+                }
+        }
+
+        if (path.empty()) {
+                merged = value;
+                return;
+        }
+        json::Object* parent = &merged;
+        for (auto it = path.begin(); it != path.end() - 1; ++it) {
+                if (!parent->is<json::Obj>()) {
+                        // Hidden by a value that isn't a object, no
+                        // layer can have anything at `path`.
+                        return;
+                }
+                auto& obj = parent->into<json::Obj&>();
+                auto child = obj.find(*it);
+                if (child == obj.end()) {
+                        if (value.blank()) {
+                                return;
+                        }
+                        child = obj.emplace(*it, json::Obj{}).first;
+                }
+                parent = &child->second;
+        }
+        if (!parent->is<json::Obj>()) {
+                return;
+        }
+        auto& obj = parent->into<json::Obj&>();
+        if (value.blank()) {
+                obj.erase(path.back());
+        } else {
+                obj[path.back()] = std::move(value);
+        }
+}
+
+void Config::layersChanged(std::vector<std::pair<json::Object const*, json::Object const*>> const& changes) {
+        if (layers.size() == 1) {
+                // Nothing to merge, share the tree of the layer
+                publish(layers.front().root);
+                return;
+        }
+        std::vector<json::Path> paths;
+        json::Path prefix;
+        for (auto const& change : changes) {
+                changedPaths(*change.first, *change.second, prefix, paths);
+        }
+        pathsChanged(paths);
+}
+
+void Config::pathsChanged(std::vector<json::Path> const& paths) {
+        if (layers.size() == 1) {
+                publish(layers.front().root);
+                return;
+        }
+        if (paths.empty()) {
+                return;
+        }
+        auto merged = std::make_shared<json::Object>(*current.read()->root);
+        for (auto const& path : paths) {
+                remerge(*merged, path);
+        }
+        publish(std::move(merged));
+}
+
+void Config::pushLayer(std::string const& name, json::Object const& root) {
+        std::lock_guard<std::mutex> lock{writer};
+        if (std::any_of(layers.begin(), layers.end(), [&](Layer const& l) { return l.name == name; })) {
+                throw ConfigError{util::format("There already is a configuration layer named `", name, "'")};
+        }
+        layers.push_back(Layer{name, std::make_shared<json::Object>(root)});
+        json::Object empty{json::Obj{}};
+        layersChanged({{&empty, layers.back().root.get()}});
+}
+
+void Config::pushFileLayer(std::string const& name, std::string const& fileName) {
+        Layer layer = readLayer(name, fileName);
+        {
+                std::lock_guard<std::mutex> lock{writer};
+                if (std::any_of(layers.begin(), layers.end(), [&](Layer const& l) { return l.name == name; })) {
+                        throw ConfigError{util::format("There already is a configuration layer named `", name, "'")};
+                }
+                layers.push_back(std::move(layer));
+                json::Object empty{json::Obj{}};
+                layersChanged({{&empty, layers.back().root.get()}});
+        }
+        rewatch();
+}
+
+void Config::setLayer(std::string const& name, json::Object const& root) {
+        std::lock_guard<std::mutex> lock{writer};
+        auto layer = findLayer(name);
+        auto before = layer->root;
+        layer->root = std::make_shared<json::Object>(root);
+        layersChanged({{before.get(), layer->root.get()}});
+}
+
+void Config::removeLayer(std::string const& name) {
+        bool hadFile;
+        {
+                std::lock_guard<std::mutex> lock{writer};
+                auto layer = findLayer(name);
+                if (layers.size() == 1) {
+                        throw ConfigError{"Can't remove the only configuration layer"};
+                }
+                auto before = layer->root;
+                hadFile = !layer->fileName.empty();
+                layers.erase(layer);
+                json::Object empty{json::Obj{}};
+                layersChanged({{before.get(), &empty}});
+        }
+        if (hadFile) {
+                rewatch();
+        }
+}
+
+std::vector<std::string> Config::layerNames() const {
+        std::lock_guard<std::mutex> lock{writer};
+        std::vector<std::string> res;
+        for (auto const& layer : layers) {
+                res.push_back(layer.name);
+        }
+        return res;
+}
+
+std::shared_ptr<json::Object const> Config::layer(std::string const& name) const {
+        std::lock_guard<std::mutex> lock{writer};
+        for (auto const& layer : layers) {
+                if (layer.name == name) {
+                        return layer.root;
+                }
+        }
+        throw ConfigError{util::format("No configuration layer named `", name, "'")};
+}
+
+std::vector<std::string> Config::files() const {
+        std::vector<std::string> res;
+        for (auto const& layer : layers) {
+                if (!layer.fileName.empty()) {
+                        res.push_back(layer.fileName);
+                        res.insert(res.end(), layer.includes.begin(), layer.includes.end());
+                }
+        }
+        return res;
+}
+
+std::vector<std::string> Config::watchedFiles() const {
+        std::lock_guard<std::mutex> lock{writer};
+        return files();
+}
+
+bool Config::reload() {
+        std::lock_guard<std::mutex> lock{writer};
+        // Read everything before changing anything so that a broken
+        // file leaves all layers as they were.
+        std::vector<std::pair<Layer*, Layer>> fresh;
+        bool anyFile{false};
+        for (auto& layer : layers) {
+                if (layer.fileName.empty()) {
+                        continue;
+                }
+                anyFile = true;
+                Sources sources;
+                std::uint64_t hash;
+                // this can throw, the old trees are kept if it does
+                json::Object root = loadTree(layer.fileName, {}, sources, hash);
+                if (hash == layer.contentHash) {
+                        continue;
+                }
+                Layer changed{layer.name, std::make_shared<json::Object>(std::move(root)), layer.fileName, hash};
+                for (std::size_t i = 1; i < sources.size(); ++i) {
+                        changed.includes.push_back(sources[i].first);
+                }
+                storeCache(layer.fileName, sources, *changed.root, hash);
+                fresh.emplace_back(&layer, std::move(changed));
+        }
+        if (!anyFile) {
+                throw ConfigError{"Can't reload a configuration that wasn't read from a file"};
+        }
+        if (fresh.empty()) {
+                return false;
+        }
+        std::vector<std::shared_ptr<json::Object const>> before;
+        std::vector<std::pair<json::Object const*, json::Object const*>> changes;
+        for (auto& f : fresh) {
+                before.push_back(f.first->root);
+                *f.first = std::move(f.second);
+                changes.emplace_back(before.back().get(), f.first->root.get());
+        }
+        layersChanged(changes);
+        return true;
+}
+
+void Config::watch(std::function<void(std::exception_ptr)> onError /* = nullptr */) {
+        std::vector<std::string> fileNames = watchedFiles();
+        if (fileNames.empty()) {
+                throw ConfigError{"Can't watch a configuration that wasn't read from a file"};
+        }
+        unwatch();
+        {
+                std::lock_guard<std::mutex> lock{writer};
+                watching = true;
+        }
+        onWatchError = onError;
+        watcher = util::make_unique<Watcher>(*this, fileNames, onError);
+}
+
+void Config::rewatch() {
+        if (!watcher) {
+                return;
+        }
+        // The watcher thread takes `writer` when it reloads, it must
+        // not be held while we wait for the thread to stop.
+        stopWatcher();
+        std::vector<std::string> fileNames = watchedFiles();
+        if (fileNames.empty()) {
+                unwatch();
+        } else {
+                watcher = util::make_unique<Watcher>(*this, fileNames, onWatchError);
+        }
+}
+
+void Config::stopWatcher() {
+        if (watcher && watcher->onOwnThread()) {
+                // Called from `onError`, the thread cleans up once
+                // the callback has returned
+                watcher.release()->detachSelf();
+        }
+        watcher.reset();
+}
+
+void Config::unwatch() {
+        stopWatcher();
+        std::lock_guard<std::mutex> lock{writer};
+        watching = false;
+        if (retired.size() > 1) {
+                retired.erase(retired.begin(), retired.end() - 1);
+        }
 }
 
 Config::Arr const& Config::arr(Path const& p) const {
-	return cfg.get<json::Arr>(p);
+	return current.read()->root->get<json::Arr>(p);
 }
 
 Config::Obj const& Config::obj(Path const& p) const {
-	return cfg.get<json::Obj>(p);
+	return current.read()->root->get<json::Obj>(p);
 }
 
 Config::Str const& Config::str(Path const& p) const {
-	return cfg.get<json::Str>(p);
+	return current.read()->root->get<json::Str>(p);
 }
 
 Config::Bool Config::b(Path const& p) const {
-	return cfg.get<json::Bool>(p);
+	return current.read()->root->get<json::Bool>(p);
 }
 
 Config::Int Config::i(Path const& p) const {
-	return cfg.get<json::Int>(p);
+	return current.read()->root->get<json::Int>(p);
 }
 
 Config::Double Config::dbl(Path const& p) const {
-	return cfg.get<json::Double>(p);
+	return current.read()->root->get<json::Double>(p);
 }
 
+Config::Arr const& Config::arr(PathView p) const {
+	return current.read()->root->get<json::Arr>(p);
+}
 
+Config::Obj const& Config::obj(PathView p) const {
+	return current.read()->root->get<json::Obj>(p);
+}
 
+Config::Str const& Config::str(PathView p) const {
+	return current.read()->root->get<json::Str>(p);
+}
+
+Config::Bool Config::b(PathView p) const {
+	return current.read()->root->get<json::Bool>(p);
+}
+
+Config::Int Config::i(PathView p) const {
+	return current.read()->root->get<json::Int>(p);
+}
+
+Config::Double Config::dbl(PathView p) const {
+	return current.read()->root->get<json::Double>(p);
+}
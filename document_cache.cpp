@@ -0,0 +1,196 @@
+#include "document_cache.h"
+
+#include <chrono>
+#include <exception>
+#include <utility>
+
+namespace json {
+
+MemoryUsage Document::memoryUsage() const {
+        MemoryUsage res = root.memoryUsage();
+        res.overhead += sizeof(Document) - sizeof(Object);
+        if (path.capacity() > std::string{}.capacity()) {
+                res.overhead += path.capacity() + 1;
+        }
+        return res;
+}
+
+DocumentCache::DocumentCache(std::size_t capacity) : cap{capacity} {}
+
+DocumentCache& DocumentCache::instance() {
+        static DocumentCache cache;
+        return cache;
+}
+
+DocumentPtr DocumentCache::load(std::string const& path, std::string contents) {
+        auto doc = std::make_shared<Document>();
+        doc->path = path;
+        doc->hash = util::hash(contents);
+        doc->root = Parser::parse(contents);
+        return doc;
+}
+
+std::shared_ptr<std::promise<DocumentPtr>> DocumentCache::startLoad(Entry& entry) {
+        auto promise = std::make_shared<std::promise<DocumentPtr>>();
+        entry.doc = promise->get_future().share();
+        entry.generation = ++generations;
+        return promise;
+}
+
+DocumentPtr DocumentCache::finishLoad(std::string const& path, std::uint64_t generation, util::FileStamp const& stamp,
+                                      std::promise<DocumentPtr>& promise, std::string contents) {
+        DocumentPtr doc;
+        std::size_t cost{0};
+        try {
+                doc = load(path, std::move(contents));
+                cost = doc->memoryUsage().total();
+        } catch (...) {
+                promise.set_exception(std::current_exception());
+                std::lock_guard<std::mutex> lock{mutex};
+                auto it = entries.find(path);
+                if (it != entries.end() && it->second.generation == generation) {
+                        erase(it);
+                }
+                throw;
+        }
+        promise.set_value(doc);
+        std::lock_guard<std::mutex> lock{mutex};
+        auto it = entries.find(path);
+        if (it != entries.end() && it->second.generation == generation) {
+                Entry& entry = it->second;
+                entry.stamp = stamp;
+                bytes -= entry.cost;
+                entry.cost = cost;
+                bytes += entry.cost;
+                evict();
+        }
+        return doc;
+}
+
+DocumentPtr DocumentCache::get(std::string const& path) {
+        std::unique_lock<std::mutex> lock{mutex};
+        auto it = entries.find(path);
+        if (it == entries.end()) {
+                it = entries.emplace(path, Entry{}).first;
+                lru.push_front(path);
+                it->second.lru = lru.begin();
+                auto promise = startLoad(it->second);
+                std::uint64_t generation = it->second.generation;
+                lock.unlock();
+
+                util::FileStamp stamp;
+                std::string contents;
+                try {
+                        stamp = util::stamp(path);
+                        contents = util::readFile(path);
+                } catch (...) {
+                        promise->set_exception(std::current_exception());
+                        invalidate(path);
+                        throw;
+                }
+                return finishLoad(path, generation, stamp, *promise, std::move(contents));
+        }
+
+        Entry& entry = it->second;
+        touch(entry);
+        std::shared_future<DocumentPtr> doc = entry.doc;
+        util::FileStamp cachedStamp = entry.stamp;
+        std::uint64_t generation = entry.generation;
+        lock.unlock();
+
+        if (doc.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                // Someone else is loading it right now, that load is
+                // as fresh as it gets.
+                return doc.get();
+        }
+        DocumentPtr current = doc.get();
+        util::FileStamp stamp;
+        try {
+                stamp = util::stamp(path);
+        } catch (...) {
+                invalidate(path);
+                throw;
+        }
+        if (stamp == cachedStamp) {
+                return current;
+        }
+
+        // The file has been touched, only parse it again if the
+        // contents actually changed.
+        std::string contents = util::readFile(path);
+        bool changed = util::hash(contents) != current->hash;
+        lock.lock();
+        it = entries.find(path);
+        if (it == entries.end() || it->second.generation != generation) {
+                // Evicted, invalidated or reloaded while we were
+                // looking at the file, try again from the start.
+                lock.unlock();
+                return get(path);
+        }
+        if (!changed) {
+                it->second.stamp = stamp;
+                return current;
+        }
+        auto promise = startLoad(it->second);
+        generation = it->second.generation;
+        lock.unlock();
+        return finishLoad(path, generation, stamp, *promise, std::move(contents));
+}
+
+void DocumentCache::invalidate(std::string const& path) {
+        std::lock_guard<std::mutex> lock{mutex};
+        auto it = entries.find(path);
+        if (it != entries.end()) {
+                erase(it);
+        }
+}
+
+void DocumentCache::clear() {
+        std::lock_guard<std::mutex> lock{mutex};
+        entries.clear();
+        lru.clear();
+        bytes = 0;
+}
+
+void DocumentCache::setCapacity(std::size_t capacity) {
+        std::lock_guard<std::mutex> lock{mutex};
+        cap = capacity;
+        evict();
+}
+
+std::size_t DocumentCache::capacity() const {
+        std::lock_guard<std::mutex> lock{mutex};
+        return cap;
+}
+
+std::size_t DocumentCache::size() const {
+        std::lock_guard<std::mutex> lock{mutex};
+        return bytes;
+}
+
+void DocumentCache::touch(Entry& entry) {
+        lru.splice(lru.begin(), lru, entry.lru);
+}
+
+void DocumentCache::evict() {
+        auto it = lru.end();
+        while (bytes > cap && it != lru.begin()) {
+                --it;
+                auto entry = entries.find(*it);
+                // Entries that are still loading haven't been
+                // accounted for yet and can't be evicted.
+                if (entry->second.cost == 0) {
+                        continue;
+                }
+                it = std::next(it);
+                erase(entry);
+        }
+}
+
+void DocumentCache::erase(std::map<std::string, Entry>::iterator it) {
+        bytes -= it->second.cost;
+        lru.erase(it->second.lru);
+        entries.erase(it);
+}
+
+} /* namespace json */
@@ -0,0 +1,123 @@
+#ifndef BINARY_LOG_H
+#define BINARY_LOG_H
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "logging.h"
+#include "util.h"
+
+namespace logging {
+
+// The format written by BinaryDest. A file is a sequence of blocks
+// that each start with a tag byte:
+//  * 'L' starts a session, followed by "cpplog", a version byte and
+//    the time of the session in nanoseconds since the epoch as 8
+//    bytes. Every BinaryDest starts a session, sites are numbered
+//    anew in each of them.
+//  * 'S' defines a site, the things that are the same for every
+//    message from one logging call: its id, level bits and line as
+//    varints followed by the format, file, function and name of the
+//    logger as varint length prefixed strings.
+//  * 'R' is a message: the id of its site, the nanoseconds since the
+//    previous message as a zigzag varint, since messages of different
+//    threads may go backwards in time, the thread and the length of
+//    the arguments as varints, followed by the arguments.
+// Each argument is a detail::ArgType byte followed by a zigzag varint
+// for Int, a varint for UInt, 8 bytes for Double, a byte for Bool and
+// Char and a varint length and the bytes for Str and Key. A Key is the
+// key of a field and is followed by its value. Numbers are in host
+// byte order.
+
+// Writes messages in the binary format above instead of text, a
+// message then only takes a few bytes more than its arguments. Read
+// the file with BinaryLogReader or the logdecode tool. Messages that
+// weren't logged with the deferred macros are stored as a single
+// string argument.
+class BinaryDest : public Dest {
+public:
+        // Append to `fileName`, throws Error if it can't be opened
+        explicit BinaryDest(std::string const& fileName);
+
+        bool writeRecord(Record const& record) override;
+        // Text written directly is stored as an Info message without
+        // a logger.
+        void write(std::string_view message) override;
+        void flush() override;
+private:
+        // Tells the sites of the deferred macros apart by their
+        // CallSite and those of other messages by file, line and level.
+        struct SiteKey {
+                void const* where;
+                int line;
+                int level;
+
+                bool operator==(SiteKey const& other) const {
+                        return where == other.where && line == other.line && level == other.level;
+                }
+        };
+        struct SiteKeyHash {
+                std::size_t operator()(SiteKey const& key) const;
+        };
+
+        // Id of the site of `record`, defined in the file the first
+        // time it is seen.
+        std::uint32_t siteId(Record const& record);
+        // Append the message block for `record` with its arguments
+        // already encoded in `args` to `out` and write it.
+        void writeMessage(std::uint32_t site, Record const& record, std::string_view args);
+
+        std::ofstream file{};
+        // Blocks are put together here before they are written
+        std::string out;
+        std::string args;
+        std::int64_t lastTime{0};
+        // The sites of a key, one for each logger they were used with
+        std::unordered_map<SiteKey, std::vector<std::pair<std::string, std::uint32_t>>, SiteKeyHash> sites;
+        std::uint32_t nextSite{0};
+};
+
+// Reads back a file written by BinaryDest
+class BinaryLogReader {
+public:
+        // Throws Error if `fileName` can't be read or isn't a binary
+        // log.
+        explicit BinaryLogReader(std::string const& fileName);
+
+        // Read the next message into `record`, gives back false at the
+        // end of the file. `record.site` is set and `msg` left empty,
+        // see renderMessage(). The strings are valid until the next
+        // call. A message that was cut short at the end of the file,
+        // e.g. by a crash while writing it, counts as the end. Throws
+        // Error if the file is corrupt.
+        bool next(Record& record);
+private:
+        struct Site {
+                CallSite site;
+                std::string format;
+                std::string file;
+                std::string func;
+                std::string name;
+        };
+
+        std::unique_ptr<util::MappedFile> contents;
+        char const* begin{nullptr};
+        char const* end{nullptr};
+        std::size_t pos{0};
+        // Sites of the current session by id
+        std::vector<std::unique_ptr<Site>> sites;
+        std::int64_t time{0};
+        // Arguments of the last message, decoded
+        std::string args;
+};
+
+} /* namespace logging */
+
+#endif /* BINARY_LOG_H */
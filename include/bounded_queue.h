@@ -0,0 +1,117 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+namespace util {
+
+// A fixed size queue that any number of threads can push to and pop
+// from without taking a lock, after Dmitry Vyukov's bounded MPMC
+// queue. Every cell carries a sequence number telling whether it is
+// free for the push or the pop that reaches it next, so a push and a
+// pop only contend when they are after the same cell.
+template<typename T>
+class BoundedQueue {
+public:
+        // `capacity` is rounded up to a power of two
+        explicit BoundedQueue(std::size_t capacity) {
+                std::size_t size{2};
+                while (size < capacity) {
+                        size *= 2;
+                }
+                mask = size - 1;
+                cells.reset(new Cell[size]);
+                for (std::size_t i = 0; i < size; ++i) {
+                        cells[i].sequence.store(i, std::memory_order_relaxed);
+                }
+        }
+
+        BoundedQueue(BoundedQueue const&) = delete;
+        BoundedQueue& operator=(BoundedQueue const&) = delete;
+
+        ~BoundedQueue() {
+                T value;
+                while (tryPop(value)) {}
+        }
+
+        // Move `value` into the queue, gives back false and leaves
+        // `value` alone if the queue is full.
+        bool tryPush(T& value) {
+                std::size_t pos = tail.load(std::memory_order_relaxed);
+                Cell* cell;
+                while (true) {
+                        cell = &cells[pos & mask];
+                        std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+                        auto diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+                        if (diff == 0) {
+                                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                                        break;
+                                }
+                        } else if (diff < 0) {
+                                return false;
+                        } else {
+                                pos = tail.load(std::memory_order_relaxed);
+                        }
+                }
+                new (&cell->storage) T(std::move(value));
+                cell->sequence.store(pos + 1, std::memory_order_release);
+                return true;
+        }
+
+        // Move the oldest value into `value`, gives back false if the
+        // queue is empty.
+        bool tryPop(T& value) {
+                std::size_t pos = head.load(std::memory_order_relaxed);
+                Cell* cell;
+                while (true) {
+                        cell = &cells[pos & mask];
+                        std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+                        auto diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1);
+                        if (diff == 0) {
+                                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                                        break;
+                                }
+                        } else if (diff < 0) {
+                                return false;
+                        } else {
+                                pos = head.load(std::memory_order_relaxed);
+                        }
+                }
+                T* stored = std::launder(reinterpret_cast<T*>(&cell->storage));
+                value = std::move(*stored);
+                stored->~T();
+                cell->sequence.store(pos + mask + 1, std::memory_order_release);
+                return true;
+        }
+
+        // Is there nothing to pop right now? Only a hint while other
+        // threads push or pop.
+        bool empty() const {
+                std::size_t pos = head.load(std::memory_order_seq_cst);
+                return cells[pos & mask].sequence.load(std::memory_order_seq_cst) != pos + 1;
+        }
+
+        std::size_t capacity() const { return mask + 1; }
+private:
+        struct Cell {
+                std::atomic<std::size_t> sequence;
+                typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+        };
+
+        std::unique_ptr<Cell[]> cells;
+        std::size_t mask;
+        // Kept on separate cache lines so that pushing and popping
+        // threads don't slow each other down.
+        alignas(64) std::atomic<std::size_t> tail{0};
+        alignas(64) std::atomic<std::size_t> head{0};
+};
+
+} /* namespace util */
+
+#endif /* BOUNDED_QUEUE_H */
@@ -2,18 +2,53 @@
 #define CONFIG_H
 
 #include <stdexcept>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <exception>
+#include <cstdint>
+#include <atomic>
+#include <vector>
+#include <utility>
 #include "json.h"
 #include "json_unstructured.h"
+#include "document_cache.h"
+#include "rcu.h"
 
 struct ConfigError : std::runtime_error::runtime_error {
         using std::runtime_error::runtime_error;
 };
 
 // Use to read config files that are in JSON format, a simple wrapper
-// around JsonUnstructured.
+// around JsonUnstructured. Copying a Config is cheap, copies share the
+// parsed tree until one of them is changed with addProperty().
+//
+// The tree is never modified once it has been published, changes made
+// by addProperty() or by reloading the file build a new tree which is
+// then swapped in atomically. Readers never take a lock and always see
+// a complete tree. References handed out by the accessors and toJson()
+// stay valid through the next change, the tree they point into is only
+// freed by the change after that. While a Config is watched no tree is
+// freed before unwatch(), since reloads can happen at any time. Use
+// snapshot() or bind() to keep a tree alive for longer.
+//
+// A configuration file can pull in other files with a "#include" key
+// holding a file name or a list of them, relative to the including
+// file. The included files are loaded concurrently and merged in the
+// order they are listed, the contents of the including file go on top.
+// Includes may nest but not form a cycle.
+//
+// A Config is made up of a ordered set of layers, e.g. built in
+// defaults, a site file, a host file and runtime overrides. Values in
+// later layers take precedence, objects that exist in several layers
+// are merged. The merged tree is what readers see, it is kept up to
+// date when a layer changes by merging only the paths that differ
+// between the old and new contents of that layer.
 class Config {
+        struct Snapshot;
 public:
         using Path = json::Path;
+        using PathView = json::PathView;
         using Arr = json::Arr;
         using Obj = json::Obj;
         using Str = json::Str;
@@ -21,9 +56,25 @@ public:
         using Int = json::Int;
         using Double = json::Double;
         
+        // Read `fileName`. The parsed tree is cached in binary form in
+        // ".<name>.cache" next to the file, later starts decode the
+        // cache instead of parsing as long as the size, inode, mtime and
+        // ctime of the file still match.
         Config(std::string const& fileName);
         Config(json::Object const& obj);
-        Config() = default;
+        // Use the tree of a document from a DocumentCache without
+        // copying it.
+        Config(json::DocumentPtr const& doc);
+        Config();
+        // Copies share the trees but not the watching of the files.
+        Config(Config const& other);
+        Config& operator=(Config const& other);
+        ~Config();
+
+        // Create a Config from `fileName` through
+        // json::DocumentCache::instance(), every Config created this
+        // way for the same unchanged file shares one parsed tree.
+        static Config cached(std::string const& fileName);
         
         Arr const& arr(Path const& p) const;
         Obj const& obj(Path const& p) const;
@@ -31,20 +82,206 @@ public:
         Bool b(Path const& p) const;
         Int i(Path const& p) const;
         Double dbl(Path const& p) const;
+        // Same as above, picked for braced lists of keys such as
+        // cfg.i({"server", "port"}), no strings are created for the
+        // lookup.
+        Arr const& arr(PathView p) const;
+        Obj const& obj(PathView p) const;
+        Str const& str(PathView p) const;
+        Bool b(PathView p) const;
+        Int i(PathView p) const;
+        Double dbl(PathView p) const;
 
         json::Object const& toJson() const;
 
-        // Add a property to this configuration, if the key, value
-        // pair didn't exist before, true is returned, otherwise false
-        // is returned and the old value is overwritten.
+        // The current tree, stays alive for as long as it is held on
+        // to even if the configuration changes.
+        std::shared_ptr<json::Object const> snapshot() const;
+        // Increased every time a new tree is published.
+        std::uint64_t generation() const;
+
+        // Put `root` on top of the existing layers. Throws ConfigError
+        // if there already is a layer called `name`.
+        void pushLayer(std::string const& name, json::Object const& root);
+        // Same as pushLayer() but with the contents of `fileName`, the
+        // layer is included in reload() and watch().
+        void pushFileLayer(std::string const& name, std::string const& fileName);
+        // Replace the contents of the layer `name`. Throws ConfigError
+        // if there is no such layer.
+        void setLayer(std::string const& name, json::Object const& root);
+        void removeLayer(std::string const& name);
+        // Names of the layers, lowest precedence first. Layers created
+        // by the constructors are named after their file, or "base".
+        std::vector<std::string> layerNames() const;
+        // The contents of the layer `name` on its own.
+        std::shared_ptr<json::Object const> layer(std::string const& name) const;
+
+        // Read the files of all file layers again and publish the
+        // result if the contents of any of them changed, which is what
+        // true is returned for. Throws ConfigError if there are no
+        // files and ParseError if the new contents aren't valid, in
+        // which case the old configuration is kept.
+        bool reload();
+        // Watch the files of all file layers with inotify and reload()
+        // on a background thread when they change. Errors while
+        // reloading are given to `onError` if it is set. Throws
+        // ConfigError if there is no file to watch.
+        void watch(std::function<void(std::exception_ptr)> onError = nullptr);
+        // Stop watching, waits for a ongoing reload to finish. May be
+        // called from `onError`, which runs on the watcher thread.
+        void unwatch();
+
+        // Memory used by the configuration tree. The tree might be
+        // shared with copies of this Config or a DocumentCache.
+        json::MemoryUsage memoryUsage() const;
+
+        // A value in a Config that has been looked up once. Reading it
+        // only costs checking if the Config has changed since the
+        // last read, in which case the path is looked up again. Create
+        // with Config::bind(), the Config must outlive the Bound.
+        // A Bound caches what it looked up and must not be used by
+        // several threads at once, give each thread its own copy.
+        template<typename T>
+        class Bound {
+        public:
+                // The current value. Throws like the accessors of
+                // Config if the path no longer leads to a `T` after a
+                // change. The reference is valid until the next call.
+                T const& get() const {
+                        if (cfg->latest.load(std::memory_order_acquire) != generation) {
+                                resolve();
+                        }
+                        return *value;
+                }
+
+                T const& operator*() const { return get(); }
+                T const* operator->() const { return &get(); }
+        private:
+                friend class Config;
+                Bound(Config const& cfg, Path path) : cfg{&cfg}, path{std::move(path)} {
+                        resolve();
+                }
+
+                void resolve() const {
+                        auto snapshot = cfg->current.read();
+                        // Holding on to the tree keeps `value` valid
+                        // even after the Config has moved on.
+                        T const* res = &snapshot->root->template get<T>(path);
+                        root = snapshot->root;
+                        value = res;
+                        generation = snapshot->generation;
+                }
+
+                Config const* cfg;
+                Path path;
+                mutable std::shared_ptr<json::Object const> root{};
+                mutable T const* value{nullptr};
+                mutable std::uint64_t generation{0};
+        };
+
+        // Look up `path` once and give back a handle that reads the
+        // value directly, see Bound. Throws if the path doesn't lead
+        // to a `T`.
+        template<typename T>
+        Bound<T> bind(Path path) const {
+                return Bound<T>{*this, std::move(path)};
+        }
+
+        // Add a property to the top layer of this configuration, if
+        // the key, value pair didn't exist before, true is returned,
+        // otherwise false is returned and the old value is overwritten.
         template<typename T>
         bool addProperty(Path const& path, std::string const& key, T const& value, typename std::enable_if<std::is_convertible<T, json::Object>::value>::type* = 0) {
                 json::Property prop{key, json::Object{value}};
-                return cfg.addProperty(path, prop);
+                Path changed{path};
+                changed.push_back(key);
+                return update([&](json::Object& root) { return root.addProperty(path, prop); }, &changed);
         }
+
+        // Change the top layer with `change`, which is given a copy of
+        // it. Every addProperty() copies the layer and publishes a new
+        // tree, make many changes at once through here instead.
+        void modify(std::function<void(json::Object&)> const& change);
         
 private:
-        json::Object cfg;
+        struct Snapshot {
+                std::shared_ptr<json::Object const> root;
+                std::uint64_t generation;
+        };
+        class Watcher;
+
+        struct Layer {
+                std::string name;
+                std::shared_ptr<json::Object const> root;
+                // File the layer was read from, if any, and the hash
+                // of what we last read from it.
+                std::string fileName{};
+                std::uint64_t contentHash{0};
+                // Files pulled in by "#include", directly or not
+                std::vector<std::string> includes{};
+        };
+        using Sources = std::vector<std::pair<std::string, util::FileStamp>>;
+
+        static std::unique_ptr<Snapshot const> makeSnapshot(std::shared_ptr<json::Object const> root, std::uint64_t generation);
+        // Read the contents of `fileName`
+        static std::string readContents(std::string const& fileName);
+        // Create a layer from the contents of `fileName`
+        static Layer readLayer(std::string const& name, std::string const& fileName);
+        // Read and parse `fileName` and everything it includes, with
+        // the includes merged in. `chain` holds the files that include
+        // `fileName`. Every file read is added to `sources` together
+        // with its stamp from before it was read, `hash` covers the
+        // contents of all of them.
+        static json::Object loadTree(std::string const& fileName, std::vector<std::string> chain, Sources& sources,
+                                     std::uint64_t& hash);
+        // Copy the top layer, let `change` modify the copy and then
+        // publish it. Gives back what `change` gave back. If `changed`
+        // is set it is the only path `change` touched, otherwise the
+        // old and new layer are compared to find out.
+        bool update(std::function<bool(json::Object&)> const& change, json::Path const* changed = nullptr);
+        // Publish `root` as the current tree and keep the one it
+        // replaces in `retired`, `writer` must be held.
+        void publish(std::shared_ptr<json::Object const> root);
+        // Find the layer called `name`, throws ConfigError if there is
+        // none. `writer` must be held.
+        std::vector<Layer>::iterator findLayer(std::string const& name);
+        // Publish a new merged tree after some layers changed,
+        // `changes` holds the old and new contents of each of them, a
+        // removed layer counts as having become empty. Only the paths
+        // that differ are merged again. `writer` must be held.
+        void layersChanged(std::vector<std::pair<json::Object const*, json::Object const*>> const& changes);
+        // Same as above for changes to known `paths`.
+        void pathsChanged(std::vector<json::Path> const& paths);
+        // Merge `path` again from all layers and store the result in
+        // `merged`.
+        void remerge(json::Object& merged, json::Path const& path) const;
+        // Files of all file layers and the files they include,
+        // `writer` must be held.
+        std::vector<std::string> files() const;
+        // Same as files() but takes `writer` itself.
+        std::vector<std::string> watchedFiles() const;
+        // Start watching files() again if we are watching.
+        void rewatch();
+        // Stop the watcher thread, or let it stop by itself when
+        // called from it.
+        void stopWatcher();
+
+        util::Rcu<Snapshot> current;
+        // Generation of the latest published tree, lets Bound check
+        // for changes without entering the Rcu.
+        std::atomic<std::uint64_t> latest{0};
+        // Trees replaced by publish() that references might still point
+        // into, the last one or all of them while `watching`. Both are
+        // guarded by `writer`.
+        std::vector<std::shared_ptr<json::Object const>> retired{};
+        bool watching{false};
+        // Serializes everything that publishes a new tree and guards
+        // `layers`
+        mutable std::mutex writer;
+        // Lowest precedence first, never empty
+        std::vector<Layer> layers;
+        std::unique_ptr<Watcher> watcher;
+        std::function<void(std::exception_ptr)> onWatchError{};
 };
 
 #endif /* CONFIG_H */
@@ -0,0 +1,112 @@
+#ifndef DOCUMENT_CACHE_H
+#define DOCUMENT_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "json_unstructured.h"
+#include "util.h"
+
+namespace json {
+
+// A parsed JSON file as handed out by DocumentCache. Documents are
+// shared between everyone that asked for the same path and are never
+// modified after they have been loaded, copy `root` if you need to
+// change it.
+struct Document {
+        // Path the document was loaded from
+        std::string path;
+        Object root;
+        // Hash of the file contents that `root` was parsed from
+        std::uint64_t hash{0};
+
+        // Memory used by the document, the tree and our own
+        // bookkeeping.
+        MemoryUsage memoryUsage() const;
+};
+
+using DocumentPtr = std::shared_ptr<Document const>;
+
+// Process wide cache of parsed JSON files, keyed by path. Every get()
+// revalidates the cached document by stat'ing the file, if the stamp
+// changed the file is read and hashed and only parsed again if the
+// contents differ. Loading happens outside the cache lock, threads
+// asking for a path that is currently being loaded wait for that load
+// instead of parsing the file themselves. When the documents use more
+// than `capacity` bytes the least recently used ones are dropped from
+// the cache, they stay alive for as long as someone holds on to them.
+class DocumentCache {
+public:
+        explicit DocumentCache(std::size_t capacity = 64 * 1024 * 1024);
+
+        DocumentCache(DocumentCache const&) = delete;
+        DocumentCache& operator=(DocumentCache const&) = delete;
+
+        // Retrieve the document for `path`, loading it if it isn't
+        // cached or if it changed on disk. Throws util::IOError if the
+        // file can't be read and ParseError if it isn't valid JSON.
+        DocumentPtr get(std::string const& path);
+
+        // Forget about `path`, the next get() will load it again.
+        void invalidate(std::string const& path);
+        // Forget about everything.
+        void clear();
+
+        // Change how many bytes the cached documents may use, evicting
+        // documents if needed.
+        void setCapacity(std::size_t capacity);
+        std::size_t capacity() const;
+        // Number of bytes currently accounted to cached documents
+        std::size_t size() const;
+
+        // The cache used by Config::cached() and anyone else that
+        // wants to share documents within the process.
+        static DocumentCache& instance();
+private:
+        struct Entry {
+                std::shared_future<DocumentPtr> doc;
+                // Bumped every time a new load is started so that a
+                // finished load can tell if it still is the current
+                // one.
+                std::uint64_t generation{0};
+                // Stamp of the file when `doc` was last validated
+                util::FileStamp stamp{};
+                // Bytes used by `doc` as given by memoryUsage(), 0
+                // while loading
+                std::size_t cost{0};
+                std::list<std::string>::iterator lru;
+        };
+
+        // Read, hash and parse `path`.
+        static DocumentPtr load(std::string const& path, std::string contents);
+        // Start loading `path` into `entry`, must be called with the
+        // mutex held. Gives back the promise that the caller has to
+        // fulfil without holding the mutex.
+        std::shared_ptr<std::promise<DocumentPtr>> startLoad(Entry& entry);
+        // Publish the result of a load started with startLoad().
+        DocumentPtr finishLoad(std::string const& path, std::uint64_t generation, util::FileStamp const& stamp,
+                               std::promise<DocumentPtr>& promise, std::string contents);
+        // Move `entry` first in the LRU list, mutex must be held
+        void touch(Entry& entry);
+        // Drop documents until we fit in `cap`, mutex must be held
+        void evict();
+        void erase(std::map<std::string, Entry>::iterator it);
+
+        mutable std::mutex mutex;
+        std::map<std::string, Entry> entries;
+        // Most recently used path first
+        std::list<std::string> lru;
+        std::size_t cap;
+        std::size_t bytes{0};
+        std::uint64_t generations{0};
+};
+
+} /* namespace json */
+
+#endif /* DOCUMENT_CACHE_H */
@@ -0,0 +1,30 @@
+#ifndef JSON_BINARY_H
+#define JSON_BINARY_H
+
+#include <cstddef>
+#include <string>
+
+#include "json.h"
+#include "json_unstructured.h"
+
+namespace json {
+namespace binary {
+
+// A compact binary form of a Object tree that can be turned back into
+// a tree without any parsing, used to cache parsed files. Every value
+// is a tag byte followed by its payload, strings and containers carry
+// their length up front so decoding can size everything in one go.
+// Integers are stored in host byte order, the format is meant for
+// caches on the machine that wrote them and not for exchanging data.
+
+// Encode `root` and everything below it.
+std::string encode(Object const& root);
+
+// Decode a tree written by encode(). Throws ParseError if `data`
+// doesn't hold a complete encoded tree.
+Object decode(char const* data, std::size_t len);
+
+} /* namespace binary */
+} /* namespace json */
+
+#endif /* JSON_BINARY_H */
@@ -0,0 +1,516 @@
+#ifndef JSON_FROZEN_H
+#define JSON_FROZEN_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "json.h"
+#include "json_unstructured.h"
+#include "util.h"
+
+// Parse a JSON string literal at compile time, use as:
+//
+// ```
+//  constexpr auto defaults = JSON_FROZEN(R"({"server": {"port": 8080}})");
+//  static_assert(defaults.get<json::Int>({"server", "port"}) == 8080, "");
+// ```
+//
+// The literal is always parsed by the compiler, a malformed literal
+// therefore fails the build instead of throwing at startup.
+#define JSON_FROZEN(literal)                                            \
+        ([]() {                                                         \
+                constexpr auto frozen_ = ::json::frozen::parse<::json::frozen::countNodes(literal)>(literal); \
+                return frozen_;                                         \
+        }())
+
+namespace json {
+namespace frozen {
+
+enum class Type : std::uint8_t { Null, Str, Int, Double, Bool, Arr, Obj };
+
+// One value in a frozen document. The nodes are stored in pre-order,
+// the children of a Arr or Obj at index `k` start at `k + 1` and each
+// node knows where its own subtree ends so that siblings can be
+// skipped without recursion.
+struct Node {
+        Type type{Type::Null};
+        // Name of this node if the parent is a Obj.
+        std::string_view key{};
+        // Contents of a Str, without the quotation marks. Escape
+        // sequences are kept as is, just like json::Parser does.
+        std::string_view str{};
+        Int i{0};
+        Double d{0};
+        Bool b{false};
+        // Number of direct children of a Arr or Obj.
+        std::size_t size{0};
+        // Index one past the last node in this subtree.
+        std::size_t end{0};
+};
+
+namespace detail {
+        constexpr bool isSpace(char c) {
+                return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+        }
+
+        constexpr bool isDigit(char c) {
+                return c >= '0' && c <= '9';
+        }
+
+        // 10^exp for 0 <= exp <= 22, every one of them is exact
+        constexpr Double pow10(int exp) {
+                Double res{1};
+                for (; exp > 0; --exp) {
+                        res *= 10;
+                }
+                return res;
+        }
+
+        // value * 10^exp. With a mantissa below 2^53 and |exp| <= 22
+        // this rounds once, just like strtod() does, so "0.3" gives the
+        // same double as json::Parser. Longer mantissas and larger
+        // exponents can be off by a few units in the last place.
+        constexpr Double scale(Double value, int exp) {
+                // Moves as much of the exponent as is exact into the
+                // mantissa, e.g. for 1e30
+                constexpr Double exactMax = 9007199254740992.0;
+                for (; exp > 22 && value * 10 < exactMax; --exp) {
+                        value *= 10;
+                }
+                auto multiply = [&](Double factor) {
+                        if (value > std::numeric_limits<Double>::max() / factor) {
+                                throw ParseError{"Number doesn't fit in json::Double in JSON literal"};
+                        }
+                        value *= factor;
+                };
+                for (; exp > 22; exp -= 22) {
+                        multiply(1e22);
+                }
+                for (; exp < -22; exp += 22) {
+                        value /= 1e22;
+                }
+                if (exp < 0) {
+                        return value / pow10(-exp);
+                }
+                multiply(pow10(exp));
+                return value;
+        }
+
+        // Recursive descent parser that is usable in constant
+        // expressions. When `nodes` is nullptr nodes are only
+        // counted, this is used to size the array that holds the
+        // document.
+        class Reader {
+        public:
+                constexpr Reader(std::string_view s, Node* nodes) : s{s}, nodes{nodes} {}
+
+                constexpr std::size_t document() {
+                        value({});
+                        skipSpace();
+                        if (pos != s.size()) {
+                                throw ParseError{"Trailing characters after JSON literal"};
+                        }
+                        return count;
+                }
+        private:
+                constexpr void skipSpace() {
+                        while (pos < s.size() && isSpace(s[pos])) {
+                                ++pos;
+                        }
+                }
+
+                // Skip whitespace and a optional ',' after a value
+                constexpr void skipSeparator() {
+                        skipSpace();
+                        if (pos < s.size() && s[pos] == ',') {
+                                ++pos;
+                                skipSpace();
+                        }
+                }
+
+                constexpr char peek() const {
+                        if (pos >= s.size()) {
+                                throw ParseError{"Unexpected end of JSON literal"};
+                        }
+                        return s[pos];
+                }
+
+                constexpr bool consume(std::string_view word) {
+                        if (s.substr(pos, word.size()) == word) {
+                                pos += word.size();
+                                return true;
+                        }
+                        return false;
+                }
+
+                constexpr std::string_view string() {
+                        if (peek() != '"') {
+                                throw ParseError{"Expected a string in JSON literal, keys must be quoted"};
+                        }
+                        std::size_t start = ++pos;
+                        while (peek() != '"') {
+                                if (s[pos] == '\\') {
+                                        ++pos;
+                                }
+                                ++pos;
+                        }
+                        return s.substr(start, pos++ - start);
+                }
+
+                constexpr void number(Node& n) {
+                        bool negative = consume("-");
+                        if (!isDigit(peek())) {
+                                throw ParseError{"Encountered unknown token in JSON literal"};
+                        }
+                        Int mantissa{0};
+                        int exp{0};
+                        bool isDouble{false};
+                        // Digits that don't fit in the mantissa are
+                        // dropped, those before the '.' still count
+                        // towards the exponent.
+                        bool dropped{false};
+                        auto digit = [&](bool fraction) {
+                                Int d = s[pos++] - '0';
+                                if (dropped || mantissa > (std::numeric_limits<Int>::max() - d) / 10) {
+                                        dropped = true;
+                                        exp += fraction ? 0 : 1;
+                                } else {
+                                        mantissa = mantissa * 10 + d;
+                                        exp -= fraction ? 1 : 0;
+                                }
+                        };
+                        while (pos < s.size() && isDigit(s[pos])) {
+                                digit(false);
+                        }
+                        if (pos < s.size() && s[pos] == '.') {
+                                ++pos;
+                                if (pos >= s.size() || !isDigit(s[pos])) {
+                                        throw ParseError{"Expected digits after '.' in JSON literal"};
+                                }
+                                isDouble = true;
+                                while (pos < s.size() && isDigit(s[pos])) {
+                                        digit(true);
+                                }
+                        }
+                        if (pos < s.size() && (s[pos] == 'e' || s[pos] == 'E')) {
+                                ++pos;
+                                bool negativeExp = consume("-");
+                                if (!negativeExp) {
+                                        consume("+");
+                                }
+                                if (pos >= s.size() || !isDigit(s[pos])) {
+                                        throw ParseError{"Expected digits in exponent in JSON literal"};
+                                }
+                                isDouble = true;
+                                int e{0};
+                                while (pos < s.size() && isDigit(s[pos])) {
+                                        // Way out of range of a double already
+                                        e = e < 100000 ? e * 10 + (s[pos++] - '0') : (++pos, e);
+                                }
+                                exp += negativeExp ? -e : e;
+                        }
+                        if (isDouble) {
+                                n.type = Type::Double;
+                                Double value = scale(static_cast<Double>(mantissa), exp);
+                                n.d = negative ? -value : value;
+                        } else {
+                                if (dropped) {
+                                        throw ParseError{"Integer doesn't fit in json::Int in JSON literal"};
+                                }
+                                n.type = Type::Int;
+                                n.i = negative ? -mantissa : mantissa;
+                        }
+                }
+
+                constexpr void value(std::string_view key) {
+                        skipSpace();
+                        std::size_t idx = count++;
+                        Node n{};
+                        n.key = key;
+                        char c = peek();
+                        if (c == '{' || c == '[') {
+                                char close = c == '{' ? '}' : ']';
+                                n.type = c == '{' ? Type::Obj : Type::Arr;
+                                ++pos;
+                                skipSpace();
+                                while (peek() != close) {
+                                        std::string_view childKey{};
+                                        if (n.type == Type::Obj) {
+                                                childKey = string();
+                                                skipSpace();
+                                                if (peek() != ':') {
+                                                        throw ParseError{"Expected ':' after key in JSON literal"};
+                                                }
+                                                ++pos;
+                                        }
+                                        value(childKey);
+                                        ++n.size;
+                                        skipSeparator();
+                                }
+                                ++pos;
+                        } else if (c == '"') {
+                                n.type = Type::Str;
+                                n.str = string();
+                        } else if (consume("true")) {
+                                n.type = Type::Bool;
+                                n.b = true;
+                        } else if (consume("false")) {
+                                n.type = Type::Bool;
+                        } else if (consume("null")) {
+                                n.type = Type::Null;
+                        } else {
+                                number(n);
+                        }
+                        n.end = count;
+                        if (nodes) {
+                                nodes[idx] = n;
+                        }
+                }
+
+                std::string_view s;
+                Node* nodes;
+                std::size_t pos{0};
+                std::size_t count{0};
+        };
+
+        // Maps the json type aliases to what a frozen document hands
+        // out, Str becomes a view into the literal.
+        template<typename T> struct Value;
+        template<> struct Value<Null>   { using type = Null;             static constexpr Type tag = Type::Null; };
+        template<> struct Value<Str>    { using type = std::string_view; static constexpr Type tag = Type::Str; };
+        template<> struct Value<Int>    { using type = Int;              static constexpr Type tag = Type::Int; };
+        template<> struct Value<Double> { using type = Double;           static constexpr Type tag = Type::Double; };
+        template<> struct Value<Bool>   { using type = Bool;             static constexpr Type tag = Type::Bool; };
+        template<> struct Value<Arr>    { static constexpr Type tag = Type::Arr; };
+        template<> struct Value<Obj>    { static constexpr Type tag = Type::Obj; };
+
+        constexpr char const* typeName(Type t) {
+                switch (t) {
+                case Type::Null:   return "json::Null";
+                case Type::Str:    return "json::Str";
+                case Type::Int:    return "json::Int";
+                case Type::Double: return "json::Double";
+                case Type::Bool:   return "json::Bool";
+                case Type::Arr:    return "json::Arr";
+                case Type::Obj:    return "json::Obj";
+                }
+                return "unknown";
+        }
+} /* namespace detail */
+
+// Count how many nodes the JSON in `s` consists of.
+constexpr std::size_t countNodes(std::string_view s) {
+        return detail::Reader{s, nullptr}.document();
+}
+
+// A reference to one value inside a frozen document, offers the
+// read-only parts of the json::Object interface.
+class View {
+public:
+        constexpr View(Node const* nodes, std::size_t idx) : nodes{nodes}, idx{idx} {}
+
+        constexpr Type type() const { return node().type; }
+
+        // Is this value of the actual type T? See the available
+        // aliases in json_unstructured.h for possible types to pass in.
+        template<typename T>
+        constexpr bool is() const {
+                return node().type == detail::Value<T>::tag;
+        }
+
+        // "Unpack" this value into whatever `T` is, throws
+        // BadTypeError if `T` isn't the type this value actually is.
+        template<typename T>
+        constexpr typename detail::Value<T>::type into() const {
+                expect(detail::Value<T>::tag);
+                return extract(static_cast<typename detail::Value<T>::type const*>(nullptr));
+        }
+
+        // Retrieve a named part from something with type Obj
+        constexpr View get(std::string_view name) const {
+                expect(Type::Obj);
+                std::size_t child = idx + 1;
+                for (std::size_t i = 0; i < node().size; ++i) {
+                        if (nodes[child].key == name) {
+                                return View{nodes, child};
+                        }
+                        child = nodes[child].end;
+                }
+                throw ObjectError{util::format("Can't find key `", std::string{name}, "' in frozen json")};
+        }
+
+        // Retrieve a certain index from something with type Arr
+        constexpr View get(int index) const {
+                expect(Type::Arr);
+                if (index < 0 || static_cast<std::size_t>(index) >= node().size) {
+                        throw ObjectError{util::format("Index `", index, "' is out of range in frozen json")};
+                }
+                std::size_t child = idx + 1;
+                for (int i = 0; i < index; ++i) {
+                        child = nodes[child].end;
+                }
+                return View{nodes, child};
+        }
+
+        // Follow the given path of keys.
+        constexpr View get(std::initializer_list<std::string_view> path) const {
+                View v = *this;
+                for (auto const& key : path) {
+                        v = v.get(key);
+                }
+                return v;
+        }
+
+        // Retrieve the given path and convert it into type `T`, if
+        // conversion is not possible an exception of type
+        // BadTypeError is thrown.
+        template<typename T>
+        constexpr typename detail::Value<T>::type get(std::initializer_list<std::string_view> path) const {
+                return get(path).template into<T>();
+        }
+
+        // Does the given path exist?
+        constexpr bool has(std::initializer_list<std::string_view> path) const {
+                std::size_t cur = idx;
+                for (auto const& key : path) {
+                        if (nodes[cur].type != Type::Obj) {
+                                return false;
+                        }
+                        std::size_t child = cur + 1;
+                        std::size_t found = 0;
+                        for (std::size_t i = 0; i < nodes[cur].size; ++i) {
+                                if (nodes[child].key == key) {
+                                        found = child;
+                                        break;
+                                }
+                                child = nodes[child].end;
+                        }
+                        if (found == 0) {
+                                return false;
+                        }
+                        cur = found;
+                }
+                return true;
+        }
+
+        // Check how long this value is given that it is Arr. Throws if
+        // the value isn't Arr.
+        constexpr int length() const {
+                expect(Type::Arr);
+                return static_cast<int>(node().size);
+        }
+
+        // Retrieve the keys for this value if it is of type Obj.
+        std::vector<std::string> keys() const {
+                expect(Type::Obj);
+                std::vector<std::string> res{};
+                std::size_t child = idx + 1;
+                for (std::size_t i = 0; i < node().size; ++i) {
+                        res.emplace_back(nodes[child].key);
+                        child = nodes[child].end;
+                }
+                return res;
+        }
+
+        // Create a regular json::Object with the same contents, for
+        // use where a mutable document is needed, e.g. Config.
+        Object toObject() const {
+                Node const& n = node();
+                switch (n.type) {
+                case Type::Null:   return Object{Null{}};
+                case Type::Str:    return Object{Str{n.str}};
+                case Type::Int:    return Object{n.i};
+                case Type::Double: return Object{n.d};
+                case Type::Bool:   return Object{n.b};
+                case Type::Arr: {
+                        Arr arr;
+                        arr.reserve(n.size);
+                        for (std::size_t child = idx + 1; child < n.end; child = nodes[child].end) {
+                                arr.push_back(View{nodes, child}.toObject());
+                        }
+                        return Object{arr};
+                }
+                case Type::Obj: {
+                        Obj obj;
+                        for (std::size_t child = idx + 1; child < n.end; child = nodes[child].end) {
+                                obj[std::string{nodes[child].key}] = View{nodes, child}.toObject();
+                        }
+                        return Object{obj};
+                }
+                }
+                throw std::runtime_error{"Unreachable code in json::frozen::View::toObject()"};
+        }
+private:
+        constexpr Node const& node() const { return nodes[idx]; }
+
+        constexpr void expect(Type t) const {
+                if (node().type != t) {
+                        throw BadTypeError{util::format("Trying to convert frozen json to `", detail::typeName(t), "' when it is of type `", detail::typeName(node().type), "'")};
+                }
+        }
+
+        constexpr Null extract(Null const*) const { return Null{}; }
+        constexpr std::string_view extract(std::string_view const*) const { return node().str; }
+        constexpr Int extract(Int const*) const { return node().i; }
+        constexpr Double extract(Double const*) const { return node().d; }
+        constexpr Bool extract(Bool const*) const { return node().b; }
+
+        Node const* nodes;
+        std::size_t idx;
+};
+
+// A JSON document parsed at compile time, consisting of `N`
+// nodes. Create with JSON_FROZEN() rather than directly. The query
+// functions forward to the View of the root value.
+template<std::size_t N>
+class Frozen {
+public:
+        constexpr explicit Frozen(std::string_view s) {
+                detail::Reader{s, nodes.data()}.document();
+        }
+
+        constexpr View root() const { return View{nodes.data(), 0}; }
+
+        constexpr Type type() const { return root().type(); }
+
+        template<typename T>
+        constexpr bool is() const { return root().template is<T>(); }
+
+        template<typename T>
+        constexpr typename detail::Value<T>::type into() const { return root().template into<T>(); }
+
+        constexpr View get(std::string_view name) const { return root().get(name); }
+        constexpr View get(int index) const { return root().get(index); }
+        constexpr View get(std::initializer_list<std::string_view> path) const { return root().get(path); }
+
+        template<typename T>
+        constexpr typename detail::Value<T>::type get(std::initializer_list<std::string_view> path) const {
+                return root().template get<T>(path);
+        }
+
+        constexpr bool has(std::initializer_list<std::string_view> path) const { return root().has(path); }
+        constexpr int length() const { return root().length(); }
+        std::vector<std::string> keys() const { return root().keys(); }
+        Object toObject() const { return root().toObject(); }
+private:
+        std::array<Node, N> nodes{};
+};
+
+// Parse `s` into a document of `N` nodes, `N` must be what
+// countNodes() gives back for `s`.
+template<std::size_t N>
+constexpr Frozen<N> parse(std::string_view s) {
+        return Frozen<N>{s};
+}
+
+} /* namespace frozen */
+} /* namespace json */
+
+#endif /* JSON_FROZEN_H */
@@ -2,6 +2,9 @@
 #define JSON_UNSTRUCTURED_H
 
 #include <string>
+#include <string_view>
+#include <initializer_list>
+#include <functional>
 #include <map>
 #include <stdexcept>
 #include <vector>
@@ -52,7 +55,56 @@ namespace {
 
 struct Property;
 
+// Bytes held by a tree of Objects, split up by what they are used for.
+// The numbers are estimates, the allocator adds its own bookkeeping on
+// top of these.
+struct MemoryUsage {
+        // The Objects themselves, also the ones stored in arrays and
+        // maps.
+        std::size_t nodes{0};
+        // Heap memory used by the contents of Str values.
+        std::size_t strings{0};
+        // Obj keys, including the std::string that holds them.
+        std::size_t keys{0};
+        // Bookkeeping done by the containers, e.g. tree pointers in
+        // map nodes.
+        std::size_t overhead{0};
+        // Memory that is allocated but unused, i.e. capacity beyond
+        // the size of strings and arrays.
+        std::size_t slack{0};
+
+        std::size_t total() const {
+                return nodes + strings + keys + overhead + slack;
+        }
+
+        MemoryUsage& operator+=(MemoryUsage const& rhs) {
+                nodes += rhs.nodes;
+                strings += rhs.strings;
+                keys += rhs.keys;
+                overhead += rhs.overhead;
+                slack += rhs.slack;
+                return *this;
+        }
+};
+
+// Filled in by the Parser when it is given one.
+struct ParseStats {
+        // Number of keys and values encountered
+        std::size_t tokens{0};
+        // Deepest nesting of arrays and objects, a scalar at the top
+        // level has depth 0.
+        std::size_t maxDepth{0};
+        // Heap allocations made while parsing, including growing the
+        // parser's own scratch buffers.
+        std::size_t allocations{0};
+        // Bytes of keys and strings copied out of the input.
+        std::size_t bytesCopied{0};
+};
+
 using Path = std::vector<std::string>;
+// A path that only refers to keys owned by someone else, e.g. string
+// literals.
+using PathView = std::initializer_list<std::string_view>;
         
 // Aliases to ease use of into()
 class Object;
@@ -61,7 +113,9 @@ using Int = std::int64_t;
 using Double = double;
 using Bool = bool;
 using Arr = std::vector<Object>;
-using Obj = std::map<std::string, Object>;
+// std::less<> lets lookups use a std::string_view without first
+// creating a std::string.
+using Obj = std::map<std::string, Object, std::less<>>;
 using Null = NullType;
 
 // A general Object that holds some kind of json data, the datatypes
@@ -115,6 +169,9 @@ struct Object {
         // serialize the contents to a string.
         std::string serialize() const;
 
+        // How much memory this Object and everything below it uses.
+        MemoryUsage memoryUsage() const;
+
         // Add a property to something of type Obj, returns true if
         // the property got added, false if the property already
         // existed. If it already exists the old value is removed. If
@@ -135,52 +192,55 @@ struct Object {
         
         // Retrieve the given path and convert it into type `T`, if
         // conversion is not possible an exception of type
-        // BadTypeError is thrown.
+        // BadTypeError is thrown. A braced list of keys, e.g.
+        // get<Int>({"a", "b"}), picks the PathView overload and
+        // doesn't create any strings.
         template<typename T>
-        T const& get(Path path) const {
-                if (path.empty()) {
-                        // We're at the end of the path and are the
-                        // object we're searching for.
-                        return into<T const&>();
-                } else {
-                        // Lookup the object inside ourselves, then
-                        // dispatch away to the object we found
-                        Path rest{path.begin() + 1, path.end()};
-                        return get(*path.begin()).get<T>(rest);
-                }
+        T const& get(Path const& path) const {
+                return walk(path.begin(), path.end()).template into<T const&>();
         }
 
-        // TODO: how can we avoid doing the same thing in both these
-        // functions?
         template<typename T>
-        T& get(Path path) {
-                if (path.empty()) {
-                        // We're at the end of the path and are the
-                        // object we're searching for.
-                        return into<T&>();
-                } else {
-                        // Lookup the object inside ourselves, then
-                        // dispatch away to the object we found
-                        Path rest{path.begin() + 1, path.end()};
-                        return get(*path.begin()).get<T>(rest);
-                }
+        T const& get(PathView path) const {
+                return walk(path.begin(), path.end()).template into<T const&>();
         }
 
-        // TODO: how can we avoid doing the same thing in both these
-        // functions? Get the given path as the type `T`, if parts of
-        // the path do not exist they are created on the way.
         template<typename T>
-        T& getOrInsert(Path path) {
-                if (path.empty()) {
-                        // We're at the end of the path and are the
-                        // object we're searching for.
-                        return into<T&>();
-                } else {
-                        // Lookup the object inside ourselves, then
-                        // dispatch away to the object we found
-                        Path rest{path.begin() + 1, path.end()};
-                        return getOrInsert(*path.begin()).getOrInsert<T>(rest);
+        T& get(Path const& path) {
+                return walk(path.begin(), path.end()).template into<T&>();
+        }
+
+        template<typename T>
+        T& get(PathView path) {
+                return walk(path.begin(), path.end()).template into<T&>();
+        }
+
+        // Get the given path as the type `T`, if parts of the path do
+        // not exist they are created on the way.
+        template<typename T>
+        T& getOrInsert(Path const& path) {
+                Object* cur = this;
+                for (auto const& key : path) {
+                        cur = &cur->getOrInsert(std::string_view{key});
+                }
+                return cur->into<T&>();
+        }
+
+        // Follow the keys in [first, last) and give back the Object at
+        // the end of the path. The keys can be anything that converts
+        // to a std::string_view.
+        template<typename It>
+        Object const& walk(It first, It last) const {
+                Object const* cur = this;
+                for (; first != last; ++first) {
+                        cur = &cur->get(std::string_view{*first});
                 }
+                return *cur;
+        }
+
+        template<typename It>
+        Object& walk(It first, It last) {
+                return const_cast<Object&>(static_cast<Object const*>(this)->walk(first, last));
         }
 
         // Retrieve the keys for this object if it is of type Obj. E.g:
@@ -193,13 +253,14 @@ struct Object {
         // this Object isn't of type Obj.
         std::vector<std::string> keys() const;
         
-        // Retrieve a named part from something with type Obj
-        Object const& get(std::string const& name) const;
-        Object& get(std::string const& name);
+        // Retrieve a named part from something with type Obj, throws
+        // std::out_of_range if there is no such part. The lookup
+        // doesn't create a std::string from `name`.
+        Object const& get(std::string_view name) const;
+        Object& get(std::string_view name);
         // Retrieve a named part from something with type Obj, if it
         // doesn't exist, we insert it and return it.
-        Object const& getOrInsert(std::string const& name) const;
-        Object& getOrInsert(std::string const& name);
+        Object& getOrInsert(std::string_view name);
 
         // Retrieve a certain index from something with type Arr
         Object const& get(int index) const;
@@ -246,6 +307,9 @@ struct Object {
         bool operator==(Object const& rhs) const;
         bool operator!=(Object const& rhs) const;
 private:
+        // Parses straight into `value` to be able to reuse it
+        friend struct Parser;
+
         template<typename T>
         bool compareVariant(Object const& lhs, Object const& rhs) const {
                 if (lhs.is<T>() && rhs.is<T>()) {
@@ -270,16 +334,36 @@ struct Property {
 };
 
 // Parses JSON data and creates a Object that can be used to
-// extract the information programmatically.
+// extract the information programmatically. A Parser keeps its
+// scratch buffers between calls, when many small messages are parsed
+// it is cheaper to keep one Parser around and use parseInto() than to
+// call parse() for every message.
 struct Parser {
         Parser() = default;
 
         // Parse the string `s` that we were created with and return
-        // the Object that it represents. Almost no guarantees are
-        // given that the parser will error out on invalid data, and
-        // very little information about what went wrong is available.
-        static Object parse(std::string const& s);
-
+        // the Object that it represents. Trailing commas are allowed
+        // and escape sequences in strings are kept as is. Throws
+        // ParseError when `s` isn't valid JSON. If `stats` is given it
+        // is filled in with statistics about the parse.
+        static Object parse(std::string const& s, ParseStats* stats = nullptr);
+
+        // Parse `s` into `dst`, reusing what is already stored in
+        // `dst`. Strings are assigned in place, arrays keep their
+        // elements and objects keep the nodes for keys that are still
+        // present, so parsing messages with the same shape over and
+        // over again doesn't allocate once the buffers are large
+        // enough. Keys that are no longer present are removed. If a
+        // key is repeated in `s` the last value wins. Throws
+        // ParseError, `dst` is left in a unspecified but valid state
+        // if that happens.
+        void parseInto(std::string const& s, Object& dst, ParseStats* stats = nullptr);
+        void parseInto(char const* data, std::size_t len, Object& dst, ParseStats* stats = nullptr);
+
+        // Parse `s` as a value of a certain kind, throws ParseError if
+        // it is something else. parseHelper() takes any kind of value.
+        // Kept from the old parser, they are the same as parseInto()
+        // into a new Object.
         Object parseArr(std::string s);
         Object parseString(std::string const& s);
         Object parseHelper(std::string s);
@@ -308,13 +392,6 @@ private:
         // when we can't find anything resembling a int.
         size_t iPos(std::string const& s) const;
 
-        // Lookup a value in the object and make sure to keep
-        // quotation marks so that strings can be identified
-        std::tuple<char const*, size_t> lookupValue(JsonStructured& json, std::string const& key) const;
-
-        std::string findKey(JsonStructured::Str const& s) const;
-        std::string findKey(JsonStructured::Str::const_iterator start, JsonStructured::Str::const_iterator end) const;
-
         bool find(std::string const& s, char needle) const {
                 for (char c : s) {
                         if (c == needle) {
@@ -326,8 +403,46 @@ private:
                 }
                 return false;
         }
-        
-        std::string json{};
+
+        // Objects and arrays nested deeper than this are rejected
+        // instead of running out of stack, the same limit as
+        // json::binary uses.
+        static constexpr std::size_t maxDepth = 512;
+
+        // Parse the value at `pos` into `dst`, `depth` is the nesting
+        // level of the value.
+        void value(Object& dst, std::size_t depth);
+        void object(Object& dst, std::size_t depth);
+        void array(Object& dst, std::size_t depth);
+        void string(Object& dst);
+        void number(Object& dst);
+        // Parse a quoted string at `pos`, gives back the contents
+        // without quotes.
+        std::pair<char const*, std::size_t> quoted();
+        // Consume `word` if the input continues with it followed by a
+        // delimiter.
+        bool literal(char const* word, std::size_t len);
+        void skipSpace();
+        // Describe where we are in the input for error messages
+        std::string context() const;
+        // parseHelper() that checks that `s` is a `T`, called `what`
+        // in the error message.
+        template<typename T>
+        Object parseAs(std::string const& s, char const* what);
+
+        // Current position in and end of the input
+        char const* pos{nullptr};
+        char const* end{nullptr};
+        char const* begin{nullptr};
+        // Scratch buffers, kept between calls so that their capacity
+        // is reused.
+        std::string num{};
+        // Per nesting level, the values of the keys seen so far in the
+        // object that is being parsed at that level.
+        std::vector<std::vector<Object const*>> seen{};
+        // Where to collect statistics for the current parse, if
+        // anywhere.
+        ParseStats* stats{nullptr};
 };
 
 template<>
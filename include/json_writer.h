@@ -0,0 +1,72 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace json {
+
+// Writes JSON straight into a string as it goes, without building a
+// Object first. Commas between values are put in as needed and strings
+// are escaped. It doesn't check that the calls make up valid JSON, e.g.
+// that every value in a object has a key. E.g.
+//   json::Writer{out}.beginObject().key("id").value(12).endObject();
+class Writer {
+public:
+        // Append to `out`, which must outlive us
+        explicit Writer(std::string& out) : out{out} {}
+
+        Writer& beginObject();
+        Writer& endObject();
+        Writer& beginArray();
+        Writer& endArray();
+        Writer& key(std::string_view key);
+
+        // Numbers, bools, strings and nullptr for null. Doubles that
+        // JSON can't represent, i.e. NaN and the infinities, are
+        // written as null.
+        template<typename T>
+        Writer& value(T const& value) {
+                if constexpr (std::is_same_v<T, bool>) {
+                        writeBool(value);
+                } else if constexpr (std::is_same_v<T, std::nullptr_t>) {
+                        writeNull();
+                } else if constexpr (std::is_floating_point_v<T>) {
+                        writeDouble(static_cast<double>(value));
+                } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+                        writeInt(static_cast<std::int64_t>(value));
+                } else if constexpr (std::is_integral_v<T>) {
+                        writeUInt(static_cast<std::uint64_t>(value));
+                } else {
+                        static_assert(std::is_convertible_v<T const&, std::string_view>,
+                                      "json::Writer takes numbers, bools, strings and nullptr");
+                        writeStr(value);
+                }
+                return *this;
+        }
+
+        // Append `s` to `out` escaped as the inside of a JSON string.
+        // Bytes that aren't ASCII are copied as they are, `s` should
+        // be valid UTF-8.
+        static void escape(std::string_view s, std::string& out);
+private:
+        // Put a comma in front of the next value or key unless it is
+        // the first in its object or array or follows a key
+        void separate();
+        void writeBool(bool value);
+        void writeNull();
+        void writeDouble(double value);
+        void writeInt(std::int64_t value);
+        void writeUInt(std::uint64_t value);
+        void writeStr(std::string_view value);
+
+        std::string& out;
+        bool first{true};
+};
+
+} /* namespace json */
+
+#endif /* JSON_WRITER_H */
@@ -9,55 +9,100 @@
 #include <memory>
 #include <map>
 #include <vector>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+// Levels below this are compiled out completely, 0 keeps everything, 1
+// drops LDBG, 2 drops LINFO as well and 3 only keeps LPANIC. E.g. build
+// releases with -DLOG_MIN_LEVEL=1.
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 0
+#endif
+
+// The level is checked before `msg` is evaluated, a message for a
+// disabled level costs a few loads and branches and builds no strings.
+// Every use has a static CallSite that can be switched on or off on
+// its own, see Sites.
+#define LOG_AT(minLevel, logger, lvl, msg)                              \
+        do {                                                            \
+                if constexpr (LOG_MIN_LEVEL <= (minLevel)) {            \
+                        static ::logging::CallSite const site_{lvl, nullptr, \
+                                ::logging::detail::basename(__FILE__), __func__, __LINE__}; \
+                        auto& log_ = *(logger);                         \
+                        if (log_.isEnabled(site_)) {                    \
+                                log_.log(site_, msg);                   \
+                        }                                               \
+                }                                                       \
+        } while (0)
 
 //TODO: perhaps let dbg, info etc have variadic arguments so that you
 //can log any type in some sensible way?
-#define LDBG(logger, msg) (*logger).dbg(__LINE__, __FILE__, msg);
-#define LINFO(logger, msg) (*logger).info(__LINE__, __FILE__, msg);
-#define LWARN(logger, msg) (*logger).warn(__LINE__, __FILE__, msg);
-#define LPANIC(logger, msg) (*logger).panic(__LINE__, __FILE__, msg);
+#define LDBG(logger, msg) LOG_AT(0, logger, ::logging::Level::Dbg, msg)
+#define LINFO(logger, msg) LOG_AT(1, logger, ::logging::Level::Info, msg)
+#define LWARN(logger, msg) LOG_AT(2, logger, ::logging::Level::Warn, msg)
+#define LPANIC(logger, msg) LOG_AT(3, logger, ::logging::Level::Panic, msg)
+
+// Deferred logging, the arguments are copied as they are and the text
+// is only produced later, by the writer thread of a asynchronous Log.
+// Every "{}" in `fmt` is replaced by the next argument. `fmt` must be
+// a string literal, the arguments numbers, bools, chars or strings.
+// E.g. LINFOF(log, "request {} took {}us", id, micros);
+// Arguments given with logging::kv() are fields of the message instead,
+// they are appended as " key=value" to the text and written as they
+// are by formats that know about them, see JsonLinesFormat. E.g.
+// LINFOF(log, "request done", logging::kv("id", id), logging::kv("us", micros));
+#define LOG_DEFERRED_AT(minLevel, logger, lvl, fmt, ...)                \
+        do {                                                            \
+                if constexpr (LOG_MIN_LEVEL <= (minLevel)) {            \
+                        static ::logging::CallSite const site_{lvl, fmt, \
+                                ::logging::detail::basename(__FILE__), __func__, __LINE__}; \
+                        auto& log_ = *(logger);                         \
+                        if (log_.isEnabled(site_)) {                    \
+                                log_.deferred(site_, ##__VA_ARGS__);    \
+                        }                                               \
+                }                                                       \
+        } while (0)
+
+#define LDBGF(logger, fmt, ...) LOG_DEFERRED_AT(0, logger, ::logging::Level::Dbg, fmt, ##__VA_ARGS__)
+#define LINFOF(logger, fmt, ...) LOG_DEFERRED_AT(1, logger, ::logging::Level::Info, fmt, ##__VA_ARGS__)
+#define LWARNF(logger, fmt, ...) LOG_DEFERRED_AT(2, logger, ::logging::Level::Warn, fmt, ##__VA_ARGS__)
+#define LPANICF(logger, fmt, ...) LOG_DEFERRED_AT(3, logger, ::logging::Level::Panic, fmt, ##__VA_ARGS__)
 
 namespace logging {
 
+namespace detail {
+// The part of `path` after the last slash, used by the macros to get
+// the name of the file at compile time.
+constexpr char const* basename(char const* path) {
+        char const* res = path;
+        for (char const* p = path; *p; ++p) {
+                if (*p == '/') {
+                        res = p + 1;
+                }
+        }
+        return res;
+}
+} /* namespace detail */
+
 struct Error : std::runtime_error {
         using std::runtime_error::runtime_error;
 };
 
-// Represents the destination a log will write to.
-class Dest {
-public:
-        // Write a message to the destination
-        virtual void write(std::string message) = 0;
-        virtual ~Dest() {}
-};
-
-class FileDest : public Dest {
-public:
-        FileDest(std::string fileName);
-
-        void write(std::string message) override;
-private:
-        std::fstream file{};
-};
-
-class DummyDest : public Dest {
-public:
-        void write(std::string message) override {}
-};
-
-class StdOutDest : public Dest {
-public:
-        void write(std::string message) override { std::cout << message; }
-};
-
 struct Level {
         static const Level Dbg;
         static const Level Info;
         static const Level Warn;
         static const Level Panic;
 
-        Level(int val) : val{val} {}
-        Level(Level const& other) : val{other.val} {}
+        constexpr Level(int val) : val{val} {}
+        constexpr Level(Level const& other) : val{other.val} {}
 
         Level operator|(Level const& rhs) const {
                 return Level{rhs.val | val};
@@ -85,6 +130,10 @@ struct Level {
                 return (level.val & val) != 0;
         }
 
+        int bits() const {
+                return val;
+        }
+
         void addLevel(Level const& level) {
                 val |= level.val;
         }
@@ -92,11 +141,514 @@ struct Level {
         void removeLevel(Level const& level) {
                 val = ~level.val & val;
         }
+
+        // Name of the level, or the least severe one if several are
+        // set, padded to the same width for all levels.
+        char const* name() const;
 private:
         int val;
 };
 
+// Constants so that the static CallSite of the macros is initialized
+// at compile time
+inline constexpr Level Level::Dbg{1};
+inline constexpr Level Level::Info{1 << 1};
+inline constexpr Level Level::Warn{1 << 2};
+inline constexpr Level Level::Panic{1 << 3};
+
+struct Record;
+
+// A formatted message handed to a Dest together with the level it was
+// logged at.
+struct Message {
+        std::string_view text;
+        Level level;
+};
+
+// Represents the destination a log will write to.
+class Dest {
+public:
+        // Write a message to the destination, `message` is only valid
+        // during the call.
+        virtual void write(std::string_view message) = 0;
+        // Write `count` messages at once, this is what a Log calls. The
+        // messages are only valid during the call. Writes them one by
+        // one with write() unless overridden.
+        virtual void writeBatch(Message const* messages, std::size_t count) {
+                for (std::size_t i = 0; i < count; ++i) {
+                        write(messages[i].text);
+                }
+        }
+        // Destinations that store messages in some other form than
+        // text override this and give back true, the record is then
+        // neither formatted nor given to write().
+        virtual bool writeRecord(Record const& record) { return false; }
+        // Make sure everything written so far has left our buffers
+        virtual void flush() {}
+        // Make sure everything written so far is on stable storage,
+        // see Log::commit(). Only flushes unless overridden.
+        virtual void sync() { flush(); }
+        virtual ~Dest() {}
+};
+
+// When a FileDest writes out what it has buffered. The buffer is
+// written when any of the limits is reached, when the Log flushes it
+// and when a asynchronous Log has nothing more to write.
+struct FlushPolicy {
+        // Size of the buffer
+        std::size_t bytes{64 * 1024};
+        // Number of buffered messages, 0 for no limit
+        std::size_t count{0};
+        // Time since the buffer was last written, checked when
+        // messages are written, 0 for no limit
+        std::chrono::milliseconds interval{1000};
+        // Messages at any of these levels are written right away
+        Level levels{Level::Warn | Level::Panic};
+};
+
+// When a FileDest moves on to a new file. The current file is renamed
+// to "<file>.<YYYYmmdd-HHMMSS>" with the local time of the rotation and
+// a new one is started, rotated files are then compressed and pruned
+// in the background.
+struct RotationPolicy {
+        // Rotate once the file has grown to this many bytes, 0 for no
+        // limit
+        std::uint64_t bytes{0};
+        // Rotate at every multiple of the interval since the epoch,
+        // e.g. every hour on the hour, 0 for never
+        std::chrono::seconds interval{0};
+        // Compress rotated files with gzip, they get a ".gz" suffix
+        bool compress{false};
+        // Number of rotated files to keep, 0 keeps all of them
+        std::size_t keep{0};
+};
+
+// Appends to a file through its own buffer, a batch of messages that
+// doesn't fit in the buffer is written with a single writev() straight
+// from where the messages are. Rotation happens on the thread that
+// writes, between batches, syncing, compressing and removing old files
+// on a thread of our own. Errors while writing are ignored.
+class FileDest : public Dest {
+public:
+        // Throws Error if `fileName` can't be opened
+        FileDest(std::string fileName, FlushPolicy policy = FlushPolicy{}, RotationPolicy rotation = RotationPolicy{});
+        FileDest(FileDest const&) = delete;
+        FileDest& operator=(FileDest const&) = delete;
+        ~FileDest();
+
+        void write(std::string_view message) override;
+        void writeBatch(Message const* messages, std::size_t count) override;
+        void flush() override;
+        // Flushes and waits for fdatasync(). Files rotated since the
+        // last sync are synced on the thread of the housekeeping, this
+        // waits for those as well.
+        void sync() override;
+private:
+        class Housekeeper;
+
+        // Write the buffer followed by `messages` and empty the buffer
+        void writeOut(Message const* messages, std::size_t count);
+        // Open `fileName` and work out when to rotate it
+        void open();
+        // Move the current file aside and start a new one
+        void rotate();
+        // When the next rotation by time is due
+        std::chrono::steady_clock::time_point nextRotation() const;
+
+        std::string fileName;
+        int fd{-1};
+        FlushPolicy policy;
+        RotationPolicy rotation;
+        // Bytes in the current file and the size and time at which it
+        // is rotated, the limits are at their maximum when not used.
+        std::uint64_t written{0};
+        std::uint64_t rotateBytes;
+        std::chrono::steady_clock::time_point rotateAt;
+        // Time stamp of the last rotated file and how many rotations
+        // there have been within it, numbers aren't reused once older
+        // files have been removed
+        std::string lastStamp{};
+        int stampRotations{0};
+        // Anything written since the last fdatasync()
+        bool dirty{false};
+        // Created at the first rotation if there is anything to do
+        // with the rotated files
+        std::unique_ptr<Housekeeper> housekeeper;
+        std::string buffer{};
+        // Messages in `buffer`
+        std::size_t buffered{0};
+        std::chrono::steady_clock::time_point lastWrite;
+};
+
+class DummyDest : public Dest {
+public:
+        void write(std::string_view message) override {}
+};
+
+class StdOutDest : public Dest {
+public:
+        void write(std::string_view message) override { std::cout << message; }
+        void flush() override { std::cout.flush(); }
+};
+
+// What a call site does with its messages, see Sites
+enum class SiteState : std::uint8_t {
+        // Hasn't run yet, the site registers itself the first time
+        Unknown,
+        // Logged if the level and the logger let it through
+        Default,
+        // Logged whatever the level and the logger say
+        On,
+        // Never logged
+        Off
+};
+
+namespace detail {
+// Counters of a call site with a limit, see Sites::limit(). A message
+// that is turned away costs a single atomic operation. A site keeps its
+// counters when it is limited again, the settings change under the
+// threads that use them.
+struct SiteLimit {
+        // Keep 1 in `sample` messages, 1 keeps all
+        std::atomic<std::uint32_t> sample{1};
+        // Is the bucket used?
+        std::atomic<bool> limited{false};
+        // Messages seen, for sampling
+        std::atomic<std::uint64_t> seen{0};
+        // Tokens left in the bucket. Every message takes one, also
+        // those that are turned away, so that it goes below 0 by the
+        // number of those. Refilled by the thread of Sites.
+        std::atomic<std::int64_t> tokens{0};
+
+        bool admit() {
+                std::uint32_t every = sample.load(std::memory_order_relaxed);
+                if (every > 1 && seen.fetch_add(1, std::memory_order_relaxed) % every != 0) {
+                        return false;
+                }
+                return !limited.load(std::memory_order_relaxed) || tokens.fetch_sub(1, std::memory_order_relaxed) > 0;
+        }
+};
+} /* namespace detail */
+
+// What a logging macro knows at compile time, each macro has its own
+// static CallSite. Deferred messages only store a pointer to it with
+// the arguments, `format` is nullptr for the other macros.
+struct CallSite {
+        Level level;
+        char const* format;
+        char const* file;
+        char const* func;
+        int line;
+        // Checked before anything else, changed through Sites
+        mutable std::atomic<SiteState> state{SiteState::Unknown};
+        // Set if the site is rate limited or sampled
+        mutable std::atomic<detail::SiteLimit*> limit{nullptr};
+
+        // Should a message that passed the other checks be logged?
+        bool admit() const {
+                detail::SiteLimit* l = limit.load(std::memory_order_acquire);
+                return !l || l->admit();
+        }
+};
+
 class Log;
+
+// The call sites of the logging macros, each registers itself with the
+// name of its logger the first time it runs. Sites can be switched on,
+// e.g. to see a single LDBG line without the rest of its logger, or off.
+// A switch applies to the sites that match it when it is made and to
+// those that register later, later switches win.
+class Sites {
+public:
+        // Which sites a switch applies to, empty fields match every
+        // site
+        struct Match {
+                // Glob for the name of the file, see fnmatch(3)
+                std::string file{};
+                // 0 for every line
+                int line{0};
+                // Glob for the full name of the logger the site first
+                // logged through, e.g. "root/net*"
+                std::string logger{};
+                Level levels{Level::Dbg | Level::Info | Level::Warn | Level::Panic};
+        };
+
+        // How many messages a site may log, see limit()
+        struct Limit {
+                // Messages per second, 0 for no limit
+                double rate{0};
+                // Messages that may be logged at once after a quiet
+                // period, 0 for as many as `rate` allows in a second
+                std::size_t burst{0};
+                // Keep only 1 in `sample` messages, 0 and 1 keep all
+                std::uint32_t sample{0};
+                // How often the number of messages that were turned
+                // away is logged
+                std::chrono::milliseconds summary{std::chrono::seconds{10}};
+        };
+
+        // A registered site, see list()
+        struct Info {
+                char const* file;
+                int line;
+                char const* func;
+                Level level;
+                std::string logger;
+                SiteState state;
+                // Messages turned away by the limit so far, updated
+                // when the bucket is refilled
+                std::uint64_t suppressed;
+        };
+
+        // Switch the sites matching `match` to `state`, Default undoes
+        // earlier switches. Gives back the number of registered sites
+        // that matched.
+        static std::size_t set(Match const& match, SiteState state);
+        // Limit each of the sites matching `match` to `limit` on its
+        // own, messages over the limit are dropped before they are
+        // built. A bucket of `limit.burst` tokens is refilled at
+        // `limit.rate` by a thread of ours, which also logs how many
+        // messages each site turned away every `limit.summary`
+        // through the Log the site first logged through. A Limit with
+        // neither a rate nor sampling removes the limit. Gives back
+        // the number of registered sites that matched.
+        static std::size_t limit(Match const& match, Limit const& limit);
+        // Apply switches and limits given as JSON, a object or a list
+        // of them with "state" set to "on", "off" or "default" and
+        // optionally "file", "line", "logger" and "level" (one of
+        // "debug", "info", "warning" and "panic") as in Match. Limits
+        // are given with "rate", "burst", "sample" and "summary" in
+        // seconds as in Limit, "state" may be left out then. E.g.
+        //   {"state": "on", "file": "net*.cpp", "line": 120}
+        //   {"logger": "root/db", "level": "warning", "rate": 10}
+        // Gives back the number of sites that matched, throws Error if
+        // `command` is malformed.
+        static std::size_t command(std::string const& command);
+        // The sites that have registered so far
+        static std::vector<Info> list();
+        // Forget every switch and limit and put all sites back to
+        // Default
+        static void reset();
+
+        // Used by the macros the first time a site runs
+        static void add(CallSite const& site, Log const& log);
+        // Used by a Log at the top when it goes away
+        static void forget(Log const& log);
+private:
+        // Refills the buckets and logs the summaries, runs on a
+        // thread of its own once the first limit is set
+        static void run();
+};
+
+// A logged message on its way to a Dest, `name` is the full name of
+// the logger. `time` and `thread` are taken when the message is
+// logged, `thread` is a small number given to each thread that logs.
+// A Record only borrows its strings, `file` and `func` are string
+// literals and the rest is valid while the logging call runs, a
+// asynchronous Log copies what it needs.
+struct Record {
+        Level level{0};
+        int line{0};
+        char const* file{""};
+        char const* func{""};
+        std::string_view name{};
+        std::string_view msg{};
+        std::chrono::system_clock::time_point time{};
+        std::uint32_t thread{0};
+        // Set for messages from the deferred macros, `msg` is then
+        // empty and is only put together from the encoded `args` when
+        // the message is formatted, see renderMessage().
+        CallSite const* site{nullptr};
+        std::string_view args{};
+};
+
+// Append the message of a deferred call to `out`, every "{}" in
+// `format` is replaced by the next argument in `args` that isn't a
+// field. The fields are appended as " key=value" if `fields` is set.
+void renderMessage(char const* format, std::string_view args, std::string& out, bool fields = true);
+
+// A field of a structured message, see kv()
+template<typename T>
+struct Field {
+        std::string_view key;
+        T const& value;
+};
+
+// Pass `value` to a deferred logging macro as the field `key`
+template<typename T>
+Field<T> kv(std::string_view key, T const& value) {
+        return Field<T>{key, value};
+}
+
+namespace detail {
+// Deferred arguments are stored as a type tag followed by the value,
+// see Log::deferred(). The key of a field is stored like a Str but with
+// its own tag, followed by the value.
+enum class ArgType : char { Int, UInt, Double, Bool, Char, Str, Key };
+
+template<typename T>
+struct IsField : std::false_type {};
+template<typename T>
+struct IsField<Field<T>> : std::true_type {};
+
+template<typename T>
+std::size_t encodedSize(T const& value) {
+        if constexpr (IsField<T>::value) {
+                return 1 + sizeof(std::uint32_t) + value.key.size() + encodedSize(value.value);
+        } else if constexpr (std::is_same_v<T, bool> || std::is_same_v<T, char>) {
+                return 2;
+        } else if constexpr (std::is_arithmetic_v<T>) {
+                return 1 + 8;
+        } else {
+                static_assert(std::is_convertible_v<T const&, std::string_view>,
+                              "Deferred logging takes numbers, bools, chars and strings");
+                return 1 + sizeof(std::uint32_t) + std::string_view{value}.size();
+        }
+}
+
+template<typename U>
+void put(char*& out, U value) {
+        std::memcpy(out, &value, sizeof(value));
+        out += sizeof(value);
+}
+
+// Append `value` at `out` and move `out` past it
+template<typename T>
+void encode(char*& out, T const& value) {
+        if constexpr (IsField<T>::value) {
+                put(out, ArgType::Key);
+                put(out, static_cast<std::uint32_t>(value.key.size()));
+                std::memcpy(out, value.key.data(), value.key.size());
+                out += value.key.size();
+                encode(out, value.value);
+        } else if constexpr (std::is_same_v<T, bool>) {
+                put(out, ArgType::Bool);
+                put(out, static_cast<char>(value));
+        } else if constexpr (std::is_same_v<T, char>) {
+                put(out, ArgType::Char);
+                put(out, value);
+        } else if constexpr (std::is_floating_point_v<T>) {
+                put(out, ArgType::Double);
+                put(out, static_cast<double>(value));
+        } else if constexpr (std::is_signed_v<T>) {
+                put(out, ArgType::Int);
+                put(out, static_cast<std::int64_t>(value));
+        } else if constexpr (std::is_unsigned_v<T>) {
+                put(out, ArgType::UInt);
+                put(out, static_cast<std::uint64_t>(value));
+        } else {
+                std::string_view s{value};
+                put(out, ArgType::Str);
+                put(out, static_cast<std::uint32_t>(s.size()));
+                std::memcpy(out, s.data(), s.size());
+                out += s.size();
+        }
+}
+} /* namespace detail */
+
+// Reads the arguments of a deferred message one by one, e.g. for a Dest
+// that wants the fields of a Record without rendering it:
+//   logging::ArgReader reader{record.args};
+//   logging::ArgReader::Arg arg;
+//   while (reader.next(arg)) { ... }
+class ArgReader {
+public:
+        using Value = std::variant<std::int64_t, std::uint64_t, double, bool, char, std::string_view>;
+        struct Arg {
+                // The key of a field, empty for other arguments
+                std::string_view key;
+                Value value;
+        };
+
+        explicit ArgReader(std::string_view args) : pos{args.data()}, end{args.data() + args.size()} {}
+
+        // Read the next argument into `arg`, gives back false once
+        // there are no more. The views point into the arguments.
+        bool next(Arg& arg);
+private:
+        char const* pos;
+        char const* end;
+};
+
+// Turns a Record into text. render() is only called by one thread at
+// a time, with the lock of the Log held.
+class Format {
+public:
+        // Append the text for `record` to `out`
+        virtual void render(Record const& record, std::string& out) = 0;
+        // Formats that write the fields of deferred messages on their
+        // own give back true, `msg` is then rendered without them. The
+        // fields are read from `args` with ArgReader.
+        virtual bool takesFields() const { return false; }
+        virtual ~Format() {}
+};
+
+// A format given as a template string, see Log::setFormat(). The
+// template is compiled into a list of literal text and fields once,
+// rendering then is a single pass over that list.
+class TemplateFormat : public Format {
+public:
+        explicit TemplateFormat(std::string const& format);
+
+        void render(Record const& record, std::string& out) override;
+private:
+        enum class Field { Literal, File, Line, Func, Name, Severity, Msg, Time, Thread, Pid };
+        struct Op {
+                Field field;
+                // Where the literal text is within `text`
+                std::size_t offset;
+                std::size_t length;
+        };
+
+        std::vector<Op> ops;
+        // All literal text, back to back
+        std::string text;
+        // Rendering of the time down to the second, only redone when
+        // the second changes.
+        std::int64_t cachedSecond{-1};
+        char cachedTime[32];
+        std::size_t cachedTimeLength{0};
+};
+
+// Writes every message as a JSON object on a line of its own, with the
+// keys "time" (UTC, e.g. "2024-01-01T12:00:00.123456Z"), "level",
+// "logger", "file", "line", "func", "thread" and "msg" followed by the
+// fields of the message. The JSON is written straight into the output,
+// fields keep their types. A field whose key is already taken, by one
+// of the keys above or an earlier field, gets a '_' in front until it
+// isn't, e.g. "_msg".
+class JsonLinesFormat : public Format {
+public:
+        void render(Record const& record, std::string& out) override;
+        bool takesFields() const override { return true; }
+private:
+        std::string time;
+        // Keys of the fields of the message being rendered
+        std::vector<std::string> keys;
+};
+
+// What a asynchronous Log does when its queue is full
+enum class Overflow {
+        // Wait for the writer thread to make room
+        Block,
+        // Throw away the message being logged
+        DropNewest,
+        // Throw away the oldest queued message to make room
+        DropOldest
+};
+
+// How Log::commit() has been doing, see Log::commitStats()
+struct CommitStats {
+        // Calls to commit() and the syncs of the destination made for
+        // them, a sync serves every commit() that waits for it.
+        std::uint64_t commits{0};
+        std::uint64_t syncs{0};
+        // Time spent in commit(), summed up over all calls and the
+        // longest call
+        std::chrono::nanoseconds total{0};
+        std::chrono::nanoseconds max{0};
+};
+
 using LogPtr = std::shared_ptr<Log>;
 
 // Represents something that can do logging
@@ -108,15 +660,93 @@ public:
         // stream at construction
         Log(std::string name, Level level = Level::Info | Level::Warn | Level::Panic, bool threaded = true);
         Log(std::string name, std::unique_ptr<Dest>&& dest, Level level = Level::Info | Level::Warn | Level::Panic, bool threaded = true);
-        virtual ~Log() {}
+        virtual ~Log();
 
         // Decide to where logging should happen
         void setDest(std::unique_ptr<Dest>&& newDest);
 
         // Set a new debugging level, is a bitmask of the various
-        // levels.
+        // levels. Subloggers use the level of the Log at the top.
         void setLevel(Level level);
 
+        // Would a message at `level` be logged or recorded? A single
+        // relaxed load, the macros check this before building the
+        // message.
+        bool isEnabled(Level level) const {
+                return (top->enabledBits.load(std::memory_order_relaxed) & level.bits()) != 0;
+        }
+
+        // Would a message from `site` be logged? The same as above for
+        // sites that haven't been switched or limited, registers the
+        // site the first time. Only messages that would be written
+        // count against the limit of a site, not those from a disabled
+        // logger or those that are only recorded.
+        bool isEnabled(CallSite const& site) const {
+                SiteState state = site.state.load(std::memory_order_relaxed);
+                if (state == SiteState::Default) {
+                        if (!isEnabled(site.level) || !sink()) {
+                                return false;
+                        }
+                        return (top->levelBits.load(std::memory_order_relaxed) & site.level.bits()) == 0 ||
+                                site.admit();
+                }
+                if (state == SiteState::Unknown) {
+                        Sites::add(site, *this);
+                        return isEnabled(site);
+                }
+                return state == SiteState::On && site.admit();
+        }
+
+        // Hand messages to a background thread that formats and
+        // writes them instead of doing it in the logging thread. The
+        // messages wait in a lock free queue of `capacity` entries,
+        // `overflow` decides what happens when it is full. Messages
+        // from subloggers go through the queue of the Log at the top.
+        // Deferred messages, see LINFOF, skip the queue, every thread
+        // gets a ring of `capacity` * 32 bytes for them instead which
+        // lives as long as the writer thread.
+        // Must not be called while other threads log through this
+        // Log, set it up before they start.
+        void startAsync(std::size_t capacity = 8192, Overflow overflow = Overflow::Block);
+        // Write everything that is queued and go back to logging from
+        // the calling thread. Same restrictions as startAsync().
+        void stopAsync();
+        // Wait until everything logged before the call has been
+        // written and flush the destination. Runs of repeats that are
+        // being coalesced are ended, see setCoalescing().
+        void flush();
+        // Number of messages thrown away because the queue was full
+        std::uint64_t dropped() const;
+        // Wait until everything logged before the call is on stable
+        // storage, see Dest::sync(). Callers that commit at the same
+        // time share one sync: while the destination syncs, further
+        // messages are written and the next sync covers all of them.
+        // Works on subloggers as well.
+        void commit();
+        // Counts and latency of commit() so far
+        CommitStats commitStats() const;
+
+        // Keep the last `messages` messages of every thread at
+        // `levels` in memory, whether or not the level of the Log lets
+        // them through. Recording a message copies it into a ring of
+        // the thread, each message takes 256 bytes and longer ones are
+        // cut. The rings are appended to `fileName` in the order the
+        // messages were logged when a panic is logged, when
+        // dumpRecording() is called and on a fatal signal after
+        // dumpRecordingOnCrash(). Rings outlive their threads, what a
+        // thread logged before it exited is dumped as well. Same
+        // restrictions as startAsync().
+        void startRecording(std::string fileName, std::size_t messages = 1024,
+                            Level levels = Level::Dbg | Level::Info | Level::Warn | Level::Panic);
+        void stopRecording();
+        // Append what has been recorded so far to the file
+        void dumpRecording();
+        // Dump the recording when the process gets SIGSEGV, SIGBUS,
+        // SIGFPE, SIGILL or SIGABRT, the signal is raised again with
+        // its default action afterwards. Only the last Log that called
+        // this is dumped.
+        void dumpRecordingOnCrash();
+
         // Create a sublogger that will use the same destination as
         // this one but can be disabled/enabled if the need arises. A
         // new logger is enabled by default.
@@ -134,7 +764,7 @@ public:
         bool enable(std::vector<std::string> path);
 
         // Is the given logger name currently enabled?
-        bool enabled(std::string const& name);
+        bool enabled(std::string_view name);
 
         // TODO: think this through and possibly add support?
         // Start a transaction, the log contents will come in the
@@ -146,55 +776,160 @@ public:
         // begin() gave back.
         // void commit(int id);
 
+        // The logging functions, use the macros instead which fill in
+        // `line`, `file` and `func` and check the level first. `file`
+        // and `func` must be string literals, nothing is copied.
+
         // This is useful when you're trying to debug something
-        virtual void dbg(int line, std::string file, std::string msg);
+        void dbg(int line, char const* file, char const* func, std::string_view msg);
 
         // Inform about some event, nothing that too interesting, just
         // the usual operation of the system.
-        virtual void info(int line, std::string file, std::string msg);
+        void info(int line, char const* file, char const* func, std::string_view msg);
 
         // Warn about some kind of condition that probably isn't nice
         // but won't matter much to use being able to continue
         // running.
-        virtual void warn(int line, std::string file, std::string msg);
+        void warn(int line, char const* file, char const* func, std::string_view msg);
 
         // Something that really should not happen happened, do
-        // exit(EXIT_FAILURE)
-        virtual void panic(int line, std::string file, std::string msg);
+        // exit(EXIT_FAILURE). Everything that was logged before is
+        // written and flushed first, the panic message itself is
+        // written directly even if the Log is asynchronous.
+        void panic(int line, char const* file, char const* func, std::string_view msg);
+
+        // Log `msg` from `site`, what the macros other than the
+        // deferred ones call.
+        void log(CallSite const& site, std::string_view msg);
+
+        // Log a message from a deferred logging macro. Only `site`, the
+        // name of the logger and the values of `args` are copied, the
+        // message is put together by the writer thread when the Log is
+        // asynchronous and right away otherwise.
+        template<typename... Args>
+        void deferred(CallSite const& site, Args const&... args) {
+                Log* target = site.state.load(std::memory_order_relaxed) == SiteState::On ? top : sink();
+                if (!target) {
+                        return;
+                }
+                std::size_t size = (std::size_t{0} + ... + detail::encodedSize(args));
+                if (char* out = target->reserveDeferred(site, *this, size)) {
+                        (detail::encode(out, args), ...);
+                        target->commitDeferred();
+                }
+        }
 
         // Change the format string to newFormat, special tokens in
         // the formatstring are:
         //  * {file} - name of the file where the log function was called
         //  * {line} - line of the file where the log function was called
+        //  * {func} - function where the log function was called
         //  * {name} - name of the logger
         //  * {severity} - severity of the logged message, e.g. warning
         //  * {msg} - the actual log message
+        //  * {time} - when the message was logged, local time with
+        //    milliseconds
+        //  * {thread} - number of the thread that logged the message
+        //  * {pid} - id of the process
+        // Every token may be used any number of times, anything else
+        // is copied as it is.
         void setFormat(std::string newFormat);
+        // Format messages with `newFormat` instead of a template.
+        void setFormat(std::unique_ptr<Format> newFormat);
+        // Coalesce runs of identical messages, only the first message of
+        // a run is written, followed by "last message repeated N times"
+        // once a different message is logged through the same logger
+        // or `timeout` after the first repeat. Messages are the same if
+        // their level and text are. Panics are always written. Without
+        // startAsync() the timeout is only checked when a message is
+        // written and by flush(). A timeout of 0 turns it off, which
+        // is the default.
+        void setCoalescing(std::chrono::milliseconds timeout);
 
         // We do this to be able to work with our macros in a somewhat
         // sensible way. It is not the nicest
         Log& operator*() { return *this; }
 protected:
-        virtual void dbgInternal(int line, std::string file, std::string name, std::string msg);
-        virtual void infoInternal(int line, std::string file, std::string name, std::string msg);
-        virtual void warnInternal(int line, std::string file, std::string name, std::string msg);
-        virtual void panicInternal(int line, std::string file, std::string name, std::string msg);
+        // The Log that writes messages logged through this logger,
+        // nullptr if this logger or one above it is disabled.
+        Log* sink() const {
+                return active.load(std::memory_order_relaxed) ? top : nullptr;
+        }
 
         // TODO: This is kind of nasty, but i don't know how to work around
         // it, we could do: https://stackoverflow.com/questions/6310720/declare-a-member-function-of-a-forward-declared-class-as-friend
         // but that seems like overkill.
         friend class SubLog;
+        friend class Sites;
         
         // Name of this log
         std::string name;
+        // Names of the loggers from the top down to us, separated by
+        // '/', this is what ends up in Record::name.
+        std::string fullName;
 private:
-        std::string levelToString(Level level);
-        // Does actual logging
-        void doLogInternal(Level level, int line, std::string file, std::string name, std::string msg);
-        // Formats a log message according to `format`.
-        std::string formatMsg(std::string level, std::string fullName, int line, std::string file, std::string message);
-        // Replaces a `needl` in the `haystack` with `replacement`.
-        std::string replace(std::string needle, std::string haystack, std::string replacement);
+        class Writer;
+        class FlightRecorder;
+
+        // Where each message in a buffer of rendered messages ends and
+        // its level
+        using Ends = std::vector<std::pair<std::size_t, Level>>;
+
+        // A run of identical messages of a logger, see setCoalescing()
+        struct Repeat {
+                // What the messages of the run are compared by, their
+                // text or the deferred arguments and site
+                std::size_t hash{0};
+                Level level{0};
+                CallSite const* site{nullptr};
+                std::string content;
+                // Repeats of the first message so far, the last of
+                // them, without its views, and when they started
+                std::uint64_t count{0};
+                Record last{};
+                std::chrono::system_clock::time_point since{};
+                // The text of the summary, kept here so that the
+                // Record of it can point into it
+                std::string summary;
+        };
+
+        // Log `record` which was logged through this logger
+        void dispatch(Record const& record);
+        // Create the Record for a message logged through us
+        Record makeRecord(Level level, int line, char const* file, char const* func, std::string_view msg) const;
+        // Does actual logging, `forced` is set for messages from a site
+        // that is switched on and skips the level checks.
+        void doLogInternal(Record const& record, bool forced = false);
+        // Format `record` and give it to the destination, must be
+        // called with the lock held.
+        void write(Record const& record);
+        // Append the text for `record` to `out`, gives back false if
+        // the destination took the record as it is instead. Must be
+        // called with the lock held and a destination set.
+        bool render(Record const& record, std::string& out);
+        // Append the text for `record` to `out` and where it ends to
+        // `ends`, preceded by the summary of a run of repeats that it
+        // ends. Nothing is appended for a repeat. Same rules as
+        // render().
+        void append(Record const& record, std::string& out, Ends& ends);
+        // Append the summaries of the runs of repeats that started
+        // before `before` - timeout, time_point::max() ends all of
+        // them. Same rules as render().
+        void expireRepeats(std::chrono::system_clock::time_point before, std::string& out, Ends& ends);
+        // Write the summaries of all runs of repeats, must be called
+        // with the lock held.
+        void endRepeats();
+        // End the run in `repeat` of the logger `name` and append its
+        // summary
+        void endRepeat(std::string_view name, Repeat& repeat, std::string& out, Ends& ends);
+        // Give the messages in `text` that end at `ends` to the
+        // destination at once, must be called with the lock held.
+        void writeText(std::string const& text, Ends const& ends);
+        // Space for `size` bytes of deferred arguments after the call
+        // site and the name of `origin`, nullptr if the message was
+        // dropped. Must be followed by commitDeferred() on success.
+        char* reserveDeferred(CallSite const& site, Log const& origin, std::size_t size);
+        void commitDeferred();
         
         // Locks/unlocks the mutex if threaded is true.
         void lock();
@@ -204,21 +939,68 @@ private:
         // enabled depending on `val`.
         bool changeState(std::string const& name, bool val);
         bool changeState(std::vector<std::string> path, bool val);
+        // Set `active` to `val` and update our subloggers to match
+        void setActive(bool val);
+        // Is the sublogger at `path` below us, names separated by '/',
+        // and every logger above it enabled? False if there is no such
+        // logger.
+        bool isActive(std::string_view path);
+        // Add a commit() that started at `start` to `commits`, must
+        // be called with `commitMutex` held.
+        void recordCommit(std::chrono::steady_clock::time_point start);
         
         // Where we want to save our log
         std::unique_ptr<Dest> dest;
-        Level level;
+        // Bits of the Level set with setLevel()
+        std::atomic<int> levelBits;
+        // `levelBits` and the levels being recorded, see
+        // startRecording()
+        std::atomic<int> enabledBits;
+        // The top of the sublogger chain, it writes our messages and
+        // its level applies to us.
+        Log* top;
+        // Are we and every logger above us enabled? Kept up to date by
+        // enable() and disable() so that logging doesn't need to walk
+        // up the chain.
+        std::atomic<bool> active{true};
         // Decides how the log should be formatted, see setFormat()
-        std::string format;
+        std::unique_ptr<Format> format;
+        // Messages are rendered here, reused to keep its capacity
+        std::string buffer;
+        Ends bufferEnds;
+        std::vector<Message> messages;
+        // Deferred messages are put together here before formatting
+        std::string message;
         // Should we ensure that logging calls are serialized?
         bool threaded;
         // Used to serialize the logging calls
         std::mutex mutex;
         // Keeps track of our direct children, so that we can
-        // enable/disable them at will
+        // enable/disable them at will. Guarded by `mutex`.
         std::map<std::string, LogPtr> subLoggers;
-        // Stores if a certain logger is enabled or disabled
-        std::map<std::string, bool> subLoggerStates;
+        // Stores if a certain logger is enabled or disabled, guarded
+        // by `mutex`.
+        std::map<std::string, bool, std::less<>> subLoggerStates;
+        // Set while we are asynchronous, see startAsync()
+        std::unique_ptr<Writer> writer;
+        // Set while we are recording, see startRecording()
+        std::unique_ptr<FlightRecorder> recorder;
+        // See setCoalescing(), guarded by `mutex` like the runs of
+        // each logger. `nextExpiry` is when the first of the runs in
+        // `repeats` is due.
+        std::chrono::milliseconds coalesceTimeout{0};
+        std::map<std::string, Repeat, std::less<>> repeats;
+        std::size_t runningRepeats{0};
+        std::chrono::system_clock::time_point nextExpiry{std::chrono::system_clock::time_point::max()};
+        // Messages written by write(), commit() uses it to tell if a
+        // sync is needed.
+        std::atomic<std::uint64_t> writtenCount{0};
+        // Serializes synchronous commits and guards `syncedCount` and
+        // `commits`
+        mutable std::mutex commitMutex;
+        // Value of `writtenCount` when the destination last synced
+        std::uint64_t syncedCount{0};
+        CommitStats commits{};
 
 public:
         // TODO: This gives us memory problems when the dynamic library we might be linked in to is
@@ -227,23 +1009,12 @@ public:
         static Log& root();
 };
 
-// Represents a logger that has a parent logger to which it sends the
-// logging requests
+// Represents a logger that has a parent logger, its messages are
+// written by the Log at the top of the chain. The full name and that
+// Log are looked up once when the sublogger is created.
 class SubLog : public Log {
 public:
         SubLog(std::string name, Log& parent);
-        
-        void dbg(int line, std::string file, std::string msg) override;
-        void info(int line, std::string file, std::string msg) override;
-        void warn(int line, std::string file, std::string msg) override;
-        void panic(int line, std::string file, std::string msg) override;
-protected:
-        void dbgInternal(int line, std::string file, std::string name, std::string msg) override;
-        void infoInternal(int line, std::string file, std::string name, std::string msg) override;
-        void warnInternal(int line, std::string file, std::string name, std::string msg) override;
-        void panicInternal(int line, std::string file, std::string name, std::string msg) override;
-private:
-        Log& parent;
 };
 
 } /* namespace logging */
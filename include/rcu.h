@@ -0,0 +1,94 @@
+#ifndef RCU_H
+#define RCU_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace util {
+
+// Holds a pointer to a immutable `T` that readers can use without ever
+// taking a lock while a writer replaces it, read-copy-update style.
+// Readers enter a read side section with read() and may use the value
+// for as long as they hold on to the Guard. publish() swaps in a new
+// value and then waits until every reader that might have seen the old
+// value has left before deleting it.
+//
+// Readers register in one of two counters chosen by the current epoch,
+// publish() moves new readers over to the other counter and waits for
+// the old one to drain. A thread must not call publish() while it
+// holds a Guard from the same Rcu, that never finishes.
+template<typename T>
+class Rcu {
+public:
+        class Guard {
+        public:
+                Guard(Guard const&) = delete;
+                Guard& operator=(Guard const&) = delete;
+                Guard(Guard&& other) : rcu{other.rcu}, slot{other.slot}, value{other.value} {
+                        other.rcu = nullptr;
+                }
+                ~Guard() {
+                        if (rcu) {
+                                rcu->readers[slot].fetch_sub(1);
+                        }
+                }
+
+                T const* get() const { return value; }
+                T const& operator*() const { return *value; }
+                T const* operator->() const { return value; }
+        private:
+                friend class Rcu;
+                Guard(Rcu const* rcu, unsigned slot, T const* value) : rcu{rcu}, slot{slot}, value{value} {}
+
+                Rcu const* rcu;
+                unsigned slot;
+                T const* value;
+        };
+
+        explicit Rcu(std::unique_ptr<T const> initial) : current{initial.release()} {}
+        Rcu(Rcu const&) = delete;
+        Rcu& operator=(Rcu const&) = delete;
+        ~Rcu() {
+                delete current.load();
+        }
+
+        // Enter a read side section and get the current value.
+        Guard read() const {
+                while (true) {
+                        std::uint64_t e = epoch.load();
+                        unsigned slot = e & 1;
+                        readers[slot].fetch_add(1);
+                        // If the epoch moved on in between, a writer
+                        // might already have checked our counter, try
+                        // again with the new one.
+                        if (epoch.load() == e) {
+                                return Guard{this, slot, current.load()};
+                        }
+                        readers[slot].fetch_sub(1);
+                }
+        }
+
+        // Replace the current value with `next` and delete the old one
+        // once no reader can see it anymore. Writers are serialized.
+        void publish(std::unique_ptr<T const> next) {
+                std::lock_guard<std::mutex> lock{writer};
+                T const* old = current.exchange(next.release());
+                std::uint64_t e = epoch.fetch_add(1);
+                while (readers[e & 1].load() != 0) {
+                        std::this_thread::yield();
+                }
+                delete old;
+        }
+private:
+        std::atomic<T const*> current;
+        mutable std::atomic<std::uint64_t> epoch{0};
+        mutable std::atomic<std::int64_t> readers[2]{{0}, {0}};
+        std::mutex writer;
+};
+
+} /* namespace util */
+
+#endif /* RCU_H */
@@ -11,6 +11,7 @@
 #include <cstring>
 #include <ostream>
 #include <chrono>
+#include <cstdint>
 #include <memory> /* unique_ptr */
 // from https://stackoverflow.com/questions/81870/is-it-possible-to-print-a-variables-type-in-standard-c
 #ifndef _MSC_VER
@@ -157,6 +158,72 @@ struct ExtractionError : std::runtime_error {
         using std::runtime_error::runtime_error;
 };
 
+// is thrown by readFile() and stamp() when the file system is unhappy
+struct IOError : std::runtime_error {
+        using std::runtime_error::runtime_error;
+};
+
+// Identity of a file on disk as given by stat(2). If two stamps of the
+// same path compare equal the file has most likely not been touched in
+// between.
+struct FileStamp {
+        std::uint64_t device{0};
+        std::uint64_t inode{0};
+        std::uint64_t size{0};
+        // Modification time and time of the last change to the inode,
+        // e.g. by a rename, in nanoseconds since the epoch
+        std::int64_t mtime{0};
+        std::int64_t ctime{0};
+
+        bool operator==(FileStamp const& rhs) const {
+                return device == rhs.device && inode == rhs.inode && size == rhs.size && mtime == rhs.mtime &&
+                        ctime == rhs.ctime;
+        }
+        bool operator!=(FileStamp const& rhs) const { return !(*this == rhs); }
+};
+
+// Stat the file `fileName`, throws IOError if that isn't possible.
+FileStamp stamp(std::string const& fileName);
+
+// Read all of `fileName` in one go, throws IOError if the file can't
+// be read.
+std::string readFile(std::string const& fileName);
+
+// Write `contents` to `fileName` so that readers either see the old or
+// the new file, never a partly written one. Throws IOError.
+void writeFileAtomically(std::string const& fileName, std::string const& contents);
+
+// A file mapped read only into memory, unmapped again when the
+// MappedFile is destroyed. Throws IOError if the file can't be mapped.
+class MappedFile {
+public:
+        explicit MappedFile(std::string const& fileName);
+        MappedFile(MappedFile const&) = delete;
+        MappedFile& operator=(MappedFile const&) = delete;
+        ~MappedFile();
+
+        char const* data() const { return ptr; }
+        std::size_t size() const { return len; }
+private:
+        char const* ptr{nullptr};
+        std::size_t len{0};
+};
+
+// 64 bit FNV-1a hash of `len` bytes at `data`, cheap enough to tell
+// if the contents of a file changed.
+inline std::uint64_t hash(char const* data, std::size_t len) {
+        std::uint64_t h{14695981039346656037ull};
+        for (std::size_t i = 0; i < len; ++i) {
+                h ^= static_cast<unsigned char>(data[i]);
+                h *= 1099511628211ull;
+        }
+        return h;
+}
+
+inline std::uint64_t hash(std::string const& s) {
+        return hash(s.data(), s.size());
+}
+
 // Convert a integer to milliseconds
 inline std::chrono::milliseconds ms(typename std::chrono::milliseconds::rep ms) {
         return std::chrono::milliseconds(ms);
@@ -0,0 +1,176 @@
+#include "json_binary.h"
+
+#include <cstdint>
+#include <cstring>
+
+namespace json {
+namespace binary {
+
+namespace {
+        enum Tag : char {
+                BlankTag,
+                NullTag,
+                FalseTag,
+                TrueTag,
+                IntTag,
+                DoubleTag,
+                StrTag,
+                ArrTag,
+                ObjTag
+        };
+
+        template<typename T>
+        void put(std::string& out, T value) {
+                out.append(reinterpret_cast<char const*>(&value), sizeof(value));
+        }
+
+        void putStr(std::string& out, std::string const& s) {
+                put<std::uint32_t>(out, static_cast<std::uint32_t>(s.size()));
+                out.append(s);
+        }
+
+        void encode(std::string& out, Object const& obj) {
+                if (obj.is<Obj>()) {
+                        Obj const& o = obj.into<Obj const&>();
+                        out.push_back(ObjTag);
+                        put<std::uint32_t>(out, static_cast<std::uint32_t>(o.size()));
+                        for (auto const& kv : o) {
+                                putStr(out, kv.first);
+                                encode(out, kv.second);
+                        }
+                } else if (obj.is<Arr>()) {
+                        Arr const& a = obj.into<Arr const&>();
+                        out.push_back(ArrTag);
+                        put<std::uint32_t>(out, static_cast<std::uint32_t>(a.size()));
+                        for (auto const& v : a) {
+                                encode(out, v);
+                        }
+                } else if (obj.is<Str>()) {
+                        out.push_back(StrTag);
+                        putStr(out, obj.into<Str const&>());
+                } else if (obj.is<Int>()) {
+                        out.push_back(IntTag);
+                        put<Int>(out, obj.into<Int>());
+                } else if (obj.is<Double>()) {
+                        out.push_back(DoubleTag);
+                        put<Double>(out, obj.into<Double>());
+                } else if (obj.is<Bool>()) {
+                        out.push_back(obj.into<Bool>() ? TrueTag : FalseTag);
+                } else if (obj.is<Null>()) {
+                        out.push_back(NullTag);
+                } else {
+                        out.push_back(BlankTag);
+                }
+        }
+
+        // Reads values back, every read checks that there are enough
+        // bytes left.
+        class Decoder {
+        public:
+                Decoder(char const* data, std::size_t len) : pos{data}, end{data + len} {}
+
+                void value(Object& res, int depth) {
+                        if (depth > maxDepth) {
+                                throw ParseError{"Encoded tree is nested too deep"};
+                        }
+                        switch (get<char>()) {
+                        case BlankTag:
+                                res = Object{};
+                                break;
+                        case NullTag:
+                                res = Object{Object::ValueType{Null{}}};
+                                break;
+                        case FalseTag:
+                                res = Object{false};
+                                break;
+                        case TrueTag:
+                                res = Object{true};
+                                break;
+                        case IntTag:
+                                res = Object{get<Int>()};
+                                break;
+                        case DoubleTag:
+                                res = Object{get<Double>()};
+                                break;
+                        case StrTag:
+                                res = Object{str()};
+                                break;
+                        case ArrTag: {
+                                std::uint32_t n = get<std::uint32_t>();
+                                // Every value takes at least a byte
+                                need(n);
+                                res = Object{Arr{}};
+                                Arr& a = res.into<Arr&>();
+                                a.resize(n);
+                                for (auto& v : a) {
+                                        value(v, depth + 1);
+                                }
+                                break;
+                        }
+                        case ObjTag: {
+                                std::uint32_t n = get<std::uint32_t>();
+                                res = Object{Obj{}};
+                                Obj& o = res.into<Obj&>();
+                                for (std::uint32_t i = 0; i < n; ++i) {
+                                        // Keys were written in order,
+                                        // each one goes at the end.
+                                        auto it = o.emplace_hint(o.end(), str(), Object{});
+                                        value(it->second, depth + 1);
+                                }
+                                break;
+                        }
+                        default:
+                                throw ParseError{"Unknown tag in encoded tree"};
+                        }
+                }
+
+                bool done() const { return pos == end; }
+        private:
+                static constexpr int maxDepth = 512;
+
+                void need(std::size_t n) const {
+                        if (static_cast<std::size_t>(end - pos) < n) {
+                                throw ParseError{"Encoded tree is truncated"};
+                        }
+                }
+
+                template<typename T>
+                T get() {
+                        need(sizeof(T));
+                        T res;
+                        std::memcpy(&res, pos, sizeof(T));
+                        pos += sizeof(T);
+                        return res;
+                }
+
+                std::string str() {
+                        std::uint32_t n = get<std::uint32_t>();
+                        need(n);
+                        std::string res{pos, n};
+                        pos += n;
+                        return res;
+                }
+
+                char const* pos;
+                char const* end;
+        };
+}
+
+std::string encode(Object const& root) {
+        std::string res;
+        encode(res, root);
+        return res;
+}
+
+Object decode(char const* data, std::size_t len) {
+        Decoder decoder{data, len};
+        Object res;
+        decoder.value(res, 0);
+        if (!decoder.done()) {
+                throw ParseError{"Trailing data after encoded tree"};
+        }
+        return res;
+}
+
+} /* namespace binary */
+} /* namespace json */
@@ -2,131 +2,12 @@
 
 #include "json.h"
 
-namespace json {
-
-std::string Parser::findKey(JsonStructured::Str const& s) const {
-        return findKey(s.begin(), s.end());
-}
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <limits>
 
-std::string Parser::findKey(JsonStructured::Str::const_iterator start, JsonStructured::Str::const_iterator end) const {
-        JsonStructured::Str::const_iterator resStart = end, resEnd = end;
-        for (auto it = start; it != end; ++it) {
-                // Means we've reached the end of a key: value pair,
-                // the key didn't start with a " and therefore we
-                // can't continue
-                if (*it == ':' && resStart == end) {
-                        throw ParseError{util::format("Could not find a key before the value started, looked in `", std::string{start, it}, "' before encountering the beginning of a value. Keys must be quoted.")};
-                }
-                // Means we've reached the end of the object and we can't really do much more.
-                if (*it == '}' && resStart == end) {
-                        return "";
-                }
-                if (*it == '"' && resStart != end && *(it - 1) != '\\') {
-                        resEnd = it;
-                        break;
-                }
-                if (*it == '"' && resStart == end) {
-                        resStart = it + 1;
-                }
-        }
-        assert(resEnd > resStart); // This must always hold true for our cast to be valid down here
-        return std::string{resStart, static_cast<std::string::size_type>(resEnd - resStart)};
-}
-
-Object Parser::parseArr(std::string s) {
-        std::stringstream ss{s};
-        JsonStructured json{ss};
-        std::vector<std::string> values = json.lookupArray({}, true);
-        std::vector<Object> result;
-        for (auto const& val : values) {
-                result.push_back(parseHelper(val));
-        }
-        return Object{result};
-}
-
-Object Parser::parseObj(std::string s) {
-        Obj obj;
-        std::stringstream ss{s};
-        JsonStructured json{ss};
-        
-        //find the first key in this object
-        std::string key = findKey(json.data());
-        if (key == "") {
-                throw ParseError{util::format("Can't find a key for object in input: `", s, "'. Keys must have quotation marks around them.")};
-        }
-
-        // ptr will be a pointer into data() owned by JsonStructured
-        char const* ptr;
-        size_t len;
-        
-        std::tie(ptr, len) = lookupValue(json, key);
-
-        obj[key] = parseHelper(std::string{ptr, len});
-        
-        // find the rest of the keys in this object
-        while (true) {
-                // jump past what we just handled
-                ptr += len;
-                JsonStructured::Str const& data = json.data();
-                key = findKey(data.begin() + (ptr - data.c_str()), data.end());
-                if (key == "") {
-                        break;
-                }
-                std::tie(ptr, len) = lookupValue(json, key);
-                obj[key] = parseHelper(std::string{ptr, len});
-        }
-        return Object{obj};
-}
-
-Object Parser::parseString(std::string const& s) {
-        return Object{util::stripQuotes(s)};
-}
-
-Object Parser::parseInt(std::string const& s) {
-        // this can throw
-        // perhaps 64bit instead?
-        int i = util::extract<int>(s);
-        return Object{i};
-}
-
-Object Parser::parseDouble(std::string const& s) {
-        // this can throw
-        double d = util::extract<double>(s);
-        return Object{d};
-}
-
-Object Parser::parseBool(std::string const& s) {
-        if (s == "true") {
-                return Object{true};
-        } else {
-                return Object{false};
-        }
-}
-
-Object Parser::parseHelper(std::string s) {
-        if (arr(s)) {
-                return parseArr(s);
-        }
-        if (obj(s)) {
-                return parseObj(s);
-        }
-        if (dbl(s)) {
-                return parseDouble(s);
-        }
-        if (i(s)) {
-                return parseInt(s);
-        }
-        if (b(s)) {
-                return parseBool(s);
-        }
-        if (null(s)) {
-                return Object{NullType()};
-        }
-        if (str(s)) {
-                return parseString(s);
-        }
-        throw ParseError{util::format("Encountered unknown token when processing `", s, "'")};
-}
+namespace json {
 
 size_t Parser::iPos(std::string const& s) const {
         if (s.size() < 1) {
@@ -143,29 +24,6 @@ size_t Parser::iPos(std::string const& s) const {
         return s.size() - 1;
 }
 
-std::tuple<char const*, size_t> Parser::lookupValue(JsonStructured& json, std::string const& key) const {
-        char const* ptr;
-        size_t len;
-        std::tie(ptr, len) = json.lookupPath({key});
-        // Make sure that we keep the string delimiters so that we can
-        // properly identify strings if that is needed.
-        if (*(ptr - 1) == '"') {
-                JsonStructured::Str const& data = json.data();
-                if (data.c_str() + data.size() > ptr) {
-                        ptr -= 1;
-                        len += 2;
-                } else {
-                        // This might imply other things than the
-                        // message says, but this'll have to do for
-                        // now
-                        // TODO: More descriptive error message?
-                        ptrdiff_t byteIndex{data.c_str() + data.size() - ptr};
-                        throw ParseError{util::format("Found beginning of string with no end, at byte `", byteIndex, "'")};
-                }
-        }
-        return std::make_tuple(ptr, len);
-}
-
 bool Parser::i(std::string const& s) const {
         size_t pos = iPos(s);
         if (pos == static_cast<size_t>(-1)) {
@@ -234,8 +92,346 @@ bool Parser::arr(std::string const& s) const {
         return find(s, '[');
 }
 
-Object Parser::parse(std::string const& json) {
-        return Parser{}.parseHelper(json);
+Object Parser::parse(std::string const& json, ParseStats* stats /* = nullptr */) {
+        Object res;
+        Parser{}.parseInto(json, res, stats);
+        return res;
+}
+
+template<typename T>
+Object Parser::parseAs(std::string const& s, char const* what) {
+        Object res = parseHelper(s);
+        if (!res.is<T>()) {
+                throw ParseError{util::format("Expected ", what, " but got `", s, "'")};
+        }
+        return res;
+}
+
+Object Parser::parseHelper(std::string s) {
+        Object res;
+        parseInto(s, res);
+        return res;
+}
+
+Object Parser::parseArr(std::string s) {
+        return parseAs<Arr>(s, "a array");
+}
+
+Object Parser::parseObj(std::string s) {
+        return parseAs<Obj>(s, "a object");
+}
+
+Object Parser::parseString(std::string const& s) {
+        return parseAs<Str>(s, "a string");
+}
+
+Object Parser::parseInt(std::string const& s) {
+        return parseAs<Int>(s, "a integer");
+}
+
+Object Parser::parseDouble(std::string const& s) {
+        Object res = parseHelper(s);
+        if (res.is<Int>()) {
+                // "1" is a fine double as well
+                return Object{static_cast<Double>(res.into<Int>())};
+        }
+        if (!res.is<Double>()) {
+                throw ParseError{util::format("Expected a double but got `", s, "'")};
+        }
+        return res;
+}
+
+Object Parser::parseBool(std::string const& s) {
+        return parseAs<Bool>(s, "a bool");
+}
+
+void Parser::parseInto(std::string const& s, Object& dst, ParseStats* stats /* = nullptr */) {
+        parseInto(s.data(), s.size(), dst, stats);
+}
+
+void Parser::parseInto(char const* data, std::size_t len, Object& dst, ParseStats* stats /* = nullptr */) {
+        begin = pos = data;
+        end = data + len;
+        this->stats = stats;
+        if (stats) {
+                *stats = ParseStats{};
+        }
+        skipSpace();
+        if (pos == end) {
+                throw ParseError{"Can't parse empty input as JSON"};
+        }
+        value(dst, 0);
+        skipSpace();
+        if (pos != end) {
+                throw ParseError{util::format("Unexpected trailing characters after JSON value at ", context())};
+        }
+}
+
+namespace {
+        bool isDelimiter(char c) {
+                return c == ',' || c == '}' || c == ']' || c == ':' || c == ' ' || c == '\t' || c == '\n' || c == '\r';
+        }
+
+        // Capacity of a std::string that doesn't use the heap
+        std::size_t const inlineCapacity = std::string{}.capacity();
+
+        // Heap bytes used by `s`, 0 if it is stored inline.
+        std::size_t heapCapacity(std::string const& s) {
+                return s.capacity() > inlineCapacity ? s.capacity() + 1 : 0;
+        }
+
+        // Make `dst` hold a default constructed `T` unless it
+        // already holds one, gives back the held value.
+        template<typename T>
+        T& reuse(Object::ValueType& dst) {
+                T* t = boost::get<T>(&dst);
+                if (!t) {
+                        dst = T{};
+                        t = boost::get<T>(&dst);
+                }
+                return *t;
+        }
+} /* namespace anon */
+
+void Parser::skipSpace() {
+        while (pos != end && (*pos == ' ' || *pos == '\t' || *pos == '\n' || *pos == '\r')) {
+                ++pos;
+        }
+}
+
+std::string Parser::context() const {
+        char const* stop = end - pos > 20 ? pos + 20 : end;
+        return util::format("byte `", pos - begin, "' (`", std::string{pos, stop}, "')");
+}
+
+void Parser::value(Object& dst, std::size_t depth) {
+        skipSpace();
+        if (pos == end) {
+                throw ParseError{"Unexpected end of input while looking for a JSON value"};
+        }
+        if (stats) {
+                ++stats->tokens;
+                stats->maxDepth = std::max(stats->maxDepth, depth);
+        }
+        if ((*pos == '{' || *pos == '[') && depth >= maxDepth) {
+                throw ParseError{util::format("JSON is nested more than ", maxDepth, " levels deep at ", context())};
+        }
+        switch (*pos) {
+        case '{':
+                object(dst, depth);
+                return;
+        case '[':
+                array(dst, depth);
+                return;
+        case '"':
+                string(dst);
+                return;
+        }
+        if (literal("true", 4)) {
+                dst.value = true;
+        } else if (literal("false", 5)) {
+                dst.value = false;
+        } else if (literal("null", 4)) {
+                dst.value = NullType{};
+        } else {
+                number(dst);
+        }
+}
+
+void Parser::object(Object& dst, std::size_t depth) {
+        ++pos;
+        Obj& obj = reuse<Obj>(dst.value);
+        if (seen.size() <= depth) {
+                if (stats && seen.capacity() <= depth) {
+                        ++stats->allocations;
+                }
+                seen.resize(depth + 1);
+        }
+        // `seen` might be reallocated by nested objects, so it is
+        // indexed rather than referenced.
+        seen[depth].clear();
+        while (true) {
+                skipSpace();
+                if (pos == end) {
+                        throw ParseError{"Unexpected end of input inside a JSON object"};
+                }
+                if (*pos == '}') {
+                        ++pos;
+                        break;
+                }
+                if (*pos != '"') {
+                        throw ParseError{util::format("Could not find a key before the value started at ", context(), ". Keys must be quoted.")};
+                }
+                auto k = quoted();
+                std::string_view key{k.first, k.second};
+                skipSpace();
+                if (pos == end || *pos != ':') {
+                        throw ParseError{util::format("Expected `:' after key `", std::string{key}, "' at ", context())};
+                }
+                ++pos;
+                auto it = obj.lower_bound(key);
+                bool inserted = it == obj.end() || it->first != key;
+                if (inserted) {
+                        it = obj.emplace_hint(it, std::string{key}, Object{});
+                }
+                std::size_t seenCapacity = seen[depth].capacity();
+                seen[depth].push_back(&it->second);
+                if (stats) {
+                        ++stats->tokens;
+                        stats->allocations += seen[depth].capacity() != seenCapacity;
+                        if (inserted) {
+                                stats->bytesCopied += key.size();
+                                stats->allocations += 1 + (key.size() > inlineCapacity);
+                        }
+                }
+                value(it->second, depth + 1);
+                skipSpace();
+                if (pos != end && *pos == ',') {
+                        ++pos;
+                }
+        }
+        // Only when keys from a earlier parse are left do we have to
+        // find out which ones to remove.
+        std::vector<Object const*>& keep = seen[depth];
+        if (keep.size() != obj.size()) {
+                std::sort(keep.begin(), keep.end());
+                for (auto it = obj.begin(); it != obj.end();) {
+                        if (std::binary_search(keep.begin(), keep.end(), &it->second)) {
+                                ++it;
+                        } else {
+                                it = obj.erase(it);
+                        }
+                }
+        }
+}
+
+void Parser::array(Object& dst, std::size_t depth) {
+        ++pos;
+        Arr& arr = reuse<Arr>(dst.value);
+        std::size_t n{0};
+        while (true) {
+                skipSpace();
+                if (pos == end) {
+                        throw ParseError{"Unexpected end of input inside a JSON array"};
+                }
+                if (*pos == ']') {
+                        ++pos;
+                        break;
+                }
+                if (n == arr.size()) {
+                        if (stats && arr.size() == arr.capacity()) {
+                                ++stats->allocations;
+                        }
+                        arr.emplace_back();
+                }
+                value(arr[n++], depth + 1);
+                skipSpace();
+                if (pos != end && *pos == ',') {
+                        ++pos;
+                }
+        }
+        arr.resize(n);
+}
+
+std::pair<char const*, std::size_t> Parser::quoted() {
+        char const* start = ++pos;
+        while (pos != end && *pos != '"') {
+                if (*pos == '\\' && pos + 1 != end) {
+                        ++pos;
+                }
+                ++pos;
+        }
+        if (pos == end) {
+                throw ParseError{util::format("Found beginning of string with no end, at byte `", start - 1 - begin, "'")};
+        }
+        return std::make_pair(start, static_cast<std::size_t>(pos++ - start));
+}
+
+void Parser::string(Object& dst) {
+        auto s = quoted();
+        Str& str = reuse<Str>(dst.value);
+        std::size_t capacity = str.capacity();
+        str.assign(s.first, s.second);
+        if (stats) {
+                stats->bytesCopied += s.second;
+                stats->allocations += str.capacity() != capacity;
+        }
+}
+
+bool Parser::literal(char const* word, std::size_t len) {
+        if (static_cast<std::size_t>(end - pos) < len || std::strncmp(pos, word, len) != 0) {
+                return false;
+        }
+        if (pos + len != end && !isDelimiter(pos[len])) {
+                return false;
+        }
+        pos += len;
+        return true;
+}
+
+void Parser::number(Object& dst) {
+        char const* start = pos;
+        while (pos != end && !isDelimiter(*pos)) {
+                ++pos;
+        }
+        char const* p = start;
+        bool negative = p != pos && *p == '-';
+        if (negative) {
+                ++p;
+        }
+        char const* digits = p;
+        Int i{0};
+        bool overflow{false};
+        while (p != pos && std::isdigit(static_cast<unsigned char>(*p))) {
+                Int digit = *p - '0';
+                if (i > (std::numeric_limits<Int>::max() - digit) / 10) {
+                        overflow = true;
+                }
+                i = i * 10 + digit;
+                ++p;
+        }
+        bool valid = p != digits;
+        bool isDouble{false};
+        if (valid && p != pos && *p == '.') {
+                char const* fraction = ++p;
+                while (p != pos && std::isdigit(static_cast<unsigned char>(*p))) {
+                        ++p;
+                }
+                valid = p != fraction;
+                isDouble = true;
+        }
+        if (valid && p != pos && (*p == 'e' || *p == 'E')) {
+                ++p;
+                if (p != pos && (*p == '-' || *p == '+')) {
+                        ++p;
+                }
+                char const* exponent = p;
+                while (p != pos && std::isdigit(static_cast<unsigned char>(*p))) {
+                        ++p;
+                }
+                valid = p != exponent;
+                isDouble = true;
+        }
+        if (!valid || p != pos) {
+                pos = start;
+                throw ParseError{util::format("Encountered unknown token when processing ", context())};
+        }
+        if (isDouble) {
+                // strtod() needs a terminated string, `num` keeps its
+                // capacity between calls.
+                std::size_t capacity = num.capacity();
+                num.assign(start, pos - start);
+                if (stats) {
+                        stats->allocations += num.capacity() != capacity;
+                }
+                dst.value = std::strtod(num.c_str(), nullptr);
+        } else {
+                if (overflow) {
+                        pos = start;
+                        throw ParseError{util::format("Integer doesn't fit in json::Int at ", context())};
+                }
+                dst.value = negative ? -i : i;
+        }
 }
 
 namespace {
@@ -286,12 +482,16 @@ void Object::push(Object value) {
 namespace {
         template<typename T, typename U>
         struct ExtractFromObj : boost::static_visitor<U> {
-                std::string name{};
-                ExtractFromObj(std::string const& name) :
+                std::string_view name{};
+                ExtractFromObj(std::string_view name) :
                         name{name} {}
 
                 U operator()(T val) const {
-                        return val.at(name);
+                        auto it = val.find(name);
+                        if (it == val.end()) {
+                                throw std::out_of_range{util::format("Can't find key `", std::string{name}, "' in object")};
+                        }
+                        return it->second;
                 }
 
                 template<typename V>
@@ -302,16 +502,16 @@ namespace {
 
         template<typename T, typename U>
         struct ExtractFromObjAndAdd : boost::static_visitor<U> {
-                std::string name{};
-                bool create{false};
-                ExtractFromObjAndAdd(std::string const& name) :
+                std::string_view name{};
+                ExtractFromObjAndAdd(std::string_view name) :
                         name{name} {}
 
                 U operator()(T val) const {
-                        if (val.find(name) == val.end()) {
-                                val[name] = Obj();
+                        auto it = val.lower_bound(name);
+                        if (it == val.end() || it->first != name) {
+                                it = val.emplace_hint(it, std::string{name}, Obj());
                         }
-                        return val.at(name);
+                        return it->second;
                 }
 
                 template<typename V>
@@ -321,20 +521,18 @@ namespace {
         };
 }
 
-Object& Object::getOrInsert(std::string const& name) {
+Object& Object::getOrInsert(std::string_view name) {
         if (blank()) {
-                auto val = json::Obj();
-                val[name] = json::Obj();
-                value = val;
+                value = json::Obj();
         }
         return boost::apply_visitor(ExtractFromObjAndAdd<Obj&, Object&>(name), value);
 }
 
-Object const& Object::get(std::string const& name) const {
+Object const& Object::get(std::string_view name) const {
         return boost::apply_visitor(ExtractFromObj<Obj const&, Object const&>(name), value);
 }
 
-Object& Object::get(std::string const& name) {
+Object& Object::get(std::string_view name) {
         return boost::apply_visitor(ExtractFromObj<Obj&, Object&>(name), value);
 }
 
@@ -388,6 +586,58 @@ int Object::length() const {
         return into<Arr>().size();
 }
 
+namespace {
+// Memory used by a value, except for the Object holding it which is
+// accounted for by whoever holds the Object.
+struct Usage : boost::static_visitor<MemoryUsage> {
+        MemoryUsage operator()(Str const& val) const {
+                MemoryUsage res;
+                std::size_t heap = heapCapacity(val);
+                if (heap > 0) {
+                        res.strings = val.size() + 1;
+                        res.slack = heap - res.strings;
+                }
+                return res;
+        }
+
+        MemoryUsage operator()(Arr const& val) const {
+                MemoryUsage res;
+                for (auto const& it : val) {
+                        res += it.memoryUsage();
+                }
+                res.slack += (val.capacity() - val.size()) * sizeof(Object);
+                return res;
+        }
+
+        MemoryUsage operator()(Obj const& val) const {
+                // A map node holds color, parent, left and right in
+                // addition to the value.
+                std::size_t const nodeHeader = 4 * sizeof(void*);
+                MemoryUsage res;
+                for (auto const& it : val) {
+                        res += it.second.memoryUsage();
+                        res.overhead += nodeHeader;
+                        res.keys += sizeof(std::string);
+                        std::size_t heap = heapCapacity(it.first);
+                        if (heap > 0) {
+                                res.keys += it.first.size() + 1;
+                                res.slack += heap - it.first.size() - 1;
+                        }
+                }
+                return res;
+        }
+
+        template<typename T>
+        MemoryUsage operator()(T const&) const { return MemoryUsage{}; }
+};
+} /* namespace anon */
+
+MemoryUsage Object::memoryUsage() const {
+        MemoryUsage res = boost::apply_visitor(Usage(), value);
+        res.nodes += sizeof(Object);
+        return res;
+}
+
 std::string Object::prettyPrint(int depth /* = 4*/) const {
         struct PrettyPrint : boost::static_visitor<std::string> {
                 int depth;
@@ -0,0 +1,124 @@
+#include "json_writer.h"
+
+#include <charconv>
+#include <cmath>
+
+namespace json {
+
+namespace {
+        template<typename T>
+        void appendNumber(std::string& out, T value) {
+                char buf[32];
+                auto res = std::to_chars(buf, buf + sizeof(buf), value);
+                out.append(buf, res.ptr);
+        }
+}
+
+void Writer::separate() {
+        if (!first) {
+                out += ',';
+        }
+        first = false;
+}
+
+Writer& Writer::beginObject() {
+        separate();
+        out += '{';
+        first = true;
+        return *this;
+}
+
+Writer& Writer::endObject() {
+        out += '}';
+        first = false;
+        return *this;
+}
+
+Writer& Writer::beginArray() {
+        separate();
+        out += '[';
+        first = true;
+        return *this;
+}
+
+Writer& Writer::endArray() {
+        out += ']';
+        first = false;
+        return *this;
+}
+
+Writer& Writer::key(std::string_view key) {
+        separate();
+        out += '"';
+        escape(key, out);
+        out += "\":";
+        // The value goes right after the key
+        first = true;
+        return *this;
+}
+
+void Writer::writeBool(bool value) {
+        separate();
+        out += value ? "true" : "false";
+}
+
+void Writer::writeNull() {
+        separate();
+        out += "null";
+}
+
+void Writer::writeDouble(double value) {
+        separate();
+        if (!std::isfinite(value)) {
+                out += "null";
+                return;
+        }
+        appendNumber(out, value);
+}
+
+void Writer::writeInt(std::int64_t value) {
+        separate();
+        appendNumber(out, value);
+}
+
+void Writer::writeUInt(std::uint64_t value) {
+        separate();
+        appendNumber(out, value);
+}
+
+void Writer::writeStr(std::string_view value) {
+        separate();
+        out += '"';
+        escape(value, out);
+        out += '"';
+}
+
+void Writer::escape(std::string_view s, std::string& out) {
+        static constexpr char hex[] = "0123456789abcdef";
+        std::size_t start{0};
+        for (std::size_t i = 0; i < s.size(); ++i) {
+                auto c = static_cast<unsigned char>(s[i]);
+                if (c >= 0x20 && c != '"' && c != '\\') {
+                        continue;
+                }
+                // Copy what didn't need escaping in one go
+                out.append(s.data() + start, i - start);
+                start = i + 1;
+                switch (c) {
+                case '"':  out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\t': out += "\\t"; break;
+                case '\b': out += "\\b"; break;
+                case '\f': out += "\\f"; break;
+                default:
+                        out += "\\u00";
+                        out += hex[c >> 4];
+                        out += hex[c & 0xf];
+                }
+        }
+        out.append(s.data() + start, s.size() - start);
+}
+
+} /* namespace json */
@@ -1,39 +1,1200 @@
 #include "logging.h"
 
 #include "util.h"
+#include "bounded_queue.h"
+#include "json.h"
+#include "json_unstructured.h"
+#include "json_writer.h"
 
 #include <fstream>
 #include <cstdlib>
 #include <stdexcept>
 #include <cassert>
+#include <charconv>
+#include <cstring>
+#include <ctime>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <condition_variable>
+#include <thread>
+
+#include <cerrno>
+#include <climits>
+#include <csignal>
+
+#include <cctype>
+#include <cmath>
+#include <limits>
+#include <optional>
+#include <tuple>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <zlib.h>
 
 namespace logging {
 
-const Level Level::Dbg = Level(1u);
-const Level Level::Info = Level(1u << 1);
-const Level Level::Warn = Level(1u << 2);
-const Level Level::Panic = Level(1u << 3);
+namespace {
+        // Threads are numbered in the order they first log
+        std::uint32_t threadNumber() {
+                static std::atomic<std::uint32_t> next{1};
+                thread_local std::uint32_t number = next.fetch_add(1, std::memory_order_relaxed);
+                return number;
+        }
+
+        template<typename Out, typename T>
+        void appendNumber(Out& out, T value) {
+                char buf[32];
+                auto res = std::to_chars(buf, buf + sizeof(buf), value);
+                out.append(buf, res.ptr);
+        }
+
+        // Start of every deferred message, followed by the name of the
+        // logger and the encoded arguments.
+        struct DeferredHeader {
+                CallSite const* site;
+                std::chrono::system_clock::rep time;
+                std::uint32_t thread;
+                std::uint32_t nameLength;
+        };
+
+        template<typename T>
+        T take(char const*& in) {
+                T res;
+                std::memcpy(&res, in, sizeof(res));
+                in += sizeof(res);
+                return res;
+        }
+
+        // Move `in` past the argument at it without looking at the
+        // value, only past the key for a field
+        void skipArg(char const*& in) {
+                switch (take<detail::ArgType>(in)) {
+                case detail::ArgType::Int:
+                case detail::ArgType::UInt:
+                case detail::ArgType::Double:
+                        in += 8;
+                        break;
+                case detail::ArgType::Bool:
+                case detail::ArgType::Char:
+                        in += 1;
+                        break;
+                case detail::ArgType::Str:
+                case detail::ArgType::Key:
+                        in += take<std::uint32_t>(in);
+                        break;
+                }
+        }
+
+        // Append the argument at `in` to `out` and move `in` past it
+        template<typename Out>
+        void appendArg(char const*& in, Out& out) {
+                switch (take<detail::ArgType>(in)) {
+                case detail::ArgType::Int:
+                        appendNumber(out, take<std::int64_t>(in));
+                        break;
+                case detail::ArgType::UInt:
+                        appendNumber(out, take<std::uint64_t>(in));
+                        break;
+                case detail::ArgType::Double:
+                        appendNumber(out, take<double>(in));
+                        break;
+                case detail::ArgType::Bool:
+                        out += take<char>(in) ? "true" : "false";
+                        break;
+                case detail::ArgType::Char:
+                        out += take<char>(in);
+                        break;
+                case detail::ArgType::Str:
+                case detail::ArgType::Key: {
+                        auto length = take<std::uint32_t>(in);
+                        out.append(in, length);
+                        in += length;
+                        break;
+                }
+                }
+        }
+
+        bool atField(char const* in, char const* end) {
+                return in < end && static_cast<detail::ArgType>(*in) == detail::ArgType::Key;
+        }
+
+        // See renderMessage()
+        template<typename Out>
+        void renderInto(char const* format, std::string_view args, Out& out, bool fields = true) {
+                std::string_view fmt{format};
+                char const* in = args.data();
+                char const* end = in + args.size();
+                std::size_t start{0};
+                std::size_t pos;
+                while ((pos = fmt.find("{}", start)) != std::string_view::npos) {
+                        while (atField(in, end)) {
+                                skipArg(in);
+                                if (in < end) {
+                                        skipArg(in);
+                                }
+                        }
+                        if (in >= end) {
+                                break;
+                        }
+                        out.append(fmt.data() + start, pos - start);
+                        appendArg(in, out);
+                        start = pos + 2;
+                }
+                out.append(fmt.data() + start, fmt.size() - start);
+                if (!fields) {
+                        return;
+                }
+                in = args.data();
+                while (in < end) {
+                        if (!atField(in, end)) {
+                                skipArg(in);
+                                continue;
+                        }
+                        out += ' ';
+                        appendArg(in, out);
+                        // The value may have been cut off by the
+                        // flight recorder
+                        if (in < end) {
+                                out += '=';
+                                appendArg(in, out);
+                        }
+                }
+        }
+
+        // The Record for a deferred entry of `size` bytes, borrows
+        // from `data`.
+        Record decodeDeferred(char const* data, std::size_t size) {
+                auto header = take<DeferredHeader>(data);
+                std::string_view name{data, header.nameLength};
+                std::string_view args{data + header.nameLength, size - sizeof(DeferredHeader) - header.nameLength};
+                CallSite const& site = *header.site;
+                auto time = std::chrono::system_clock::time_point{std::chrono::system_clock::duration{header.time}};
+                return Record{site.level, site.line, site.file, site.func, name, {}, time, header.thread, &site, args};
+        }
+
+        // Deferred messages of one thread on their way to the writer
+        // thread, only the owning thread writes entries and only the
+        // writer thread reads them. Every entry starts with its size,
+        // a entry that doesn't fit before the end of the buffer is
+        // put at the start after a padding marker.
+        class DeferredRing {
+        public:
+                explicit DeferredRing(std::size_t capacity) {
+                        std::size_t size{64};
+                        while (size < capacity) {
+                                size *= 2;
+                        }
+                        mask = size - 1;
+                        buffer.reset(new char[size]);
+                        // Fault the pages in now instead of while logging
+                        std::memset(buffer.get(), 0, size);
+                }
+
+                // Largest entry that is accepted
+                std::size_t maxEntry() const { return (mask + 1) / 4; }
+
+                // Space for a entry of `size` bytes, nullptr if the
+                // ring is full. Only visible to the reader after
+                // commit().
+                char* reserve(std::size_t size) {
+                        std::size_t need = entrySize(size);
+                        std::size_t pos = tail.load(std::memory_order_relaxed);
+                        std::size_t offset = pos & mask;
+                        std::size_t pad = mask + 1 - offset < need ? mask + 1 - offset : 0;
+                        if (pos + pad + need - cachedHead > mask + 1) {
+                                cachedHead = head.load(std::memory_order_acquire);
+                                if (pos + pad + need - cachedHead > mask + 1) {
+                                        return nullptr;
+                                }
+                        }
+                        if (pad) {
+                                std::memcpy(&buffer[offset], &padding, sizeof(padding));
+                                pos += pad;
+                                offset = 0;
+                        }
+                        auto length = static_cast<std::uint32_t>(size);
+                        std::memcpy(&buffer[offset], &length, sizeof(length));
+                        reserved = pos + need;
+                        return &buffer[offset + sizeof(length)];
+                }
+
+                void commit() {
+                        // Sequentially consistent so that the writer
+                        // thread can't go to sleep without seeing it.
+                        tail.store(reserved, std::memory_order_seq_cst);
+                }
+
+                // Reading side, positions only ever grow
+
+                std::size_t begin() const { return head.load(std::memory_order_acquire); }
+                std::size_t end() const { return tail.load(std::memory_order_seq_cst); }
+
+                // The entry at `pos`, nullptr if there is none yet.
+                // Moves `pos` past the entry.
+                char const* read(std::size_t& pos, std::size_t& size) const {
+                        while (pos != end()) {
+                                std::uint32_t length;
+                                std::memcpy(&length, &buffer[pos & mask], sizeof(length));
+                                if (length == padding) {
+                                        pos += mask + 1 - (pos & mask);
+                                        continue;
+                                }
+                                char const* res = &buffer[(pos & mask) + sizeof(length)];
+                                size = length;
+                                pos += entrySize(length);
+                                return res;
+                        }
+                        return nullptr;
+                }
+
+                // Give the space up to `pos` back to the writing thread
+                void release(std::size_t pos) { head.store(pos, std::memory_order_release); }
+
+                // Where the ring had been written up to when the
+                // destination last synced, guarded by the mutex of
+                // the Writer.
+                std::size_t synced{0};
+        private:
+                static constexpr std::uint32_t padding = ~std::uint32_t{0};
+
+                // Entries are kept 8 byte aligned
+                static std::size_t entrySize(std::size_t size) {
+                        return (size + sizeof(std::uint32_t) + 7) & ~std::size_t{7};
+                }
+
+                std::unique_ptr<char[]> buffer;
+                std::size_t mask;
+                // Owned by the writing thread
+                alignas(64) std::atomic<std::size_t> tail{0};
+                std::size_t reserved{0};
+                std::size_t cachedHead{0};
+                alignas(64) std::atomic<std::size_t> head{0};
+        };
+
+        // The rings the thread last used, by id of the Writer
+        struct RingCache {
+                std::uint64_t writer{0};
+                DeferredRing* ring{nullptr};
+        };
+        thread_local RingCache ringCache[4];
+        thread_local unsigned ringCacheNext{0};
+
+        // A deferred message between Log::reserveDeferred() and
+        // Log::commitDeferred(). Messages that are written right away
+        // are encoded into `scratch`.
+        struct PendingDeferred {
+                DeferredRing* ring{nullptr};
+                // The entry and its size, in `ring` or `scratch`
+                char* entry{nullptr};
+                std::size_t size{0};
+                std::string scratch{};
+        };
+        thread_local PendingDeferred pending;
+
+        // Output that goes straight to a file descriptor through a
+        // buffer of its own. Doesn't allocate or call anything that
+        // isn't async signal safe, dumps of the flight recorder use it
+        // from signal handlers.
+        class FdOut {
+        public:
+                explicit FdOut(int fd) : fd{fd} {}
+                FdOut(FdOut const&) = delete;
+                FdOut& operator=(FdOut const&) = delete;
+                ~FdOut() { flush(); }
+
+                void append(char const* data, std::size_t size) {
+                        while (size > 0) {
+                                if (used == sizeof(buf)) {
+                                        flush();
+                                }
+                                std::size_t n = std::min(size, sizeof(buf) - used);
+                                std::memcpy(buf + used, data, n);
+                                used += n;
+                                data += n;
+                                size -= n;
+                        }
+                }
+
+                void append(char const* first, char const* last) {
+                        append(first, static_cast<std::size_t>(last - first));
+                }
+
+                FdOut& operator+=(char const* s) {
+                        append(s, std::strlen(s));
+                        return *this;
+                }
+
+                FdOut& operator+=(char c) {
+                        append(&c, 1);
+                        return *this;
+                }
+
+                void flush() {
+                        std::size_t done{0};
+                        while (done < used) {
+                                ssize_t n = ::write(fd, buf + done, used - done);
+                                if (n < 0 && errno == EINTR) {
+                                        continue;
+                                }
+                                if (n <= 0) {
+                                        break;
+                                }
+                                done += static_cast<std::size_t>(n);
+                        }
+                        used = 0;
+                }
+        private:
+                int fd;
+                char buf[4096];
+                std::size_t used{0};
+        };
+
+        template<typename Out>
+        void appendPadded(Out& out, std::int64_t value, int width) {
+                char buf[24];
+                int n = 0;
+                do {
+                        buf[sizeof(buf) - ++n] = static_cast<char>('0' + value % 10);
+                        value /= 10;
+                } while (value > 0 || n < width);
+                out.append(buf + sizeof(buf) - n, static_cast<std::size_t>(n));
+        }
+
+        // Append `ns` nanoseconds since the epoch as UTC with
+        // microseconds, e.g. "2024-01-01T12:00:00.123456Z". Unlike
+        // localtime_r() this is async signal safe.
+        template<typename Out>
+        void appendUtc(Out& out, std::int64_t ns) {
+                std::int64_t micros = ns / 1000 - (ns % 1000 < 0);
+                std::int64_t secs = micros / 1000000 - (micros % 1000000 < 0);
+                std::int64_t days = secs / 86400 - (secs % 86400 < 0);
+                std::int64_t inDay = secs - days * 86400;
+                // Days to a date in the proleptic Gregorian calendar,
+                // see http://howardhinnant.github.io/date_algorithms.html
+                std::int64_t z = days + 719468;
+                std::int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+                std::int64_t doe = z - era * 146097;
+                std::int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+                std::int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+                std::int64_t mp = (5 * doy + 2) / 153;
+                std::int64_t day = doy - (153 * mp + 2) / 5 + 1;
+                std::int64_t month = mp < 10 ? mp + 3 : mp - 9;
+                std::int64_t year = yoe + era * 400 + (month <= 2);
+                appendPadded(out, year, 4);
+                out += '-';
+                appendPadded(out, month, 2);
+                out += '-';
+                appendPadded(out, day, 2);
+                out += 'T';
+                appendPadded(out, inDay / 3600, 2);
+                out += ':';
+                appendPadded(out, inDay / 60 % 60, 2);
+                out += ':';
+                appendPadded(out, inDay % 60, 2);
+                out += '.';
+                appendPadded(out, micros - secs * 1000000, 6);
+                out += 'Z';
+        }
+}
+
+void renderMessage(char const* format, std::string_view args, std::string& out, bool fields /* = true */) {
+        renderInto(format, args, out, fields);
+}
+
+// The background thread of a asynchronous Log. Logging threads push
+// records into `queue` and deferred messages into their own ring, and
+// only touch `mutex` to wake the thread up when it is sleeping with
+// nothing to write.
+class Log::Writer {
+public:
+        Writer(Log& log, std::size_t capacity, Overflow overflow)
+                : log(log), queue{capacity}, overflow{overflow}, ringCapacity{capacity * 32} {
+                thread = std::thread{[this]() { run(); }};
+        }
+
+        // Writes everything that is still queued before returning
+        ~Writer() {
+                {
+                        std::lock_guard<std::mutex> lock{mutex};
+                        stopping = true;
+                }
+                wake.notify_one();
+                thread.join();
+        }
+
+        void push(Record const& r) {
+                Entry record{r};
+                if (!queue.tryPush(record)) {
+                        switch (overflow) {
+                        case Overflow::Block:
+                                for (int tries = 0; !queue.tryPush(record); ++tries) {
+                                        notify();
+                                        if (tries < 64) {
+                                                std::this_thread::yield();
+                                        } else {
+                                                std::this_thread::sleep_for(std::chrono::microseconds(50));
+                                        }
+                                }
+                                break;
+                        case Overflow::DropNewest:
+                                droppedCount.fetch_add(1, std::memory_order_relaxed);
+                                return;
+                        case Overflow::DropOldest: {
+                                Entry oldest;
+                                while (!queue.tryPush(record)) {
+                                        if (queue.tryPop(oldest)) {
+                                                droppedCount.fetch_add(1, std::memory_order_relaxed);
+                                                done.fetch_add(1);
+                                        }
+                                }
+                                break;
+                        }
+                        }
+                }
+                queued.fetch_add(1);
+                notify();
+        }
+
+        // Space for a deferred entry of `size` bytes in the ring of
+        // the calling thread, nullptr if it was dropped. `ring` is set
+        // to the ring to commit() to.
+        char* reserve(std::size_t size, DeferredRing*& ring) {
+                ring = threadRing();
+                char* res = ring->reserve(size);
+                if (!res) {
+                        if (overflow != Overflow::Block) {
+                                // The oldest entries belong to the
+                                // writer thread, DropOldest drops the
+                                // newest as well.
+                                droppedCount.fetch_add(1, std::memory_order_relaxed);
+                                return nullptr;
+                        }
+                        for (int tries = 0; !(res = ring->reserve(size)); ++tries) {
+                                notify();
+                                if (tries < 64) {
+                                        std::this_thread::yield();
+                                } else {
+                                        std::this_thread::sleep_for(std::chrono::microseconds(50));
+                                }
+                        }
+                }
+                return res;
+        }
+
+        // Hand a reserved entry to the thread
+        void commit(DeferredRing& ring) {
+                ring.commit();
+                notify();
+        }
+
+        // Largest deferred entry that fits in a ring
+        std::size_t maxDeferred() const {
+                return ringCapacity / 4;
+        }
+
+        // Wait until everything queued before the call has been
+        // written
+        void flush() {
+                Ticket ticket = take();
+                std::unique_lock<std::mutex> lock{mutex};
+                wake.notify_one();
+                flushed.wait(lock, [&]() {
+                        return done.load() >= ticket.queued &&
+                                std::all_of(ticket.ends.begin(), ticket.ends.end(), [](auto const& e) {
+                                        return e.first->begin() >= e.second;
+                                });
+                });
+        }
+
+        // Wait until everything queued before the call has been
+        // written and synced, see Log::commit()
+        void commit() {
+                Ticket ticket = take();
+                std::unique_lock<std::mutex> lock{mutex};
+                ++committers;
+                wake.notify_one();
+                flushed.wait(lock, [&]() {
+                        return syncedQueue >= ticket.queued && syncedWrites >= ticket.written &&
+                                std::all_of(ticket.ends.begin(), ticket.ends.end(), [](auto const& e) {
+                                        return e.first->synced >= e.second;
+                                });
+                });
+                --committers;
+        }
+
+        std::uint64_t dropped() const {
+                return droppedCount.load(std::memory_order_relaxed);
+        }
+private:
+        // A Record that owns copies of the strings it borrows. Names
+        // and messages that fit are kept inline so that queueing a
+        // message doesn't allocate, the queue allocates all entries
+        // up front.
+        class Entry {
+        public:
+                Entry() = default;
+                explicit Entry(Record const& r)
+                        : time{r.time}, level{r.level}, line{r.line}, file{r.file}, func{r.func}, thread{r.thread},
+                          site{r.site}, nameLength{r.name.size()}, msgLength{r.msg.size()}, argsLength{r.args.size()} {
+                        char* dst = text;
+                        if (nameLength + msgLength + argsLength > sizeof(text)) {
+                                heap.resize(nameLength + msgLength + argsLength);
+                                dst = &heap[0];
+                        }
+                        // Empty views may have no data at all
+                        std::copy_n(r.name.data(), nameLength, dst);
+                        std::copy_n(r.msg.data(), msgLength, dst + nameLength);
+                        std::copy_n(r.args.data(), argsLength, dst + nameLength + msgLength);
+                }
+
+                Record record() const {
+                        char const* src = heap.empty() ? text : heap.data();
+                        return Record{level, line, file, func, std::string_view{src, nameLength},
+                                      std::string_view{src + nameLength, msgLength}, time, thread, site,
+                                      std::string_view{src + nameLength + msgLength, argsLength}};
+                }
+                std::chrono::system_clock::time_point time{};
+        private:
+                Level level{0};
+                int line{0};
+                char const* file{""};
+                char const* func{""};
+                std::uint32_t thread{0};
+                CallSite const* site{nullptr};
+                std::size_t nameLength{0};
+                std::size_t msgLength{0};
+                std::size_t argsLength{0};
+                char text[192];
+                std::string heap{};
+        };
+
+        // The ring of the calling thread, created on first use
+        DeferredRing* threadRing() {
+                for (auto const& cached : ringCache) {
+                        if (cached.writer == id) {
+                                return cached.ring;
+                        }
+                }
+                DeferredRing* ring{nullptr};
+                {
+                        std::lock_guard<std::mutex> lock{ringsMutex};
+                        auto self = std::this_thread::get_id();
+                        for (auto const& r : rings) {
+                                if (r.first == self) {
+                                        ring = r.second.get();
+                                }
+                        }
+                        if (!ring) {
+                                rings.emplace_back(self, util::make_unique<DeferredRing>(ringCapacity));
+                                ring = rings.back().second.get();
+                        }
+                }
+                ringCache[ringCacheNext++ % 4] = RingCache{id, ring};
+                return ring;
+        }
+
+        // Move the deferred entries of all rings into `batch`, the
+        // space they took is released by releaseRings() once they have
+        // been written. Gives back the number of rings that had any.
+        std::size_t drainRings(std::vector<Entry>& batch) {
+                std::lock_guard<std::mutex> lock{ringsMutex};
+                std::size_t any{0};
+                for (auto const& r : rings) {
+                        DeferredRing& ring = *r.second;
+                        std::size_t pos = ring.begin();
+                        std::size_t size;
+                        std::size_t taken{0};
+                        while (taken < batchSize) {
+                                char const* data = ring.read(pos, size);
+                                if (!data) {
+                                        break;
+                                }
+                                batch.emplace_back(decodeDeferred(data, size));
+                                ++taken;
+                        }
+                        if (taken) {
+                                drained.emplace_back(&ring, pos);
+                                ++any;
+                        }
+                }
+                return any;
+        }
+
+        void releaseRings() {
+                for (auto const& d : drained) {
+                        d.first->release(d.second);
+                }
+                drained.clear();
+        }
+
+        bool ringsEmpty() {
+                std::lock_guard<std::mutex> lock{ringsMutex};
+                return std::all_of(rings.begin(), rings.end(), [](auto const& r) {
+                        return r.second->begin() == r.second->end();
+                });
+        }
+
+        // What has to be written for a flush() or commit() to return
+        struct Ticket {
+                std::uint64_t queued;
+                std::uint64_t written;
+                std::vector<std::pair<DeferredRing const*, std::size_t>> ends;
+        };
+
+        Ticket take() {
+                Ticket res{queued.load(), log.writtenCount.load(), {}};
+                std::lock_guard<std::mutex> lock{ringsMutex};
+                for (auto const& r : rings) {
+                        res.ends.emplace_back(r.second.get(), r.second->end());
+                }
+                return res;
+        }
+
+        // Is a commit() waiting and has anything been written since
+        // the last sync? Must be called with `mutex` held.
+        bool unsynced() {
+                if (!committers) {
+                        return false;
+                }
+                if (done.load() != syncedQueue || log.writtenCount.load() != syncedWrites) {
+                        return true;
+                }
+                std::lock_guard<std::mutex> lock{ringsMutex};
+                return std::any_of(rings.begin(), rings.end(), [](auto const& r) {
+                        return r.second->begin() != r.second->synced;
+                });
+        }
+
+        // Sync the destination if a commit() waits for it. Everything
+        // written by now is covered, commits that came in while the
+        // batch was written share the sync.
+        void sync() {
+                std::uint64_t doneCount;
+                std::uint64_t writtenCount;
+                std::vector<std::pair<DeferredRing*, std::size_t>> positions;
+                {
+                        std::lock_guard<std::mutex> lock{mutex};
+                        if (!unsynced()) {
+                                return;
+                        }
+                        doneCount = done.load();
+                        writtenCount = log.writtenCount.load();
+                        std::lock_guard<std::mutex> ringsLock{ringsMutex};
+                        for (auto const& r : rings) {
+                                positions.emplace_back(r.second.get(), r.second->begin());
+                        }
+                }
+                log.lock();
+                if (log.dest) {
+                        log.dest->sync();
+                }
+                log.unlock();
+                {
+                        std::lock_guard<std::mutex> lock{log.commitMutex};
+                        ++log.commits.syncs;
+                }
+                std::lock_guard<std::mutex> lock{mutex};
+                syncedQueue = doneCount;
+                syncedWrites = writtenCount;
+                for (auto const& p : positions) {
+                        p.first->synced = p.second;
+                }
+                flushed.notify_all();
+        }
+
+        // Render `batch` and hand all of it to the destination at once,
+        // the lock of the Log must be held.
+        void writeBatch(std::vector<Entry> const& batch) {
+                if (!log.dest) {
+                        return;
+                }
+                text.clear();
+                ends.clear();
+                for (auto const& entry : batch) {
+                        log.append(entry.record(), text, ends);
+                }
+                log.writeText(text, ends);
+        }
+
+        // Write the summaries of runs of repeats that are due, or of
+        // all of them
+        void expireRepeats(bool all) {
+                auto now = all ? std::chrono::system_clock::time_point::max() : std::chrono::system_clock::now();
+                log.lock();
+                if (log.dest && log.runningRepeats && now >= log.nextExpiry) {
+                        text.clear();
+                        ends.clear();
+                        log.expireRepeats(now, text, ends);
+                        log.writeText(text, ends);
+                        log.dest->flush();
+                }
+                log.unlock();
+        }
+
+        // Wake up the thread if it is waiting for records
+        void notify() {
+                // Only the first thread to notice wakes it up, the rest
+                // don't need to touch the mutex.
+                if (sleeping.load() && sleeping.exchange(false)) {
+                        std::lock_guard<std::mutex> lock{mutex};
+                        wake.notify_one();
+                }
+        }
+
+        void run() {
+                std::vector<Entry> batch;
+                batch.reserve(batchSize);
+                Entry record;
+                while (true) {
+                        while (batch.size() < batchSize && queue.tryPop(record)) {
+                                batch.push_back(std::move(record));
+                        }
+                        std::size_t queuedCount = batch.size();
+                        std::size_t sources = drainRings(batch) + (queuedCount ? 1 : 0);
+                        if (sources > 1) {
+                                // Keep the order in which messages were
+                                // logged across the queue and the rings,
+                                // each of them is in order already
+                                std::stable_sort(batch.begin(), batch.end(), [](Entry const& a, Entry const& b) {
+                                        return a.time < b.time;
+                                });
+                        }
+                        if (!batch.empty()) {
+                                log.lock();
+                                writeBatch(batch);
+                                if (queue.empty() && ringsEmpty() && log.dest) {
+                                        log.dest->flush();
+                                }
+                                log.unlock();
+                                releaseRings();
+                                done.fetch_add(queuedCount);
+                                batch.clear();
+                                sync();
+                                std::lock_guard<std::mutex> lock{mutex};
+                                flushed.notify_all();
+                                continue;
+                        }
+                        expireRepeats(false);
+                        sync();
+
+                        std::unique_lock<std::mutex> lock{mutex};
+                        sleeping.store(true);
+                        if (queue.empty() && ringsEmpty() && !unsynced()) {
+                                if (stopping) {
+                                        sleeping.store(false);
+                                        lock.unlock();
+                                        expireRepeats(true);
+                                        sync();
+                                        return;
+                                }
+                                // The timeout only matters if a wake up
+                                // is lost, which notify() prevents.
+                                wake.wait_for(lock, std::chrono::milliseconds(100));
+                        }
+                        sleeping.store(false);
+                }
+        }
+
+        static constexpr std::size_t batchSize = 256;
+
+        Log& log;
+        util::BoundedQueue<Entry> queue;
+        Overflow overflow;
+        // Tells our rings apart from those of other Writers in
+        // `ringCache`
+        std::uint64_t id{nextId()};
+        std::size_t ringCapacity;
+        // Rings of all threads that have logged deferred messages
+        // through us, by thread
+        std::mutex ringsMutex;
+        std::vector<std::pair<std::thread::id, std::unique_ptr<DeferredRing>>> rings;
+        // Where each ring was drained up to for the batch being written
+        std::vector<std::pair<DeferredRing*, std::size_t>> drained;
+        // The text of the batch being written and where each message
+        // in it ends
+        std::string text;
+        Ends ends;
+        // Records pushed so far and records written or dropped so far,
+        // flush() waits for the latter to catch up.
+        std::atomic<std::uint64_t> queued{0};
+        std::atomic<std::uint64_t> done{0};
+        std::atomic<std::uint64_t> droppedCount{0};
+        std::atomic<bool> sleeping{false};
+        // Threads waiting in commit() and the values of `done` and
+        // Log::writtenCount at the last sync, guarded by `mutex`
+        std::size_t committers{0};
+        std::uint64_t syncedQueue{0};
+        std::uint64_t syncedWrites{0};
+
+        static std::uint64_t nextId() {
+                static std::atomic<std::uint64_t> next{1};
+                return next.fetch_add(1);
+        }
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable flushed;
+        bool stopping{false};
+        std::thread thread;
+};
+
+// Keeps the last messages of every thread in memory, see
+// Log::startRecording(). Every thread writes to a ring of its own and
+// never waits. A slot carries a sequence number that is odd while the
+// slot is written, dump() skips slots that change while it reads them
+// so that it can run at any time, also from a signal handler.
+class Log::FlightRecorder {
+public:
+        FlightRecorder(std::string fileName, std::size_t messages, Level levels)
+                : fileName{std::move(fileName)}, levelBits{levels.bits()} {
+                slots = 16;
+                while (slots < messages) {
+                        slots *= 2;
+                }
+        }
+
+        ~FlightRecorder() {
+                FlightRecorder* self = this;
+                crashRecorder.compare_exchange_strong(self, nullptr);
+                for (Ring* ring = rings.load(); ring;) {
+                        Ring* next = ring->next;
+                        delete ring;
+                        ring = next;
+                }
+        }
+
+        int levels() const {
+                return levelBits;
+        }
+
+        // Copy `record` into the ring of the calling thread if its
+        // level is recorded
+        void record(Record const& record) {
+                if (!(record.level.bits() & levelBits)) {
+                        return;
+                }
+                Ring& ring = threadRing();
+                std::uint64_t pos = ring.written.load(std::memory_order_relaxed);
+                Slot& slot = ring.slots[pos & (slots - 1)];
+                slot.seq.store(2 * pos + 1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+
+                Contents& c = slot.contents;
+                c.time = std::chrono::duration_cast<std::chrono::nanoseconds>(record.time.time_since_epoch()).count();
+                c.site = record.site;
+                c.level = record.level.bits();
+                c.thread = record.thread;
+                std::size_t nameLength = std::min(record.name.size(), maxName);
+                std::copy_n(record.name.data(), nameLength, c.data);
+                std::string_view text = record.site ? record.args : record.msg;
+                std::size_t length = text.size();
+                std::size_t room = sizeof(c.data) - nameLength;
+                c.cut = length > room;
+                if (c.cut) {
+                        length = record.site ? argsFitting(text, room) : room;
+                }
+                std::copy_n(text.data(), length, c.data + nameLength);
+                c.nameLength = static_cast<std::uint16_t>(nameLength);
+                c.length = static_cast<std::uint16_t>(length);
+
+                slot.seq.store(2 * pos + 2, std::memory_order_release);
+                ring.written.store(pos + 1, std::memory_order_release);
+        }
+
+        // Append the messages of all rings to the file, oldest first.
+        // A dump that starts while another one runs does nothing.
+        void dump(char const* reason) {
+                if (dumping.exchange(true)) {
+                        return;
+                }
+                int fd = ::open(fileName.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+                if (fd >= 0) {
+                        {
+                                FdOut out{fd};
+                                out += "--- flight recorder dump (";
+                                out += reason;
+                                out += ") at ";
+                                appendUtc(out, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                std::chrono::system_clock::now().time_since_epoch()).count());
+                                out += " ---\n";
+                                dumpRings(out);
+                        }
+                        ::close(fd);
+                }
+                dumping.store(false);
+        }
+
+        // Dump this recorder on fatal signals
+        void dumpOnCrash() {
+                crashRecorder.store(this);
+                struct sigaction action{};
+                action.sa_handler = onSignal;
+                sigemptyset(&action.sa_mask);
+                action.sa_flags = SA_RESETHAND;
+                for (int signal : {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT}) {
+                        ::sigaction(signal, &action, nullptr);
+                }
+        }
+private:
+        static constexpr std::size_t slotSize = 256;
+        // Longest logger name that is kept
+        static constexpr std::size_t maxName = 64;
+
+        // A recorded message, `data` holds the name of the logger
+        // followed by the message or, for deferred messages, their
+        // encoded arguments.
+        struct Contents {
+                std::int64_t time;
+                CallSite const* site;
+                int level;
+                std::uint32_t thread;
+                std::uint16_t nameLength;
+                std::uint16_t length;
+                // Was the message too long for the slot?
+                bool cut;
+                char data[slotSize - 37];
+        };
+        struct Slot {
+                std::atomic<std::uint64_t> seq{0};
+                Contents contents;
+        };
+        static_assert(sizeof(Slot) == slotSize, "Slots should fill whole cache lines");
+
+        struct Ring {
+                Ring(std::size_t slots, std::thread::id owner) : slots{new Slot[slots]}, owner{owner} {}
+
+                std::unique_ptr<Slot[]> slots;
+                std::thread::id owner;
+                // Messages written so far, only the owner writes it
+                std::atomic<std::uint64_t> written{0};
+                // The ring that was added before this one
+                Ring* next{nullptr};
+                // State of dump(): the next message and where to stop,
+                // `current` is a copy of the message at `dumpPos` if
+                // `loaded` is set.
+                std::uint64_t dumpPos{0};
+                std::uint64_t dumpEnd{0};
+                bool loaded{false};
+                Contents current;
+        };
+
+        // The ring of the calling thread. Threads that exit leave their
+        // ring behind, a thread that gets the same id later takes it
+        // over.
+        Ring& threadRing() {
+                for (auto const& cached : recorderCache) {
+                        if (cached.recorder == id) {
+                                return *cached.ring;
+                        }
+                }
+                std::lock_guard<std::mutex> lock{mutex};
+                auto self = std::this_thread::get_id();
+                Ring* ring = rings.load(std::memory_order_relaxed);
+                while (ring && ring->owner != self) {
+                        ring = ring->next;
+                }
+                if (!ring) {
+                        ring = new Ring{slots, self};
+                        ring->next = rings.load(std::memory_order_relaxed);
+                        rings.store(ring, std::memory_order_release);
+                }
+                recorderCache[recorderCacheNext++ % 4] = RecorderCache{id, ring};
+                return *ring;
+        }
+
+        // Length of the arguments at the start of `args` that fit in
+        // `room` bytes
+        static std::size_t argsFitting(std::string_view args, std::size_t room) {
+                char const* in = args.data();
+                char const* fits = in;
+                while (in < args.data() + args.size()) {
+                        // A field only fits with its value
+                        if (atField(in, args.data() + args.size())) {
+                                skipArg(in);
+                        }
+                        skipArg(in);
+                        if (static_cast<std::size_t>(in - args.data()) > room) {
+                                break;
+                        }
+                        fits = in;
+                }
+                return static_cast<std::size_t>(fits - args.data());
+        }
+
+        // Copy the message at `ring.dumpPos` into `ring.current`,
+        // skipping those that were overwritten. Gives back false at
+        // the end of what is dumped.
+        bool load(Ring& ring) {
+                while (ring.dumpPos < ring.dumpEnd) {
+                        std::uint64_t oldest = ring.written.load(std::memory_order_acquire);
+                        oldest = oldest > slots ? oldest - slots : 0;
+                        ring.dumpPos = std::max(ring.dumpPos, oldest);
+                        Slot const& slot = ring.slots[ring.dumpPos & (slots - 1)];
+                        std::uint64_t seq = slot.seq.load(std::memory_order_acquire);
+                        if (seq == 2 * ring.dumpPos + 2) {
+                                std::memcpy(&ring.current, &slot.contents, sizeof(Contents));
+                                std::atomic_thread_fence(std::memory_order_acquire);
+                                if (slot.seq.load(std::memory_order_relaxed) == seq) {
+                                        return true;
+                                }
+                        }
+                        ++ring.dumpPos;
+                }
+                return false;
+        }
+
+        // Write the rings merged by time
+        void dumpRings(FdOut& out) {
+                Ring* first = rings.load(std::memory_order_acquire);
+                for (Ring* ring = first; ring; ring = ring->next) {
+                        ring->dumpEnd = ring->written.load(std::memory_order_acquire);
+                        ring->dumpPos = ring->dumpEnd > slots ? ring->dumpEnd - slots : 0;
+                        ring->loaded = load(*ring);
+                }
+                while (true) {
+                        Ring* oldest{nullptr};
+                        for (Ring* ring = first; ring; ring = ring->next) {
+                                if (ring->loaded && (!oldest || ring->current.time < oldest->current.time)) {
+                                        oldest = ring;
+                                }
+                        }
+                        if (!oldest) {
+                                return;
+                        }
+                        writeMessage(out, oldest->current);
+                        ++oldest->dumpPos;
+                        oldest->loaded = load(*oldest);
+                }
+        }
+
+        static void writeMessage(FdOut& out, Contents const& c) {
+                appendUtc(out, c.time);
+                out += " [";
+                out += Level{c.level}.name();
+                out += " (";
+                out.append(c.data, c.nameLength);
+                out += ") ";
+                appendNumber(out, c.thread);
+                out += "]: ";
+                std::string_view text{c.data + c.nameLength, c.length};
+                if (c.site) {
+                        renderInto(c.site->format, text, out);
+                } else {
+                        out.append(text.data(), text.size());
+                }
+                if (c.cut) {
+                        out += "...";
+                }
+                out += '\n';
+        }
+
+        static void onSignal(int signal) {
+                if (FlightRecorder* recorder = crashRecorder.load()) {
+                        switch (signal) {
+                        case SIGSEGV: recorder->dump("SIGSEGV"); break;
+                        case SIGBUS: recorder->dump("SIGBUS"); break;
+                        case SIGFPE: recorder->dump("SIGFPE"); break;
+                        case SIGILL: recorder->dump("SIGILL"); break;
+                        default: recorder->dump("SIGABRT"); break;
+                        }
+                }
+                // The default action is back in place, it takes over
+                // once we return
+                ::raise(signal);
+        }
+
+        static std::uint64_t nextId() {
+                static std::atomic<std::uint64_t> next{1};
+                return next.fetch_add(1);
+        }
+
+        // The rings the thread last used, by id of the recorder
+        struct RecorderCache {
+                std::uint64_t recorder{0};
+                Ring* ring{nullptr};
+        };
+        static thread_local RecorderCache recorderCache[4];
+        static thread_local unsigned recorderCacheNext;
+        // The recorder that is dumped on fatal signals
+        static std::atomic<FlightRecorder*> crashRecorder;
+
+        std::string fileName;
+        int levelBits;
+        // Slots in each ring, a power of 2
+        std::size_t slots;
+        std::uint64_t id{nextId()};
+        // Guards adding rings, they are read without it
+        std::mutex mutex;
+        // The most recently added ring, each points to the one before
+        std::atomic<Ring*> rings{nullptr};
+        std::atomic<bool> dumping{false};
+};
+
+thread_local Log::FlightRecorder::RecorderCache Log::FlightRecorder::recorderCache[4];
+thread_local unsigned Log::FlightRecorder::recorderCacheNext{0};
+std::atomic<Log::FlightRecorder*> Log::FlightRecorder::crashRecorder{nullptr};
 
 //TODO: Should we just coarsely lock every function or do we want to
 //device something smart? Probably doesn't matter too much if we do
 //the coarse thing?
 LogPtr Log::sub(std::string const& name) {
+        auto res = std::make_shared<SubLog>(name, *this);
         lock();
-        subLoggers[name] = std::make_shared<SubLog>(name, *this);
+        res->active.store(active.load());
+        subLoggers[name] = res;
         subLoggerStates[name] = true;
         unlock();
-        return subLoggers[name];
+        return res;
 }
 
 bool Log::changeState(std::string const& name, bool val) {
+        lock();
         auto it = subLoggerStates.find(name);
         bool found = it != subLoggerStates.end();
         if (found) {
-                it->second = false;
+                it->second = val;
+                auto child = subLoggers.find(name);
+                if (child != subLoggers.end()) {
+                        child->second->setActive(val && active.load());
+                }
         }
+        unlock();
         return found;
 }
 
+void Log::setActive(bool val) {
+        lock();
+        active.store(val);
+        for (auto const& child : subLoggers) {
+                child.second->setActive(val && subLoggerStates[child.first]);
+        }
+        unlock();
+}
+
+bool Log::isActive(std::string_view path) {
+        if (!active.load()) {
+                return false;
+        }
+        if (path.empty()) {
+                return true;
+        }
+        std::size_t slash = path.find('/');
+        LogPtr child;
+        lock();
+        auto it = subLoggers.find(std::string{path.substr(0, slash)});
+        if (it != subLoggers.end()) {
+                child = it->second;
+        }
+        unlock();
+        return child && child->isActive(slash == std::string_view::npos ? std::string_view{} : path.substr(slash + 1));
+}
+
 bool Log::changeState(std::vector<std::string> path, bool val) {
         assert(path.size() > 0);
         if (path.size() == 1) {
@@ -41,10 +1202,13 @@ bool Log::changeState(std::vector<std::string> path, bool val) {
         } else if (path.size() == 2) {
                 return changeState(path[1], val);
         } else {
+                lock();
                 auto it = subLoggers.find(path.at(1));
-                if (it != subLoggers.end()) {
+                LogPtr child = it != subLoggers.end() ? it->second : nullptr;
+                unlock();
+                if (child) {
                         auto v = std::vector<std::string>(path.begin() + 1, path.end());
-                        return it->second->changeState(v, val);
+                        return child->changeState(v, val);
                 }
         }
         return false;
@@ -67,153 +1231,549 @@ bool Log::enable(std::string const& name) {
 }
 
 SubLog::SubLog(std::string name, Log& parent)
-        : Log{name}, parent(parent) {}
-
-void SubLog::dbg(int line, std::string file, std::string msg) {
-        parent.dbgInternal(line, file, name, msg);
+        : Log{name} {
+        top = parent.top;
+        fullName = parent.fullName + "/" + this->name;
 }
 
-void SubLog::info(int line, std::string file, std::string msg) {
-        parent.infoInternal(line, file, name, msg);
+bool Log::enabled(std::string_view name) {
+        lock();
+        auto it = subLoggerStates.find(name);
+        bool res = it != subLoggerStates.end() && it->second;
+        unlock();
+        return res;
 }
 
-void SubLog::warn(int line, std::string file, std::string msg) {
-        parent.warnInternal(line, file, name, msg);
-}
+Log::Log(std::string name, std::unique_ptr<Dest>&& dest, Level level /* = Level::Info | Level::Warn | Level::Panic */, bool threaded /* = true */)
+        : name{name}, fullName{name}, dest{std::move(dest)}, levelBits{level.bits()}, enabledBits{level.bits()}, top{this},
+          format{util::make_unique<TemplateFormat>("[{severity} ({name})]: {msg}\n")},
+          threaded{threaded} {}
 
-void SubLog::panic(int line, std::string file, std::string msg) {
-        parent.panicInternal(line, file, name, msg);       
-}
+Log::Log(std::string name, Level level /* = Level::Info | Level::Warn | Level::Panic */, bool threaded /* = true */)
+        : Log{name, util::make_unique<StdOutDest>(), level, threaded} {}
 
-void SubLog::dbgInternal(int line, std::string file, std::string name, std::string msg) {
-        if (enabled(name)) {
-                parent.dbgInternal(line, file, this->name + "/" + name, msg);
+Log::~Log() {
+        if (top == this) {
+                Sites::forget(*this);
         }
+        stopAsync();
+        lock();
+        endRepeats();
+        unlock();
 }
 
-void SubLog::infoInternal(int line, std::string file, std::string name, std::string msg) {
-        if (enabled(name)) {
-                parent.infoInternal(line, file, this->name + "/" + name, msg);
-        }
+void Log::startAsync(std::size_t capacity /* = 8192 */, Overflow overflow /* = Overflow::Block */) {
+        stopAsync();
+        writer = util::make_unique<Writer>(*this, capacity, overflow);
 }
 
-void SubLog::warnInternal(int line, std::string file, std::string name, std::string msg) {
-        if (enabled(name)) {
-                parent.warnInternal(line, file, this->name + "/" + name, msg);
-        }
+void Log::stopAsync() {
+        writer.reset();
 }
 
-void SubLog::panicInternal(int line, std::string file, std::string name, std::string msg) {
-        if (enabled(name)) {
-                parent.panicInternal(line, file, this->name + "/" + name, msg);
+void Log::flush() {
+        if (writer) {
+                writer->flush();
+        }
+        lock();
+        endRepeats();
+        if (dest) {
+                dest->flush();
         }
+        unlock();
 }
 
-bool Log::enabled(std::string const& name) {
-        auto it = subLoggerStates.find(name);
-        if (it != subLoggerStates.end()) {
-                return it->second;
+std::uint64_t Log::dropped() const {
+        return writer ? writer->dropped() : 0;
+}
+
+void Log::commit() {
+        auto start = std::chrono::steady_clock::now();
+        if (top->writer) {
+                top->writer->commit();
+                std::lock_guard<std::mutex> commitLock{top->commitMutex};
+                top->recordCommit(start);
+                return;
         }
-        return false;
+        std::uint64_t ticket = top->writtenCount.load();
+        // Whoever holds the lock syncs for everyone that waits behind
+        // it, they find their messages synced once they get it.
+        std::lock_guard<std::mutex> commitLock{top->commitMutex};
+        if (top->syncedCount < ticket) {
+                top->lock();
+                std::uint64_t written = top->writtenCount.load();
+                if (top->dest) {
+                        top->dest->sync();
+                }
+                top->unlock();
+                top->syncedCount = written;
+                ++top->commits.syncs;
+        }
+        top->recordCommit(start);
 }
 
-Log::Log(std::string name, std::unique_ptr<Dest>&& dest, Level level /* = Level::Info | Level::Warn | Level::Panic */, bool threaded /* = true */)
-        : name{name}, dest{std::move(dest)}, level{level}, format{"[{severity} ({name})]: {msg}\n"},
-          threaded{threaded} {}
+void Log::recordCommit(std::chrono::steady_clock::time_point start) {
+        auto took = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+        ++commits.commits;
+        commits.total += took;
+        commits.max = std::max(commits.max, took);
+}
 
-Log::Log(std::string name, Level level /* = Level::Info | Level::Warn | Level::Panic */, bool threaded /* = true */)
-        : Log{name, util::make_unique<StdOutDest>(), level, threaded} {}
+CommitStats Log::commitStats() const {
+        std::lock_guard<std::mutex> commitLock{top->commitMutex};
+        return top->commits;
+}
 
 void Log::setFormat(std::string newFormat) {
+        setFormat(util::make_unique<TemplateFormat>(newFormat));
+}
+
+void Log::setFormat(std::unique_ptr<Format> newFormat) {
         lock();
-        format = newFormat;
+        format = std::move(newFormat);
         unlock();
 }
 
-void Log::setLevel(Level newLevel) {
+void Log::setCoalescing(std::chrono::milliseconds timeout) {
         lock();
-        level = newLevel;
+        if (!timeout.count()) {
+                endRepeats();
+                repeats.clear();
+        }
+        coalesceTimeout = timeout;
         unlock();
 }
 
-void Log::dbgInternal(int line, std::string file, std::string name, std::string msg) {
-        if (enabled(name)) {
-                doLogInternal(Level::Dbg, line, file, this->name + "/" + name, msg);
+void Log::setLevel(Level newLevel) {
+        levelBits.store(newLevel.bits(), std::memory_order_relaxed);
+        enabledBits.store(newLevel.bits() | (recorder ? recorder->levels() : 0), std::memory_order_relaxed);
+}
+
+void Log::startRecording(std::string fileName, std::size_t messages /* = 1024 */,
+                         Level levels /* = Level::Dbg | Level::Info | Level::Warn | Level::Panic */) {
+        recorder = util::make_unique<FlightRecorder>(std::move(fileName), messages, levels);
+        enabledBits.store(levelBits.load() | levels.bits(), std::memory_order_relaxed);
+}
+
+void Log::stopRecording() {
+        enabledBits.store(levelBits.load(), std::memory_order_relaxed);
+        recorder.reset();
+}
+
+void Log::dumpRecording() {
+        if (top->recorder) {
+                top->recorder->dump("requested");
         }
 }
 
-void Log::infoInternal(int line, std::string file, std::string name, std::string msg) {
-        if (enabled(name)) {
-                doLogInternal(Level::Info, line, file, this->name + "/" + name, msg);
+void Log::dumpRecordingOnCrash() {
+        if (top->recorder) {
+                top->recorder->dumpOnCrash();
         }
 }
 
-void Log::warnInternal(int line, std::string file, std::string name, std::string msg) {
-        if (enabled(name)) {
-                doLogInternal(Level::Warn, line, file, this->name + "/" + name, msg);
+void Log::dispatch(Record const& record) {
+        if (Log* target = sink()) {
+                target->doLogInternal(record);
         }
 }
 
-void Log::panicInternal(int line, std::string file, std::string name, std::string msg) {
-        if (enabled(name)) {
-                doLogInternal(Level::Panic, line, file, this->name + "/" + name, msg);
+char* Log::reserveDeferred(CallSite const& site, Log const& origin, std::size_t size) {
+        size += sizeof(DeferredHeader) + origin.fullName.size();
+        char* res;
+        // Panics are written right away, see panic(), and messages
+        // that are only recorded aren't written at all
+        bool write = site.state.load(std::memory_order_relaxed) == SiteState::On ||
+                (levelBits.load(std::memory_order_relaxed) & site.level.bits()) != 0;
+        if (writer && write && size <= writer->maxDeferred() && !site.level.hasLevel(Level::Panic)) {
+                res = writer->reserve(size, pending.ring);
+                if (!res) {
+                        return nullptr;
+                }
+        } else {
+                pending.ring = nullptr;
+                pending.scratch.resize(size);
+                res = &pending.scratch[0];
         }
+        pending.entry = res;
+        pending.size = size;
+        DeferredHeader header{&site, std::chrono::system_clock::now().time_since_epoch().count(), threadNumber(),
+                              static_cast<std::uint32_t>(origin.fullName.size())};
+        std::memcpy(res, &header, sizeof(header));
+        res += sizeof(header);
+        std::memcpy(res, origin.fullName.data(), origin.fullName.size());
+        return res + origin.fullName.size();
+}
+
+void Log::commitDeferred() {
+        if (pending.ring) {
+                if (recorder) {
+                        recorder->record(decodeDeferred(pending.entry, pending.size));
+                }
+                writer->commit(*pending.ring);
+                return;
+        }
+        Record record = decodeDeferred(pending.entry, pending.size);
+        doLogInternal(record, record.site->state.load(std::memory_order_relaxed) == SiteState::On);
+}
+
+Record Log::makeRecord(Level level, int line, char const* file, char const* func, std::string_view msg) const {
+        return Record{level, line, file, func, fullName, msg, std::chrono::system_clock::now(), threadNumber()};
 }
 
-void Log::doLogInternal(Level level, int line, std::string file, std::string name, std::string msg) {
+void Log::doLogInternal(Record const& record, bool forced /* = false */) {
+        // Calls that don't go through the macros haven't been checked
+        if (!forced && !isEnabled(record.level)) {
+                return;
+        }
+        if (recorder) {
+                recorder->record(record);
+        }
+        if (!forced && !(levelBits.load(std::memory_order_relaxed) & record.level.bits())) {
+                return;
+        }
+        if (writer && !record.level.hasLevel(Level::Panic)) {
+                writer->push(record);
+                return;
+        }
+        if (writer) {
+                // Everything logged before the panic goes first
+                writer->flush();
+        }
         lock();
-        if (dest) {
-                dest->write(formatMsg(levelToString(level), name, line, file, msg));
-        } else {
+        if (!dest) {
+                unlock();
                 throw Error{"There is no destination available for logging"};
         }
+        write(record);
+        if (record.level.hasLevel(Level::Panic)) {
+                dest->flush();
+        }
         unlock();
+        if (recorder && record.level.hasLevel(Level::Panic)) {
+                recorder->dump("panic");
+        }
 }
 
-std::string Log::levelToString(Level level) {
-        if (level.hasLevel(Level::Dbg))   { return "DEBUG  "; }
-        if (level.hasLevel(Level::Info))  { return "INFO   "; }
-        if (level.hasLevel(Level::Warn))  { return "WARNING"; }
-        if (level.hasLevel(Level::Panic)) { return "PANIC  "; }
-        throw std::runtime_error{"Unreachable code in Log::levelToString()"};
+void Log::write(Record const& record) {
+        if (!dest) {
+                return;
+        }
+        buffer.clear();
+        bufferEnds.clear();
+        append(record, buffer, bufferEnds);
+        writeText(buffer, bufferEnds);
+        writtenCount.fetch_add(1, std::memory_order_relaxed);
 }
 
-std::string Log::replace(std::string needle, std::string haystack, std::string replacement) {
-        std::string res{};
-        auto pos = haystack.find(needle);
-        if (pos == std::string::npos) {
-                return haystack;
+void Log::append(Record const& record, std::string& out, Ends& ends) {
+        if (coalesceTimeout.count()) {
+                if (runningRepeats && record.time >= nextExpiry) {
+                        expireRepeats(record.time, out, ends);
+                }
+                std::string_view content = record.site ? record.args : record.msg;
+                std::size_t hash = std::hash<std::string_view>{}(content);
+                auto it = repeats.find(record.name);
+                if (it == repeats.end()) {
+                        it = repeats.emplace(std::string{record.name}, Repeat{}).first;
+                }
+                Repeat& repeat = it->second;
+                if (hash == repeat.hash && record.level.bits() == repeat.level.bits() && record.site == repeat.site &&
+                    content == repeat.content && !record.level.hasLevel(Level::Panic)) {
+                        repeat.last = record;
+                        if (!repeat.count++) {
+                                repeat.since = record.time;
+                                ++runningRepeats;
+                                nextExpiry = std::min(nextExpiry, record.time + coalesceTimeout);
+                        }
+                        return;
+                }
+                if (repeat.count) {
+                        endRepeat(it->first, repeat, out, ends);
+                }
+                repeat.hash = hash;
+                repeat.level = record.level;
+                repeat.site = record.site;
+                repeat.content.assign(content.data(), content.size());
+        }
+        if (render(record, out)) {
+                ends.emplace_back(out.size(), record.level);
         }
-        res = haystack.substr(0, pos);
-        res += replacement;
-        res += haystack.substr(pos + needle.length());
-        return res;
 }
 
-std::string Log::formatMsg(std::string level, std::string fullName, int line, std::string file, std::string message) {
-        std::string res{format};
-        res = replace("{file}", res, file);
-        res = replace("{line}", res, util::format(line));
-        res = replace("{name}", res, fullName);
-        res = replace("{severity}", res, level);
-        res = replace("{msg}", res, message);
-        return res;
+void Log::expireRepeats(std::chrono::system_clock::time_point before, std::string& out, Ends& ends) {
+        nextExpiry = std::chrono::system_clock::time_point::max();
+        for (auto& entry : repeats) {
+                Repeat& repeat = entry.second;
+                if (!repeat.count) {
+                        continue;
+                }
+                if (before == std::chrono::system_clock::time_point::max() ||
+                    repeat.since + coalesceTimeout <= before) {
+                        endRepeat(entry.first, repeat, out, ends);
+                } else {
+                        nextExpiry = std::min(nextExpiry, repeat.since + coalesceTimeout);
+                }
+        }
+}
+
+void Log::endRepeats() {
+        if (!dest || !runningRepeats) {
+                return;
+        }
+        buffer.clear();
+        bufferEnds.clear();
+        expireRepeats(std::chrono::system_clock::time_point::max(), buffer, bufferEnds);
+        writeText(buffer, bufferEnds);
+}
+
+void Log::endRepeat(std::string_view name, Repeat& repeat, std::string& out, Ends& ends) {
+        repeat.summary = util::format("last message repeated ", repeat.count, repeat.count == 1 ? " time" : " times");
+        Record summary{repeat.last.level, repeat.last.line, repeat.last.file, repeat.last.func, name,
+                       repeat.summary, repeat.last.time, repeat.last.thread};
+        repeat.count = 0;
+        --runningRepeats;
+        if (render(summary, out)) {
+                ends.emplace_back(out.size(), summary.level);
+        }
+}
+
+void Log::writeText(std::string const& text, Ends const& ends) {
+        messages.clear();
+        std::size_t start{0};
+        for (auto const& end : ends) {
+                messages.push_back(Message{std::string_view{text}.substr(start, end.first - start), end.second});
+                start = end.first;
+        }
+        if (!messages.empty()) {
+                dest->writeBatch(messages.data(), messages.size());
+        }
+}
+
+bool Log::render(Record const& record, std::string& out) {
+        if (dest->writeRecord(record)) {
+                return false;
+        }
+        if (record.site) {
+                message.clear();
+                renderMessage(record.site->format, record.args, message, !format->takesFields());
+                Record rendered{record};
+                rendered.msg = message;
+                format->render(rendered, out);
+        } else {
+                format->render(record, out);
+        }
+        return true;
+}
+
+char const* Level::name() const {
+        if (hasLevel(Level::Dbg))   { return "DEBUG  "; }
+        if (hasLevel(Level::Info))  { return "INFO   "; }
+        if (hasLevel(Level::Warn))  { return "WARNING"; }
+        if (hasLevel(Level::Panic)) { return "PANIC  "; }
+        throw std::runtime_error{"Unreachable code in Level::name()"};
+}
+
+TemplateFormat::TemplateFormat(std::string const& format) {
+        static const std::pair<char const*, Field> tokens[] = {
+                {"{file}", Field::File}, {"{line}", Field::Line}, {"{func}", Field::Func},
+                {"{name}", Field::Name}, {"{severity}", Field::Severity}, {"{msg}", Field::Msg},
+                {"{time}", Field::Time}, {"{thread}", Field::Thread}, {"{pid}", Field::Pid},
+        };
+        auto literal = [&](std::size_t begin, std::size_t end) {
+                if (begin == end) {
+                        return;
+                }
+                // Extend the previous literal if there is one
+                if (!ops.empty() && ops.back().field == Field::Literal) {
+                        ops.back().length += end - begin;
+                } else {
+                        ops.push_back(Op{Field::Literal, text.size(), end - begin});
+                }
+                text.append(format, begin, end - begin);
+        };
+
+        std::size_t pos{0};
+        std::size_t start{0};
+        while ((pos = format.find('{', pos)) != std::string::npos) {
+                bool matched{false};
+                for (auto const& token : tokens) {
+                        std::size_t len = std::strlen(token.first);
+                        if (format.compare(pos, len, token.first) == 0) {
+                                literal(start, pos);
+                                ops.push_back(Op{token.second, 0, 0});
+                                pos += len;
+                                start = pos;
+                                matched = true;
+                                break;
+                        }
+                }
+                if (!matched) {
+                        ++pos;
+                }
+        }
+        literal(start, format.size());
+}
+
+void TemplateFormat::render(Record const& record, std::string& out) {
+        for (auto const& op : ops) {
+                switch (op.field) {
+                case Field::Literal:
+                        out.append(text, op.offset, op.length);
+                        break;
+                case Field::File:
+                        out += record.file;
+                        break;
+                case Field::Line:
+                        appendNumber(out, record.line);
+                        break;
+                case Field::Func:
+                        out += record.func;
+                        break;
+                case Field::Name:
+                        out += record.name;
+                        break;
+                case Field::Severity:
+                        out += record.level.name();
+                        break;
+                case Field::Msg:
+                        out += record.msg;
+                        break;
+                case Field::Time: {
+                        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(record.time.time_since_epoch()).count();
+                        std::int64_t second = ms / 1000;
+                        if (second != cachedSecond) {
+                                std::time_t t = static_cast<std::time_t>(second);
+                                std::tm tm;
+                                localtime_r(&t, &tm);
+                                cachedTimeLength = std::strftime(cachedTime, sizeof(cachedTime), "%Y-%m-%d %H:%M:%S", &tm);
+                                cachedSecond = second;
+                        }
+                        out.append(cachedTime, cachedTimeLength);
+                        char millis[4] = {'.', static_cast<char>('0' + ms % 1000 / 100),
+                                          static_cast<char>('0' + ms % 100 / 10), static_cast<char>('0' + ms % 10)};
+                        out.append(millis, sizeof(millis));
+                        break;
+                }
+                case Field::Thread:
+                        appendNumber(out, record.thread);
+                        break;
+                case Field::Pid:
+                        appendNumber(out, static_cast<long>(::getpid()));
+                        break;
+                }
+        }
+}
+
+bool ArgReader::next(Arg& arg) {
+        arg.key = {};
+        if (atField(pos, end)) {
+                ++pos;
+                auto length = take<std::uint32_t>(pos);
+                arg.key = std::string_view{pos, length};
+                pos += length;
+        }
+        if (pos >= end) {
+                return false;
+        }
+        switch (take<detail::ArgType>(pos)) {
+        case detail::ArgType::Int:
+                arg.value = take<std::int64_t>(pos);
+                break;
+        case detail::ArgType::UInt:
+                arg.value = take<std::uint64_t>(pos);
+                break;
+        case detail::ArgType::Double:
+                arg.value = take<double>(pos);
+                break;
+        case detail::ArgType::Bool:
+                arg.value = take<char>(pos) != 0;
+                break;
+        case detail::ArgType::Char:
+                arg.value = take<char>(pos);
+                break;
+        case detail::ArgType::Str:
+        case detail::ArgType::Key: {
+                auto length = take<std::uint32_t>(pos);
+                arg.value = std::string_view{pos, length};
+                pos += length;
+                break;
+        }
+        }
+        return true;
+}
+
+void JsonLinesFormat::render(Record const& record, std::string& out) {
+        json::Writer json{out};
+        time.clear();
+        appendUtc(time, std::chrono::duration_cast<std::chrono::nanoseconds>(record.time.time_since_epoch()).count());
+        char const* level = record.level.hasLevel(Level::Dbg) ? "debug" :
+                record.level.hasLevel(Level::Info) ? "info" :
+                record.level.hasLevel(Level::Warn) ? "warning" : "panic";
+        json.beginObject()
+                .key("time").value(time)
+                .key("level").value(level)
+                .key("logger").value(record.name)
+                .key("file").value(record.file)
+                .key("line").value(record.line)
+                .key("func").value(record.func)
+                .key("thread").value(record.thread)
+                .key("msg").value(record.msg);
+        static constexpr std::string_view fixed[] = {"time", "level", "logger", "file", "line", "func", "thread", "msg"};
+        std::size_t fields{0};
+        auto taken = [&](std::string_view key) {
+                return std::find(std::begin(fixed), std::end(fixed), key) != std::end(fixed) ||
+                        std::find(keys.begin(), keys.begin() + fields, key) != keys.begin() + fields;
+        };
+        ArgReader reader{record.args};
+        ArgReader::Arg arg;
+        while (reader.next(arg)) {
+                if (arg.key.empty()) {
+                        continue;
+                }
+                if (fields == keys.size()) {
+                        keys.emplace_back();
+                }
+                std::string& key = keys[fields];
+                key.assign(arg.key);
+                while (taken(key)) {
+                        key.insert(0, 1, '_');
+                }
+                ++fields;
+                json.key(key);
+                std::visit([&](auto const& value) {
+                        if constexpr (std::is_same_v<std::decay_t<decltype(value)>, char>) {
+                                json.value(std::string_view{&value, 1});
+                        } else {
+                                json.value(value);
+                        }
+                }, arg.value);
+        }
+        json.endObject();
+        out += '\n';
 }
 
-void Log::dbg(int line, std::string file, std::string msg) {
-        doLogInternal(Level::Dbg, line, file, name, msg);
+void Log::dbg(int line, char const* file, char const* func, std::string_view msg) {
+        dispatch(makeRecord(Level::Dbg, line, file, func, msg));
 }
 
-void Log::info(int line, std::string file, std::string msg) {
-        doLogInternal(Level::Info, line, file, name, msg);
+void Log::info(int line, char const* file, char const* func, std::string_view msg) {
+        dispatch(makeRecord(Level::Info, line, file, func, msg));
 }
 
-void Log::warn(int line, std::string file, std::string msg) {
-        doLogInternal(Level::Warn, line, file, name, msg);
+void Log::warn(int line, char const* file, char const* func, std::string_view msg) {
+        dispatch(makeRecord(Level::Warn, line, file, func, msg));
 }
 
-void Log::panic(int line, std::string file, std::string msg) {
-        doLogInternal(Level::Panic, line, file, name, msg);
+void Log::panic(int line, char const* file, char const* func, std::string_view msg) {
+        dispatch(makeRecord(Level::Panic, line, file, func, msg));
+}
+
+void Log::log(CallSite const& site, std::string_view msg) {
+        bool forced = site.state.load(std::memory_order_relaxed) == SiteState::On;
+        if (Log* target = forced ? top : sink()) {
+                target->doLogInternal(makeRecord(site.level, site.line, site.file, site.func, msg), forced);
+        }
 }
 
 void Log::setDest(std::unique_ptr<Dest>&& newDest) {
@@ -234,15 +1794,739 @@ void Log::unlock() {
         }
 }
 
-FileDest::FileDest(std::string fileName) {
-        file.open(fileName, std::ios::out | std::ios::app);
-        if (!file.is_open()) {
-                throw Error{util::format("Can't open `", fileName, "' for writing")};
+// Compresses and removes rotated files of a FileDest on a thread of its
+// own so that the writing thread never waits for it. There is no one to
+// report errors to, a file that can't be compressed is left as it is.
+class FileDest::Housekeeper {
+public:
+        Housekeeper(std::string fileName, RotationPolicy rotation)
+                : fileName{std::move(fileName)}, rotation{rotation} {
+                thread = std::thread{[this]() { run(); }};
+        }
+
+        // Finishes with the files handed to us before returning
+        ~Housekeeper() {
+                {
+                        std::lock_guard<std::mutex> lock{mutex};
+                        stopping = true;
+                }
+                wake.notify_one();
+                thread.join();
+        }
+
+        // Take care of `segment` which was just rotated. `fd` is still
+        // open on it if it has to be synced, -1 otherwise, and is
+        // closed once that's done.
+        void add(std::string segment, int fd) {
+                {
+                        std::lock_guard<std::mutex> lock{mutex};
+                        segments.push_back(Segment{std::move(segment), fd});
+                        handed += fd >= 0;
+                }
+                wake.notify_one();
+        }
+
+        // Wait until the files handed to us so far have been synced
+        void waitSynced() {
+                std::unique_lock<std::mutex> lock{mutex};
+                std::uint64_t target = handed;
+                syncedCond.wait(lock, [&]() { return synced >= target; });
+        }
+private:
+        struct Segment {
+                std::string name;
+                int fd;
+        };
+
+        void run() {
+                std::unique_lock<std::mutex> lock{mutex};
+                while (true) {
+                        wake.wait(lock, [this]() { return stopping || !segments.empty(); });
+                        if (segments.empty()) {
+                                return;
+                        }
+                        // Sync everything first, commits wait for this
+                        // and not for the compression as well
+                        std::vector<int> fds;
+                        for (auto& s : segments) {
+                                if (s.fd >= 0) {
+                                        fds.push_back(s.fd);
+                                        s.fd = -1;
+                                }
+                        }
+                        if (!fds.empty()) {
+                                lock.unlock();
+                                for (int fd : fds) {
+                                        while (::fdatasync(fd) != 0 && errno == EINTR) {
+                                        }
+                                        ::close(fd);
+                                }
+                                lock.lock();
+                                synced += fds.size();
+                                syncedCond.notify_all();
+                                continue;
+                        }
+                        std::string segment = std::move(segments.front().name);
+                        segments.erase(segments.begin());
+                        lock.unlock();
+                        if (rotation.compress) {
+                                compress(segment);
+                        }
+                        if (rotation.keep) {
+                                prune();
+                        }
+                        lock.lock();
+                }
+        }
+
+        // Replace `segment` with a gzip compressed copy
+        static void compress(std::string const& segment) {
+                int in = ::open(segment.c_str(), O_RDONLY | O_CLOEXEC);
+                if (in < 0) {
+                        return;
+                }
+                std::string tmp = segment + ".gz.tmp";
+                gzFile out = ::gzopen(tmp.c_str(), "wb");
+                bool ok = out != nullptr;
+                char buf[64 * 1024];
+                ssize_t n;
+                while (ok && (n = ::read(in, buf, sizeof(buf))) > 0) {
+                        ok = ::gzwrite(out, buf, static_cast<unsigned>(n)) == n;
+                }
+                ok = ok && n == 0;
+                if (out && ::gzclose(out) != Z_OK) {
+                        ok = false;
+                }
+                ::close(in);
+                if (ok && ::rename(tmp.c_str(), (segment + ".gz").c_str()) == 0) {
+                        ::unlink(segment.c_str());
+                } else {
+                        ::unlink(tmp.c_str());
+                }
+        }
+
+        // Remove the oldest rotated files beyond the number to keep
+        void prune() {
+                auto slash = fileName.rfind('/');
+                std::string dir = slash == std::string::npos ? "." : fileName.substr(0, slash + 1);
+                std::string prefix = (slash == std::string::npos ? fileName : fileName.substr(slash + 1)) + ".";
+                DIR* d = ::opendir(dir.c_str());
+                if (!d) {
+                        return;
+                }
+                // Rotated files by their time stamp and the number
+                // of the rotation within that second, which sorts them
+                // by time. The number is compared as a number, "-10"
+                // comes after "-2".
+                std::vector<std::tuple<std::string, std::uint64_t, std::string>> rotated;
+                while (dirent* entry = ::readdir(d)) {
+                        std::string_view name{entry->d_name};
+                        if (name.compare(0, prefix.size(), prefix) != 0 || name.size() == prefix.size() ||
+                            !std::isdigit(static_cast<unsigned char>(name[prefix.size()])) ||
+                            name.substr(name.size() - std::min<std::size_t>(name.size(), 4)) == ".tmp") {
+                                continue;
+                        }
+                        std::string_view key = name.substr(prefix.size());
+                        if (key.size() > 3 && key.substr(key.size() - 3) == ".gz") {
+                                key.remove_suffix(3);
+                        }
+                        // The stamp itself has a '-' between the date
+                        // and the time, the number comes after another
+                        std::uint64_t number{0};
+                        auto dash = key.find('-');
+                        dash = dash == std::string_view::npos ? dash : key.find('-', dash + 1);
+                        if (dash != std::string_view::npos) {
+                                std::from_chars(key.data() + dash + 1, key.data() + key.size(), number);
+                                key = key.substr(0, dash);
+                        }
+                        rotated.emplace_back(std::string{key}, number, std::string{name});
+                }
+                ::closedir(d);
+                if (rotated.size() <= rotation.keep) {
+                        return;
+                }
+                std::sort(rotated.begin(), rotated.end());
+                for (std::size_t i = 0; i < rotated.size() - rotation.keep; ++i) {
+                        std::string const& name = std::get<2>(rotated[i]);
+                        std::string path = slash == std::string::npos ? name : dir + name;
+                        ::unlink(path.c_str());
+                }
+        }
+
+        std::string fileName;
+        RotationPolicy rotation;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable syncedCond;
+        std::vector<Segment> segments;
+        // Descriptors handed to us to sync and how many of them are
+        std::uint64_t handed{0};
+        std::uint64_t synced{0};
+        bool stopping{false};
+        std::thread thread;
+};
+
+FileDest::FileDest(std::string fileName, FlushPolicy policy /* = FlushPolicy{} */,
+                   RotationPolicy rotation /* = RotationPolicy{} */)
+        : fileName{std::move(fileName)}, policy{policy}, rotation{rotation}, lastWrite{std::chrono::steady_clock::now()} {
+        open();
+        buffer.reserve(policy.bytes);
+}
+
+FileDest::~FileDest() {
+        flush();
+        ::close(fd);
+}
+
+void FileDest::write(std::string_view message) {
+        Message msg{message, Level{0}};
+        writeBatch(&msg, 1);
+}
+
+void FileDest::writeBatch(Message const* messages, std::size_t count) {
+        std::size_t size{0};
+        bool urgent{false};
+        for (std::size_t i = 0; i < count; ++i) {
+                size += messages[i].text.size();
+                urgent = urgent || policy.levels.hasLevel(messages[i].level);
+        }
+        if (buffer.size() + size > policy.bytes) {
+                // No point in copying what is written right away
+                writeOut(messages, count);
+                return;
+        }
+        for (std::size_t i = 0; i < count; ++i) {
+                buffer.append(messages[i].text.data(), messages[i].text.size());
+        }
+        buffered += count;
+        if (urgent || (policy.count && buffered >= policy.count) ||
+            (policy.interval.count() && std::chrono::steady_clock::now() - lastWrite >= policy.interval)) {
+                writeOut(nullptr, 0);
+        }
+}
+
+void FileDest::flush() {
+        if (!buffer.empty()) {
+                writeOut(nullptr, 0);
+        }
+}
+
+void FileDest::sync() {
+        flush();
+        if (dirty) {
+                while (::fdatasync(fd) != 0 && errno == EINTR) {
+                }
+                dirty = false;
+        }
+        if (housekeeper) {
+                housekeeper->waitSynced();
+        }
+}
+
+void FileDest::writeOut(Message const* messages, std::size_t count) {
+        iovec iov[IOV_MAX];
+        int n{0};
+        if (!buffer.empty()) {
+                iov[n++] = iovec{&buffer[0], buffer.size()};
+        }
+        std::size_t next{0};
+        while (n > 0 || next < count) {
+                while (n < IOV_MAX && next < count) {
+                        auto text = messages[next++].text;
+                        if (!text.empty()) {
+                                iov[n++] = iovec{const_cast<char*>(text.data()), text.size()};
+                        }
+                }
+                iovec* pos = iov;
+                while (n > 0) {
+                        ssize_t res = ::writev(fd, pos, n);
+                        if (res < 0) {
+                                if (errno == EINTR) {
+                                        continue;
+                                }
+                                n = 0;
+                                break;
+                        }
+                        written += res;
+                        dirty = true;
+                        // Skip what was written, a short write
+                        // leaves us in the middle of a message.
+                        while (n > 0 && static_cast<std::size_t>(res) >= pos->iov_len) {
+                                res -= pos->iov_len;
+                                ++pos;
+                                --n;
+                        }
+                        if (n > 0) {
+                                pos->iov_base = static_cast<char*>(pos->iov_base) + res;
+                                pos->iov_len -= res;
+                        }
+                }
+        }
+        buffer.clear();
+        buffered = 0;
+        lastWrite = std::chrono::steady_clock::now();
+        // Whole messages have been written, a good time to rotate
+        if (written >= rotateBytes || lastWrite >= rotateAt) {
+                rotate();
+        }
+}
+
+void FileDest::open() {
+        fd = ::open(fileName.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+                throw Error{util::format("Can't open `", fileName, "' for writing: ", std::strerror(errno))};
+        }
+        struct stat st;
+        written = ::fstat(fd, &st) == 0 ? static_cast<std::uint64_t>(st.st_size) : 0;
+        rotateBytes = rotation.bytes ? rotation.bytes : std::numeric_limits<std::uint64_t>::max();
+        rotateAt = nextRotation();
+}
+
+std::chrono::steady_clock::time_point FileDest::nextRotation() const {
+        if (!rotation.interval.count()) {
+                return std::chrono::steady_clock::time_point::max();
+        }
+        // Steady time of the next multiple of the interval
+        auto since = std::chrono::system_clock::now().time_since_epoch() % rotation.interval;
+        return std::chrono::steady_clock::now() +
+                std::chrono::duration_cast<std::chrono::steady_clock::duration>(rotation.interval - since);
+}
+
+void FileDest::rotate() {
+        std::time_t t = std::time(nullptr);
+        std::tm tm;
+        localtime_r(&t, &tm);
+        char stamp[32];
+        std::strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+        if (lastStamp != stamp) {
+                lastStamp = stamp;
+                stampRotations = 0;
+        }
+        std::string segment = util::format(fileName, ".", stamp);
+        // Several rotations within a second get a number each, counting
+        // up so that they sort in the order they were made
+        auto next = [&]() {
+                return util::format(fileName, ".", stamp, "-", ++stampRotations);
+        };
+        if (stampRotations) {
+                segment = next();
+        }
+        while (::access(segment.c_str(), F_OK) == 0 || ::access((segment + ".gz").c_str(), F_OK) == 0) {
+                segment = next();
+        }
+        if (::rename(fileName.c_str(), segment.c_str()) != 0) {
+                // Keep writing where we are and try again once the
+                // limits have been reached once more
+                if (rotation.bytes) {
+                        rotateBytes = written + rotation.bytes;
+                }
+                rotateAt = nextRotation();
+                return;
+        }
+        int old = fd;
+        try {
+                open();
+        } catch (Error const&) {
+                // Better the renamed file than nothing
+                fd = old;
+                return;
+        }
+        // The old file is synced on the housekeeping thread, the next
+        // sync() waits for that. Nothing to sync if no one wrote to it
+        // since the last one.
+        bool oldDirty = dirty;
+        dirty = false;
+        if (!oldDirty && !rotation.compress && !rotation.keep) {
+                ::close(old);
+                return;
+        }
+        if (!oldDirty) {
+                ::close(old);
+                old = -1;
+        }
+        if (!housekeeper) {
+                housekeeper = util::make_unique<Housekeeper>(fileName, rotation);
+        }
+        housekeeper->add(segment, old);
+}
+
+namespace {
+        struct RegisteredSite {
+                CallSite const* site;
+                std::string logger;
+                // The Log at the top of the logger, nullptr once it is
+                // gone
+                Log* log;
+                // Set while the site is limited
+                detail::SiteLimit* limit{nullptr};
+                // Counters of the site since it was first limited,
+                // owned by the registry and reused by later limits
+                detail::SiteLimit* counters{nullptr};
+                // The rest is only used by the thread of Sites
+                double rate{0};
+                std::int64_t burst{0};
+                std::chrono::milliseconds summary{0};
+                // Tokens earned but not yet added to the bucket
+                double credit{0};
+                // `seen` of the limit when last looked at
+                std::uint64_t lastSeen{0};
+                // Messages turned away that haven't been logged about
+                // yet and since when, and all of them
+                std::uint64_t suppressed{0};
+                std::chrono::steady_clock::time_point since{};
+                std::uint64_t totalSuppressed{0};
+        };
+
+        struct SiteSwitch {
+                Sites::Match match;
+                SiteState state;
+        };
+
+        struct SiteLimitRule {
+                Sites::Match match;
+                Sites::Limit limit;
+        };
+
+        struct SiteRegistry {
+                std::mutex mutex;
+                std::vector<RegisteredSite> sites;
+                std::vector<SiteSwitch> switches;
+                std::vector<SiteLimitRule> limits;
+                // Counters of every site that has been limited, one
+                // each. Sites may still use them after the limit is
+                // lifted.
+                std::vector<std::unique_ptr<detail::SiteLimit>> counters;
+                bool running{false};
+        };
+
+        // Never destroyed, sites may still run while static objects
+        // are destroyed
+        SiteRegistry& siteRegistry() {
+                static SiteRegistry* registry = new SiteRegistry;
+                return *registry;
+        }
+
+        bool matches(Sites::Match const& match, RegisteredSite const& entry) {
+                CallSite const& site = *entry.site;
+                return (match.levels.bits() & site.level.bits()) &&
+                        (!match.line || match.line == site.line) &&
+                        (match.file.empty() || ::fnmatch(match.file.c_str(), site.file, 0) == 0) &&
+                        (match.logger.empty() || ::fnmatch(match.logger.c_str(), entry.logger.c_str(), 0) == 0);
+        }
+
+        // Set the counters of `entry` up for `limit`, or take them away
+        void applyLimit(SiteRegistry& registry, RegisteredSite& entry, Sites::Limit const& limit) {
+                if (limit.rate <= 0 && limit.sample <= 1) {
+                        entry.limit = nullptr;
+                        entry.site->limit.store(nullptr, std::memory_order_release);
+                        return;
+                }
+                entry.rate = limit.rate;
+                entry.burst = limit.burst ? static_cast<std::int64_t>(limit.burst)
+                                          : std::max<std::int64_t>(1, static_cast<std::int64_t>(std::ceil(limit.rate)));
+                entry.summary = limit.summary;
+                entry.credit = 0;
+                entry.lastSeen = 0;
+                if (!entry.counters) {
+                        registry.counters.push_back(util::make_unique<detail::SiteLimit>());
+                        entry.counters = registry.counters.back().get();
+                }
+                detail::SiteLimit& counters = *entry.counters;
+                counters.sample.store(std::max<std::uint32_t>(limit.sample, 1), std::memory_order_relaxed);
+                counters.limited.store(limit.rate > 0, std::memory_order_relaxed);
+                counters.seen.store(0, std::memory_order_relaxed);
+                counters.tokens.store(entry.burst, std::memory_order_relaxed);
+                entry.limit = entry.counters;
+                entry.site->limit.store(entry.limit, std::memory_order_release);
+        }
+
+        // Refill the bucket of `entry` for `elapsed` seconds and count
+        // the messages that were turned away since the last time
+        void refill(RegisteredSite& entry, double elapsed) {
+                detail::SiteLimit& limit = *entry.limit;
+                std::uint32_t sample = limit.sample.load(std::memory_order_relaxed);
+                std::uint64_t turnedAway{0};
+                if (limit.limited.load(std::memory_order_relaxed)) {
+                        entry.credit += entry.rate * elapsed;
+                        auto earned = static_cast<std::int64_t>(entry.credit);
+                        entry.credit -= static_cast<double>(earned);
+                        std::int64_t tokens = limit.tokens.load(std::memory_order_relaxed);
+                        std::int64_t next;
+                        do {
+                                turnedAway = tokens < 0 ? static_cast<std::uint64_t>(-tokens) : 0;
+                                next = std::min(entry.burst, std::max<std::int64_t>(tokens, 0) + earned);
+                        } while (!limit.tokens.compare_exchange_weak(tokens, next, std::memory_order_relaxed));
+                }
+                if (sample > 1) {
+                        std::uint64_t seen = limit.seen.load(std::memory_order_relaxed);
+                        // Every message whose number is a multiple of
+                        // `sample` is kept
+                        std::uint64_t kept = (seen + sample - 1) / sample - (entry.lastSeen + sample - 1) / sample;
+                        turnedAway += seen - entry.lastSeen - kept;
+                        entry.lastSeen = seen;
+                }
+                entry.totalSuppressed += turnedAway;
+                if (turnedAway && !entry.suppressed) {
+                        entry.since = std::chrono::steady_clock::now();
+                }
+                entry.suppressed += turnedAway;
+        }
+
+        std::string const& commandString(json::Object const& command, std::string_view key) {
+                try {
+                        return command.get<json::Str>({key});
+                } catch (json::ObjectError const&) {
+                        throw Error{util::format("`", key, "' of a site command must be a string")};
+                }
+        }
+
+        // A number from 0 up to what fits in every field it goes
+        // into, converting anything else would be undefined
+        double commandNumber(json::Object const& value, std::string_view key) {
+                double res;
+                if (value.is<json::Int>()) {
+                        res = static_cast<double>(value.into<json::Int>());
+                } else if (value.is<json::Double>()) {
+                        res = value.into<json::Double>();
+                } else {
+                        throw Error{util::format("`", key, "' of a site command must be a number")};
+                }
+                auto const max = std::numeric_limits<std::uint32_t>::max();
+                if (!std::isfinite(res) || res < 0 || res > max) {
+                        throw Error{util::format("`", key, "' of a site command must be between 0 and ", max)};
+                }
+                return res;
+        }
+}
+
+std::size_t Sites::set(Match const& match, SiteState state) {
+        auto& registry = siteRegistry();
+        std::lock_guard<std::mutex> lock{registry.mutex};
+        registry.switches.push_back(SiteSwitch{match, state});
+        std::size_t res{0};
+        for (auto const& entry : registry.sites) {
+                if (matches(match, entry)) {
+                        entry.site->state.store(state, std::memory_order_relaxed);
+                        ++res;
+                }
+        }
+        return res;
+}
+
+std::size_t Sites::limit(Match const& match, Limit const& limit) {
+        auto& registry = siteRegistry();
+        std::lock_guard<std::mutex> lock{registry.mutex};
+        registry.limits.push_back(SiteLimitRule{match, limit});
+        std::size_t res{0};
+        for (auto& entry : registry.sites) {
+                if (matches(match, entry)) {
+                        applyLimit(registry, entry, limit);
+                        ++res;
+                }
+        }
+        if (!registry.running) {
+                registry.running = true;
+                std::thread{run}.detach();
+        }
+        return res;
+}
+
+void Sites::run() {
+        auto& registry = siteRegistry();
+        auto last = std::chrono::steady_clock::now();
+        while (true) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                std::lock_guard<std::mutex> lock{registry.mutex};
+                auto now = std::chrono::steady_clock::now();
+                double elapsed = std::chrono::duration<double>(now - last).count();
+                last = now;
+                for (auto& entry : registry.sites) {
+                        if (!entry.limit) {
+                                continue;
+                        }
+                        refill(entry, elapsed);
+                        if (!entry.suppressed || now - entry.since < entry.summary) {
+                                continue;
+                        }
+                        CallSite const& site = *entry.site;
+                        // Nothing is said about the messages of a
+                        // logger that has been disabled since
+                        bool active{false};
+                        if (entry.log) {
+                                std::string_view path{entry.logger};
+                                path.remove_prefix(std::min(path.size(), entry.log->fullName.size() + 1));
+                                active = site.state.load(std::memory_order_relaxed) == SiteState::On ||
+                                        entry.log->isActive(path);
+                        }
+                        if (active) {
+                                std::string msg = util::format("suppressed ", entry.suppressed, " messages from ",
+                                                               site.file, ":", site.line);
+                                try {
+                                        entry.log->doLogInternal(Record{site.level, site.line, site.file, site.func,
+                                                                        entry.logger, msg, std::chrono::system_clock::now(),
+                                                                        threadNumber()}, true);
+                                } catch (Error const&) {
+                                        // There is no destination
+                                }
+                        }
+                        entry.suppressed = 0;
+                }
+        }
+}
+
+std::size_t Sites::command(std::string const& command) {
+        json::Object parsed;
+        try {
+                parsed = json::Parser::parse(command);
+        } catch (json::Error const& e) {
+                throw Error{util::format("Can't parse site command: ", e.what())};
+        }
+        std::vector<json::Object> commands;
+        if (parsed.is<json::Arr>()) {
+                commands = parsed.into<json::Arr const&>();
+        } else {
+                commands.push_back(parsed);
+        }
+        struct Parsed {
+                Match match;
+                std::optional<SiteState> state;
+                std::optional<Limit> limit;
+        };
+        std::vector<Parsed> parsedCommands;
+        for (auto const& c : commands) {
+                if (!c.is<json::Obj>()) {
+                        throw Error{"A site command must be a object"};
+                }
+                Parsed res;
+                for (auto const& kv : c.into<json::Obj const&>()) {
+                        if (kv.first == "state") {
+                                auto const& state = commandString(c, "state");
+                                if (state == "on") {
+                                        res.state = SiteState::On;
+                                } else if (state == "off") {
+                                        res.state = SiteState::Off;
+                                } else if (state == "default") {
+                                        res.state = SiteState::Default;
+                                } else {
+                                        throw Error{util::format("Unknown site state `", state, "'")};
+                                }
+                        } else if (kv.first == "file") {
+                                res.match.file = commandString(c, "file");
+                        } else if (kv.first == "logger") {
+                                res.match.logger = commandString(c, "logger");
+                        } else if (kv.first == "line") {
+                                if (!kv.second.is<json::Int>()) {
+                                        throw Error{"`line' of a site command must be a number"};
+                                }
+                                res.match.line = static_cast<int>(kv.second.into<json::Int>());
+                        } else if (kv.first == "level") {
+                                auto const& level = commandString(c, "level");
+                                if (level == "debug") {
+                                        res.match.levels = Level::Dbg;
+                                } else if (level == "info") {
+                                        res.match.levels = Level::Info;
+                                } else if (level == "warning") {
+                                        res.match.levels = Level::Warn;
+                                } else if (level == "panic") {
+                                        res.match.levels = Level::Panic;
+                                } else {
+                                        throw Error{util::format("Unknown level `", level, "'")};
+                                }
+                        } else if (kv.first == "rate") {
+                                res.limit = res.limit.value_or(Limit{});
+                                res.limit->rate = commandNumber(kv.second, kv.first);
+                        } else if (kv.first == "burst") {
+                                res.limit = res.limit.value_or(Limit{});
+                                res.limit->burst = static_cast<std::size_t>(commandNumber(kv.second, kv.first));
+                        } else if (kv.first == "sample") {
+                                res.limit = res.limit.value_or(Limit{});
+                                res.limit->sample = static_cast<std::uint32_t>(commandNumber(kv.second, kv.first));
+                        } else if (kv.first == "summary") {
+                                res.limit = res.limit.value_or(Limit{});
+                                res.limit->summary = std::chrono::milliseconds{
+                                        static_cast<std::int64_t>(commandNumber(kv.second, kv.first) * 1000)};
+                        } else {
+                                throw Error{util::format("Unknown key `", kv.first, "' in site command")};
+                        }
+                }
+                if (!res.state && !res.limit) {
+                        throw Error{"A site command needs a `state' or a limit"};
+                }
+                parsedCommands.push_back(res);
+        }
+        // Nothing is changed unless the whole command is valid
+        std::size_t res{0};
+        for (auto const& c : parsedCommands) {
+                std::size_t matched{0};
+                if (c.state) {
+                        matched = set(c.match, *c.state);
+                }
+                if (c.limit) {
+                        matched = limit(c.match, *c.limit);
+                }
+                res += matched;
+        }
+        return res;
+}
+
+std::vector<Sites::Info> Sites::list() {
+        auto& registry = siteRegistry();
+        std::lock_guard<std::mutex> lock{registry.mutex};
+        std::vector<Info> res;
+        for (auto const& entry : registry.sites) {
+                CallSite const& site = *entry.site;
+                res.push_back(Info{site.file, site.line, site.func, site.level, entry.logger,
+                                   site.state.load(std::memory_order_relaxed), entry.totalSuppressed});
+        }
+        return res;
+}
+
+void Sites::reset() {
+        auto& registry = siteRegistry();
+        std::lock_guard<std::mutex> lock{registry.mutex};
+        registry.switches.clear();
+        registry.limits.clear();
+        for (auto& entry : registry.sites) {
+                entry.site->state.store(SiteState::Default, std::memory_order_relaxed);
+                applyLimit(registry, entry, Limit{});
+        }
+}
+
+void Sites::add(CallSite const& site, Log const& log) {
+        auto& registry = siteRegistry();
+        std::lock_guard<std::mutex> lock{registry.mutex};
+        // Another thread may have been first
+        if (site.state.load(std::memory_order_relaxed) != SiteState::Unknown) {
+                return;
         }
+        registry.sites.push_back(RegisteredSite{&site, log.fullName, log.top});
+        RegisteredSite& entry = registry.sites.back();
+        SiteState state{SiteState::Default};
+        for (auto const& s : registry.switches) {
+                if (matches(s.match, entry)) {
+                        state = s.state;
+                }
+        }
+        SiteLimitRule const* rule{nullptr};
+        for (auto const& l : registry.limits) {
+                if (matches(l.match, entry)) {
+                        rule = &l;
+                }
+        }
+        if (rule) {
+                applyLimit(registry, entry, rule->limit);
+        }
+        site.state.store(state, std::memory_order_relaxed);
 }
 
-void FileDest::write(std::string message) {
-        file << message;
+void Sites::forget(Log const& log) {
+        auto& registry = siteRegistry();
+        std::lock_guard<std::mutex> lock{registry.mutex};
+        for (auto& entry : registry.sites) {
+                if (entry.log == &log) {
+                        entry.log = nullptr;
+                }
+        }
 }
 
 // If i've understood https://stackoverflow.com/a/11667596 correctly
@@ -0,0 +1,332 @@
+#include "doctest.h"
+
+#include "config.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <thread>
+#include <vector>
+
+#include <sys/time.h>
+
+namespace {
+void writeFile(std::string const& fileName, std::string const& contents) {
+        // Write and rename so that readers never see a half written
+        // file, the same way most editors save.
+        std::string tmp = fileName + ".tmp";
+        {
+                std::ofstream f{tmp, std::ios::out | std::ios::trunc};
+                f << contents;
+        }
+        std::rename(tmp.c_str(), fileName.c_str());
+}
+
+// Wait for `pred` to become true, gives up after a few seconds.
+template<typename Pred>
+bool waitFor(Pred pred) {
+        for (int i = 0; i < 500 && !pred(); ++i) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return pred();
+}
+} /* namespace anon */
+
+TEST_CASE("configs can be reloaded while being read") {
+        std::string fileName{"config_reload_test.json"};
+        writeFile(fileName, R"<({"server": {"port": 1}})<");
+        Config cfg{fileName};
+        CHECK(cfg.i({"server", "port"}) == 1);
+        CHECK(cfg.generation() == 0);
+
+        SUBCASE("reload() only publishes changed contents") {
+                CHECK_FALSE(cfg.reload());
+                writeFile(fileName, R"<({"server": {"port": 2}})<");
+                auto old = cfg.snapshot();
+                CHECK(cfg.reload());
+                CHECK(cfg.i({"server", "port"}) == 2);
+                CHECK(cfg.generation() == 1);
+                CHECK(old->get<json::Int>({"server", "port"}) == 1);
+        }
+
+        SUBCASE("invalid contents keep the old configuration") {
+                writeFile(fileName, R"<({"server": )<");
+                CHECK_THROWS_AS(cfg.reload(), json::ParseError const&);
+                CHECK(cfg.i({"server", "port"}) == 1);
+        }
+
+        SUBCASE("watched files are reloaded in the background") {
+                cfg.watch();
+                std::atomic<bool> stop{false};
+                std::atomic<bool> sawBadValue{false};
+                std::vector<std::thread> readers;
+                for (int i = 0; i < 2; ++i) {
+                        readers.emplace_back([&]() {
+                                while (!stop) {
+                                        json::Int port = cfg.i({"server", "port"});
+                                        if (port < 1 || port > 3) {
+                                                sawBadValue = true;
+                                        }
+                                }
+                        });
+                }
+                writeFile(fileName, R"<({"server": {"port": 3}})<");
+                CHECK(waitFor([&]() { return cfg.i({"server", "port"}) == 3; }));
+                stop = true;
+                for (auto& t : readers) {
+                        t.join();
+                }
+                CHECK_FALSE(sawBadValue);
+                cfg.unwatch();
+        }
+
+        SUBCASE("the error handler can stop watching") {
+                std::atomic<bool> failed{false};
+                cfg.watch([&](std::exception_ptr) {
+                        cfg.unwatch();
+                        failed = true;
+                });
+                writeFile(fileName, R"<({"server": )<");
+                CHECK(waitFor([&]() { return failed.load(); }));
+                writeFile(fileName, R"<({"server": {"port": 2}})<");
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                CHECK(cfg.i({"server", "port"}) == 1);
+        }
+
+        SUBCASE("strings and objects can be read while reloading") {
+                writeFile(fileName, R"<({"server": {"port": 1, "name": "web"}})<");
+                cfg.reload();
+                cfg.watch();
+                std::atomic<bool> stop{false};
+                std::atomic<bool> sawBadValue{false};
+                std::vector<std::thread> readers;
+                for (int i = 0; i < 2; ++i) {
+                        readers.emplace_back([&]() {
+                                while (!stop) {
+                                        auto name = cfg.str({"server", "name"});
+                                        auto server = cfg.obj({"server"});
+                                        if (name.size() != 3 || server.size() != 2) {
+                                                sawBadValue = true;
+                                        }
+                                }
+                        });
+                }
+                for (int port = 2; port < 20; ++port) {
+                        writeFile(fileName, util::format(R"<({"server": {"port": )<", port, R"<(, "name": "api"}})<"));
+                        CHECK(waitFor([&]() { return cfg.i({"server", "port"}) == port; }));
+                }
+                stop = true;
+                for (auto& t : readers) {
+                        t.join();
+                }
+                CHECK_FALSE(sawBadValue);
+                cfg.unwatch();
+        }
+
+        std::remove(fileName.c_str());
+}
+
+TEST_CASE("configs without files can't be reloaded") {
+        Config cfg{json::Parser::parse(R"<({"a": 1})<")};
+        CHECK_THROWS_AS(cfg.reload(), ConfigError const&);
+        CHECK_THROWS_AS(cfg.watch(), ConfigError const&);
+
+        Config copy{cfg};
+        json::Object const& before = copy.toJson();
+        copy.addProperty({}, "b", 2);
+        CHECK(copy.i({"b"}) == 2);
+        // Still alive after one change
+        CHECK(before.get<json::Int>({"a"}) == 1);
+        CHECK_THROWS(before.get<json::Int>({"b"}));
+        CHECK_THROWS(cfg.i({"b"}));
+        CHECK(copy.generation() == 1);
+}
+
+TEST_CASE("bound values follow changes to the config") {
+        Config cfg{json::Parser::parse(R"<({"server": {"port": 80, "name": "web"}})<")};
+        auto port = cfg.bind<json::Int>({"server", "port"});
+        auto name = cfg.bind<json::Str>({"server", "name"});
+        CHECK(*port == 80);
+        CHECK(name->size() == 3);
+        CHECK(&port.get() == &port.get());
+        CHECK_THROWS_AS(cfg.bind<json::Str>({"server", "port"}), json::BadTypeError const&);
+
+        cfg.addProperty({"server"}, "port", 8080);
+        CHECK(*port == 8080);
+        CHECK(name.get() == "web");
+
+        cfg.addProperty({"server"}, "port", "not a port");
+        CHECK_THROWS_AS(port.get(), json::BadTypeError const&);
+}
+
+TEST_CASE("layers are merged with later layers taking precedence") {
+        Config cfg{json::Parser::parse(R"<({"server": {"port": 80, "name": "web"}, "log": {"level": "info"}})<")};
+        cfg.pushLayer("host", json::Parser::parse(R"<({"server": {"port": 8080}, "tags": ["a"]})<"));
+        CHECK(cfg.layerNames() == std::vector<std::string>{"base", "host"});
+        CHECK(cfg.i({"server", "port"}) == 8080);
+        CHECK(cfg.str({"server", "name"}) == "web");
+        CHECK(cfg.str({"log", "level"}) == "info");
+        CHECK(cfg.arr({"tags"}).size() == 1);
+        CHECK_THROWS_AS(cfg.pushLayer("host", json::Object{json::Obj{}}), ConfigError const&);
+
+        SUBCASE("changing a layer only touches what changed") {
+                auto before = cfg.generation();
+                cfg.setLayer("host", json::Parser::parse(R"<({"server": {"port": 8080}, "tags": ["a"]})<"));
+                CHECK(cfg.generation() == before);
+
+                cfg.setLayer("host", json::Parser::parse(R"<({"server": {"port": 9090}})<"));
+                CHECK(cfg.i({"server", "port"}) == 9090);
+                CHECK(cfg.str({"server", "name"}) == "web");
+                CHECK_THROWS(cfg.arr({"tags"}));
+                CHECK(cfg.generation() == before + 1);
+        }
+
+        SUBCASE("values that aren't objects hide lower layers") {
+                cfg.pushLayer("override", json::Parser::parse(R"<({"server": "off"})<"));
+                CHECK(cfg.str({"server"}) == "off");
+                cfg.pushLayer("top", json::Parser::parse(R"<({"server": {"name": "api"}})<"));
+                CHECK(cfg.str({"server", "name"}) == "api");
+                CHECK_THROWS(cfg.i({"server", "port"}));
+
+                cfg.removeLayer("override");
+                CHECK(cfg.i({"server", "port"}) == 8080);
+                CHECK(cfg.str({"server", "name"}) == "api");
+        }
+
+        SUBCASE("properties are added to the top layer") {
+                auto before = cfg.generation();
+                cfg.addProperty({"server"}, "name", "api");
+                CHECK(cfg.str({"server", "name"}) == "api");
+                CHECK(cfg.i({"server", "port"}) == 8080);
+                CHECK(cfg.generation() == before + 1);
+
+                cfg.modify([](json::Object& root) {
+                        root.addProperty({"server"}, json::Property{"port", json::Object{9090}});
+                        root.addProperty({"log"}, json::Property{"level", json::Object{"debug"}});
+                });
+                CHECK(cfg.i({"server", "port"}) == 9090);
+                CHECK(cfg.str({"log", "level"}) == "debug");
+                CHECK(cfg.str({"server", "name"}) == "api");
+                CHECK(cfg.generation() == before + 2);
+                CHECK(cfg.layer("base")->get<json::Int>({"server", "port"}) == 80);
+        }
+
+        SUBCASE("removing a layer uncovers the ones below") {
+                cfg.removeLayer("host");
+                CHECK(cfg.i({"server", "port"}) == 80);
+                CHECK_THROWS(cfg.arr({"tags"}));
+                CHECK(cfg.toJson() == *cfg.layer("base"));
+                CHECK_THROWS_AS(cfg.removeLayer("base"), ConfigError const&);
+                CHECK_THROWS_AS(cfg.layer("host"), ConfigError const&);
+        }
+
+        SUBCASE("properties are added to the top layer") {
+                cfg.addProperty({"log"}, "level", "debug");
+                CHECK(cfg.str({"log", "level"}) == "debug");
+                CHECK(cfg.layer("base")->get<json::Str>({"log", "level"}) == "info");
+                CHECK(cfg.layer("host")->get<json::Str>({"log", "level"}) == "debug");
+        }
+}
+
+TEST_CASE("file layers are reloaded") {
+        std::string fileName{"config_layer_test.json"};
+        writeFile(fileName, R"<({"server": {"port": 1}})<");
+        Config cfg{json::Parser::parse(R"<({"server": {"port": 80, "name": "web"}})<")};
+        cfg.pushFileLayer("site", fileName);
+        CHECK(cfg.i({"server", "port"}) == 1);
+        CHECK(cfg.str({"server", "name"}) == "web");
+
+        writeFile(fileName, R"<({"server": {"name": "api"}})<");
+        CHECK(cfg.reload());
+        CHECK(cfg.i({"server", "port"}) == 80);
+        CHECK(cfg.str({"server", "name"}) == "api");
+
+        writeFile(fileName, "{");
+        CHECK_THROWS(cfg.reload());
+        CHECK(cfg.str({"server", "name"}) == "api");
+        std::remove(fileName.c_str());
+}
+
+TEST_CASE("configs are loaded from the startup cache") {
+        std::string fileName{"config_cache_test.json"};
+        std::string cacheName{".config_cache_test.json.cache"};
+        std::remove(cacheName.c_str());
+        writeFile(fileName, R"<({"server": {"port": 1, "name": "web"}})<");
+
+        // Files that were just written aren't cached, their mtime
+        // might not change with the next write.
+        Config fresh{fileName};
+        CHECK(fresh.i({"server", "port"}) == 1);
+        CHECK_FALSE(std::ifstream{cacheName}.is_open());
+
+        timeval old[2] = {{1000000000, 0}, {1000000000, 0}};
+        REQUIRE(utimes(fileName.c_str(), old) == 0);
+        Config parsed{fileName};
+        CHECK(std::ifstream{cacheName}.is_open());
+
+        Config cached{fileName};
+        CHECK(cached.toJson() == parsed.toJson());
+        CHECK(cached.str({"server", "name"}) == "web");
+
+        SUBCASE("a changed file isn't read from the cache") {
+                writeFile(fileName, R"<({"server": {"port": 2}})<");
+                CHECK(Config{fileName}.i({"server", "port"}) == 2);
+        }
+
+        SUBCASE("a file replaced with one of the same size and mtime isn't read from the cache") {
+                writeFile(fileName, R"<({"server": {"port": 7, "name": "web"}})<");
+                REQUIRE(utimes(fileName.c_str(), old) == 0);
+                CHECK(Config{fileName}.i({"server", "port"}) == 7);
+        }
+
+        SUBCASE("a broken cache is ignored") {
+                writeFile(cacheName, "cfgcache garbage");
+                CHECK(Config{fileName}.i({"server", "port"}) == 1);
+        }
+
+        SUBCASE("reload() notices changes after a cache hit") {
+                writeFile(fileName, R"<({"server": {"port": 3}})<");
+                CHECK(cached.reload());
+                CHECK(cached.i({"server", "port"}) == 3);
+        }
+        std::remove(fileName.c_str());
+        std::remove(cacheName.c_str());
+}
+
+TEST_CASE("included files are merged in include order") {
+        writeFile("config_include_a.json", R"<({"server": {"port": 1, "name": "a"}, "a": true})<");
+        writeFile("config_include_b.json", R"<({"#include": "config_include_c.json", "server": {"port": 2}})<");
+        writeFile("config_include_c.json", R"<({"server": {"name": "c"}, "c": true})<");
+        writeFile("config_include_test.json",
+                  R"<({"#include": ["config_include_a.json", "config_include_b.json"], "server": {"host": "x"}})<");
+
+        Config cfg{std::string{"config_include_test.json"}};
+        CHECK(cfg.i({"server", "port"}) == 2);
+        CHECK(cfg.str({"server", "name"}) == "c");
+        CHECK(cfg.str({"server", "host"}) == "x");
+        CHECK(cfg.b({"a"}));
+        CHECK(cfg.b({"c"}));
+        CHECK_FALSE(cfg.toJson().into<json::Obj const&>().count("#include"));
+
+        SUBCASE("changes to included files are reloaded") {
+                writeFile("config_include_c.json", R"<({"server": {"name": "changed"}})<");
+                CHECK(cfg.reload());
+                CHECK(cfg.str({"server", "name"}) == "changed");
+                CHECK_THROWS(cfg.b({"c"}));
+        }
+
+        SUBCASE("cycles are reported") {
+                writeFile("config_include_c.json", R"<({"#include": "config_include_test.json"})<");
+                CHECK_THROWS_AS(cfg.reload(), ConfigError const&);
+                CHECK(cfg.str({"server", "name"}) == "c");
+        }
+
+        SUBCASE("missing includes are reported") {
+                writeFile("config_include_c.json", R"<({"#include": ["config_include_missing.json"]})<");
+                CHECK_THROWS_AS(cfg.reload(), ConfigError const&);
+        }
+        for (auto f : {"a", "b", "c", "test"}) {
+                std::remove(util::format("config_include_", f, ".json").c_str());
+        }
+}
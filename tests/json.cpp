@@ -2,10 +2,20 @@
 
 #include "json.h"
 #include "json_unstructured.h"
+#include "json_frozen.h"
+#include "json_binary.h"
+#include "json_writer.h"
+#include "document_cache.h"
+#include "config.h"
 #include "test_util.h"
 
 #include <iostream>
 #include <sstream>
+#include <fstream>
+#include <future>
+#include <cstdio>
+#include <cmath>
+#include <limits>
 
 TEST_CASE("parsing different values works") {
         // super simple for now
@@ -236,3 +246,234 @@ TEST_CASE("parsing empty strings throws a ParseError") {
         std::string json{""};
         CHECK_THROWS_AS(json::Parser::parse(json), json::ParseError const&);
 }
+
+TEST_CASE("values of a given kind can be parsed") {
+        json::Parser parser;
+        CHECK(parser.parseHelper(R"({"a": [1, 2]})").get<json::Arr>({"a"}).size() == 2);
+        CHECK(parser.parseArr("[1, true]").into<json::Arr const&>().size() == 2);
+        CHECK(parser.parseObj(R"({"a": 1})").get<json::Int>({"a"}) == 1);
+        CHECK(parser.parseString(R"("text")").into<json::Str const&>() == "text");
+        CHECK(parser.parseInt("42").into<json::Int>() == 42);
+        CHECK(parser.parseDouble("1.5").into<json::Double>() == 1.5);
+        CHECK(parser.parseDouble("2").into<json::Double>() == 2.0);
+        CHECK(parser.parseBool("true").into<json::Bool>());
+        CHECK_THROWS_AS(parser.parseArr(R"({"a": 1})"), json::ParseError const&);
+        CHECK_THROWS_AS(parser.parseInt("1.5"), json::ParseError const&);
+        CHECK_THROWS_AS(parser.parseBool("1"), json::ParseError const&);
+}
+
+TEST_CASE("deeply nested json throws a ParseError") {
+        CHECK_NOTHROW(json::Parser::parse(std::string(512, '[') + std::string(512, ']')));
+        CHECK_THROWS_AS(json::Parser::parse(std::string(513, '[') + std::string(513, ']')), json::ParseError const&);
+        CHECK_THROWS_AS(json::Parser::parse(std::string(1000000, '[') + std::string(1000000, ']')), json::ParseError const&);
+        std::string objects;
+        for (int i = 0; i < 1000; ++i) {
+                objects += R"({"a": )";
+        }
+        CHECK_THROWS_AS(json::Parser::parse(objects), json::ParseError const&);
+}
+
+TEST_CASE("frozen json literals are parsed at compile time") {
+        constexpr auto frozen = JSON_FROZEN(R"<({
+    "server": {
+        "port": 8080,
+        "addr": "ff01::1",
+        "ratio": 1.5e1,
+        "enable": true,
+        "peers": [1, -2, 3],
+    },
+    "nothing": null,
+})<");
+        static_assert(frozen.get<json::Int>({"server", "port"}) == 8080, "port should be known at compile time");
+        static_assert(frozen.get<json::Str>({"server", "addr"}) == "ff01::1", "addr should be known at compile time");
+        static_assert(frozen.get({"server", "peers"}).length() == 3, "peers should have three elements");
+        static_assert(frozen.has({"server", "enable"}), "enable should exist");
+        static_assert(!frozen.has({"server", "missing"}), "missing should not exist");
+
+        CHECK(frozen.get<json::Double>({"server", "ratio"}) == doctest::Approx(15));
+        CHECK(frozen.get<json::Bool>({"server", "enable"}));
+        CHECK(frozen.get({"server", "peers"}).get(1).into<json::Int>() == -2);
+        CHECK(frozen.get({"nothing"}).is<json::Null>());
+        CHECK_THROWS_AS(frozen.get<json::Int>({"server", "addr"}), json::BadTypeError const&);
+        CHECK_THROWS_AS(frozen.get({"server", "missing"}), json::ObjectError const&);
+
+        SUBCASE("converting to a json::Object gives the same result as the parser") {
+                json::Object parsed = json::Parser::parse(R"<({"a": {"b": [1, 2, "three"]}, "c": false})<");
+                constexpr auto same = JSON_FROZEN(R"<({"a": {"b": [1, 2, "three"]}, "c": false})<");
+                CHECK(same.toObject() == parsed);
+        }
+
+        SUBCASE("doubles are the same as the parser's") {
+                constexpr auto exact = JSON_FROZEN("[0.3, 1.1, -2.675e-3, 5e-324, 1e30, 123456789012345.6e-4]");
+                json::Object parsed = json::Parser::parse("[0.3, 1.1, -2.675e-3, 5e-324, 1e30, 123456789012345.6e-4]");
+                json::Arr const& arr = parsed.get<json::Arr>(json::Path{});
+                REQUIRE(exact.root().length() == arr.size());
+                for (std::size_t i = 0; i < arr.size(); ++i) {
+                        CAPTURE(i);
+                        CHECK(exact.root().get(i).into<json::Double>() == arr[i].get<json::Double>(json::Path{}));
+                }
+                // More digits than fit in the mantissa
+                constexpr auto close = JSON_FROZEN("[123456789012345678901234.5, 1.7976931348623157e308]");
+                CHECK(close.root().get(0).into<json::Double>() == doctest::Approx(123456789012345678901234.5));
+                CHECK(close.root().get(1).into<json::Double>() == doctest::Approx(1.7976931348623157e308));
+                // Out of range literals fail the build, the same checks
+                // throw when run outside of a constant expression
+                CHECK_THROWS_AS(json::frozen::countNodes("12345678901234567890"), json::ParseError const&);
+                CHECK_THROWS_AS(json::frozen::countNodes("1e309"), json::ParseError const&);
+                static_assert(JSON_FROZEN("0.3").into<json::Double>() == 0.3, "0.3 should be exact");
+                static_assert(JSON_FROZEN("1.1").into<json::Double>() == 1.1, "1.1 should be exact");
+        }
+}
+
+TEST_CASE("the document cache shares documents until the file changes") {
+        std::string fileName{"document_cache_test.json"};
+        auto writeFile = [&](std::string const& contents) {
+                std::ofstream f{fileName, std::ios::out | std::ios::trunc};
+                f << contents;
+        };
+        writeFile(R"<({"value": 10})<");
+        json::DocumentCache cache;
+
+        json::DocumentPtr first = cache.get(fileName);
+        CHECK(first->root.get<json::Int>({"value"}) == 10);
+        CHECK(cache.get(fileName) == first);
+
+        SUBCASE("changed contents are parsed again") {
+                writeFile(R"<({"value": 200})<");
+                json::DocumentPtr second = cache.get(fileName);
+                CHECK(second != first);
+                CHECK(second->root.get<json::Int>({"value"}) == 200);
+                CHECK(first->root.get<json::Int>({"value"}) == 10);
+        }
+
+        SUBCASE("documents are evicted when the cache is full") {
+                cache.setCapacity(0);
+                CHECK(cache.size() == 0);
+                CHECK(cache.get(fileName) != first);
+        }
+
+        SUBCASE("concurrent loads of the same file give the same document") {
+                cache.clear();
+                std::vector<std::future<json::DocumentPtr>> loads;
+                for (int i = 0; i < 4; ++i) {
+                        loads.push_back(std::async(std::launch::async, [&]() { return cache.get(fileName); }));
+                }
+                json::DocumentPtr doc = loads[0].get();
+                for (unsigned i = 1; i < loads.size(); ++i) {
+                        CHECK(loads[i].get() == doc);
+                }
+        }
+
+        std::remove(fileName.c_str());
+        CHECK_THROWS_AS(cache.get(fileName), util::IOError const&);
+}
+
+TEST_CASE("parseInto reuses what is already in the destination") {
+        json::Parser parser;
+        json::Object msg;
+        parser.parseInto(R"<({"id": 1, "name": "first message", "tags": ["a", "b"]})<", msg);
+        char const* name = msg.get<json::Str>({"name"}).data();
+        json::Arr const* tags = &msg.get<json::Arr>({"tags"});
+
+        parser.parseInto(R"<({"id": 2, "name": "second", "tags": ["c", "d"]})<", msg);
+        CHECK(msg.get<json::Int>({"id"}) == 2);
+        CHECK(msg.get<json::Str>({"name"}) == "second");
+        CHECK(msg.get<json::Str>({"name"}).data() == name);
+        CHECK(&msg.get<json::Arr>({"tags"}) == tags);
+        CHECK(msg.get<json::Arr>({"tags"})[1].into<json::Str>() == "d");
+
+        SUBCASE("keys and elements that disappear are removed") {
+                parser.parseInto(R"<({"id": 3, "tags": ["e"]})<", msg);
+                CHECK(msg.keys().size() == 2);
+                CHECK(msg.get<json::Arr>({"tags"}).size() == 1);
+        }
+
+        SUBCASE("values can change type") {
+                parser.parseInto(R"<({"id": "four", "name": null, "tags": {"x": 1.5}})<", msg);
+                CHECK(msg.get<json::Str>({"id"}) == "four");
+                CHECK(msg.get({"name"}).is<json::Null>());
+                CHECK(msg.get<json::Double>({"tags", "x"}) == doctest::Approx(1.5));
+        }
+
+        SUBCASE("invalid input throws") {
+                CHECK_THROWS_AS(parser.parseInto(R"<({"id": 1)<", msg), json::ParseError const&);
+                CHECK_THROWS_AS(parser.parseInto(R"<({"id": 1x})<", msg), json::ParseError const&);
+                CHECK_THROWS_AS(parser.parseInto(R"<({"id": "unterminated})<", msg), json::ParseError const&);
+        }
+}
+
+TEST_CASE("memory usage and parser statistics are reported") {
+        std::string json{R"<({"a long key that does not fit inline": "a long string value that does not fit inline", "arr": [1, 2, 3], "nest": {"b": true}})<"};
+        json::ParseStats stats;
+        json::Object result = json::Parser::parse(json, &stats);
+
+        CHECK(stats.tokens == 12);
+        CHECK(stats.maxDepth == 2);
+        CHECK(stats.allocations > 0);
+        CHECK(stats.bytesCopied >= 2 * std::string{"a long key that does not fit inline"}.size());
+
+        json::MemoryUsage usage = result.memoryUsage();
+        CHECK(usage.nodes == 8 * sizeof(json::Object));
+        CHECK(usage.strings == std::string{"a long string value that does not fit inline"}.size() + 1);
+        CHECK(usage.keys >= 4 * sizeof(std::string) + std::string{"a long key that does not fit inline"}.size());
+        CHECK(usage.overhead > 0);
+        CHECK(usage.total() == usage.nodes + usage.strings + usage.keys + usage.overhead + usage.slack);
+
+        SUBCASE("reparsing the same shape doesn't allocate") {
+                json::Parser parser;
+                json::Object msg;
+                parser.parseInto(json, msg);
+                parser.parseInto(json, msg, &stats);
+                CHECK(stats.allocations == 0);
+        }
+}
+
+TEST_CASE("lookups work with string views and literals") {
+        json::Object result = json::Parser::parse(R"<({"server": {"port": 8080, "name": "web"}})<");
+        std::string buffer{"xxserveryy"};
+        std::string_view key{buffer.data() + 2, 6};
+        CHECK(result.get(key).get<json::Int>({"port"}) == 8080);
+        CHECK(result.get<json::Str>({"server", "name"}) == "web");
+        json::Path path{"server", "port"};
+        CHECK(result.get<json::Int>(path) == 8080);
+        CHECK_THROWS_AS(result.get<json::Int>({"server", "missing"}), std::out_of_range const&);
+
+        Config cfg{result};
+        CHECK(cfg.i({"server", "port"}) == 8080);
+        CHECK_THROWS_AS(cfg.str(path), json::BadTypeError const&);
+}
+
+TEST_CASE("trees survive the binary encoding") {
+        auto obj = json::Parser::parse(R"<({"a": [1, 2.5, "three", true, false], "b": {"c": {}}, "d": [null]})<");
+        std::string encoded = json::binary::encode(obj);
+        auto decoded = json::binary::decode(encoded.data(), encoded.size());
+        CHECK(decoded.get("a") == obj.get("a"));
+        CHECK(decoded.get("b") == obj.get("b"));
+        CHECK(decoded.get("d").get(0).is<json::Null>());
+        CHECK(decoded.get("a").get(2) == json::Object{"three"});
+
+        CHECK_THROWS_AS(json::binary::decode(encoded.data(), encoded.size() - 1), json::ParseError const&);
+        encoded.push_back('x');
+        CHECK_THROWS_AS(json::binary::decode(encoded.data(), encoded.size()), json::ParseError const&);
+}
+
+TEST_CASE("the writer streams JSON") {
+        std::string out;
+        json::Writer writer{out};
+        writer.beginObject()
+                .key("a").value(1)
+                .key("b").beginArray().value(true).value(nullptr).value(-2.5).beginObject().endObject().endArray()
+                .key("s").value("tab\tquote\"back\\slash\x01")
+                .key("nan").value(std::nan(""))
+                .endObject();
+        CHECK(out == R"({"a":1,"b":[true,null,-2.5,{}],"s":"tab\tquote\"back\\slash\u0001","nan":null})");
+
+        json::Object parsed = json::Parser::parse(out);
+        CHECK(parsed.get<json::Int>({"a"}) == 1);
+        CHECK(parsed.get<json::Arr>({"b"}).size() == 4);
+
+        out.clear();
+        json::Writer{out}.beginArray().value(std::numeric_limits<std::uint64_t>::max()).value('x' == 'x').endArray();
+        CHECK(out == "[18446744073709551615,true]");
+}
+
@@ -1,11 +1,32 @@
 #include "doctest.h"
 #include "logging.h"
+#include "json_unstructured.h"
+#include "binary_log.h"
 #include "util.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <cstdlib>
+#include <new>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <csignal>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <zlib.h>
+#include <thread>
+#include <vector>
+
 class StringDest : public logging::Dest {
 public:
         static std::string contents;
-        void write(std::string msg) {
+        void write(std::string_view msg) override {
                 contents += msg;
         }
 
@@ -14,6 +35,75 @@ public:
 
 std::string StringDest::contents;
 
+namespace {
+// Allocations made by threads that have `countAllocations` set
+thread_local bool countAllocations{false};
+std::size_t allocations{0};
+}
+
+// Every form of new and delete that isn't aligned is replaced, so that
+// memory is always allocated and freed by the same pair, which the
+// sanitizers check. Freeing is kept out of line so that the compiler
+// doesn't see free() being called on what operator new gave back.
+static void* countedAlloc(std::size_t size) noexcept {
+        if (countAllocations) {
+                ++allocations;
+        }
+        return std::malloc(size ? size : 1);
+}
+
+[[gnu::noinline]] static void countedFree(void* p) noexcept {
+        std::free(p);
+}
+
+void* operator new(std::size_t size) {
+        if (void* p = countedAlloc(size)) {
+                return p;
+        }
+        throw std::bad_alloc{};
+}
+
+void* operator new[](std::size_t size) {
+        return operator new(size);
+}
+
+void* operator new(std::size_t size, std::nothrow_t const&) noexcept {
+        return countedAlloc(size);
+}
+
+void* operator new[](std::size_t size, std::nothrow_t const&) noexcept {
+        return countedAlloc(size);
+}
+
+void operator delete(void* p) noexcept {
+        countedFree(p);
+}
+
+void operator delete[](void* p) noexcept {
+        countedFree(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+        countedFree(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept {
+        countedFree(p);
+}
+
+void operator delete(void* p, std::nothrow_t const&) noexcept {
+        countedFree(p);
+}
+
+void operator delete[](void* p, std::nothrow_t const&) noexcept {
+        countedFree(p);
+}
+
+// Logs "a" and gives back the line it did that on
+static int logFromHere(logging::Log& l) {
+        LINFO(l, "a"); return __LINE__;
+}
+
 TEST_CASE("basic logging works") {
         StringDest::reset();
         logging::Log l{"root", util::make_unique<StringDest>()};
@@ -30,6 +120,22 @@ TEST_CASE("basic logging works") {
                 CHECK(StringDest::contents.substr(0, 4) == "INFO");
         }
 
+        SUBCASE("tokens can be repeated and mixed with text") {
+                l.setFormat("{line}{msg} {msg}{nope} {func}:{line}");
+                int line = logFromHere(l);
+                CHECK(StringDest::contents == util::format(line, "a a{nope} logFromHere:", line));
+        }
+
+        SUBCASE("time, thread and pid are filled in") {
+                l.setFormat("{time}|{thread}|{pid}");
+                LINFO(l, "");
+                auto const& s = StringDest::contents;
+                REQUIRE(s.size() > 24);
+                CHECK(s[4] == '-');
+                CHECK(s[19] == '.');
+                CHECK(s.substr(s.rfind('|') + 1) == util::format(getpid()));
+        }
+
         SUBCASE("subloggers work") {
                 l.setFormat("{name}");
                 auto sub = l.sub("sub");
@@ -38,11 +144,1063 @@ TEST_CASE("basic logging works") {
                         LINFO(sub, "sub");
                         CHECK(StringDest::contents == "root/sub");
                 }
+
+                SUBCASE("nested subloggers log with their full name") {
+                        auto inner = sub->sub("inner");
+                        LINFO(inner, "inner");
+                        CHECK(StringDest::contents == "root/sub/inner");
+                }
                 
                 SUBCASE("subloggers can be disabled") {
                         l.disable("sub");
                         LINFO(sub, "sub");
                         CHECK(StringDest::contents.empty());
+                        CHECK_FALSE(l.enabled("sub"));
+
+                        l.enable("sub");
+                        LINFO(sub, "sub");
+                        CHECK(StringDest::contents == "root/sub");
+                }
+
+                SUBCASE("disabling a sublogger disables the ones below it") {
+                        auto inner = sub->sub("inner");
+                        auto innermost = inner->sub("innermost");
+                        l.disable("sub");
+                        LINFO(inner, "inner");
+                        LINFOF(innermost, "innermost");
+                        CHECK(StringDest::contents.empty());
+
+                        // Enabling below a disabled logger isn't enough
+                        CHECK(l.enable({"root", "sub", "inner"}));
+                        LINFO(inner, "inner");
+                        CHECK(StringDest::contents.empty());
+
+                        l.disable({"root", "sub", "inner", "innermost"});
+                        l.enable("sub");
+                        LINFO(inner, "inner");
+                        LINFO(innermost, "innermost");
+                        CHECK(StringDest::contents == "root/sub/inner");
+                        CHECK_FALSE(l.enable({"root", "sub", "nope"}));
+                }
+        }
+}
+
+TEST_CASE("asynchronous logging writes everything") {
+        StringDest::reset();
+        logging::Log l{"root", util::make_unique<StringDest>()};
+        l.setFormat("{msg}\n");
+        l.startAsync(64);
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+                threads.emplace_back([&l]() {
+                        for (int i = 0; i < 500; ++i) {
+                                LINFO(l, "x");
+                        }
+                });
+        }
+        for (auto& t : threads) {
+                t.join();
+        }
+        l.flush();
+        CHECK(StringDest::contents.size() == 4 * 500 * 2);
+        CHECK(l.dropped() == 0);
+
+        SUBCASE("panic writes what was queued before it") {
+                LINFO(l, "before");
+                LPANIC(l, "panic");
+                auto tail = StringDest::contents.substr(StringDest::contents.size() - 13);
+                CHECK(tail == "before\npanic\n");
+        }
+}
+
+namespace {
+// Holds up the writer thread until it is let go, `entered` is set once
+// it is held up
+class GateDest : public logging::Dest {
+public:
+        GateDest(std::atomic<bool>& open, std::vector<std::string>& lines, std::atomic<bool>* entered = nullptr)
+                : open(open), lines(lines), entered(entered) {}
+
+        void write(std::string_view msg) override {
+                if (entered) {
+                        entered->store(true);
+                }
+                while (!open.load()) {
+                        std::this_thread::yield();
+                }
+                lines.emplace_back(msg);
+        }
+private:
+        std::atomic<bool>& open;
+        std::vector<std::string>& lines;
+        std::atomic<bool>* entered;
+};
+}
+
+TEST_CASE("a full queue drops messages according to the overflow policy") {
+        std::atomic<bool> open{false};
+        std::vector<std::string> lines;
+        logging::Log l{"root", util::make_unique<GateDest>(open, lines)};
+        l.setFormat("{msg}");
+
+        SUBCASE("the newest messages are dropped") {
+                l.startAsync(4, logging::Overflow::DropNewest);
+                for (int i = 0; i < 100; ++i) {
+                        LINFO(l, util::format(i));
+                }
+                open = true;
+                l.flush();
+                CHECK(l.dropped() + lines.size() == 100);
+                CHECK(lines.front() == "0");
+        }
+
+        SUBCASE("the oldest messages are dropped") {
+                l.startAsync(4, logging::Overflow::DropOldest);
+                for (int i = 0; i < 100; ++i) {
+                        LINFO(l, util::format(i));
+                }
+                open = true;
+                l.flush();
+                CHECK(l.dropped() + lines.size() == 100);
+                CHECK(lines.back() == "99");
+        }
+}
+
+TEST_CASE("deferred messages of several threads are written in the order they were logged") {
+        std::atomic<bool> open{false};
+        std::atomic<bool> entered{false};
+        std::vector<std::string> lines;
+        logging::Log l{"root", util::make_unique<GateDest>(open, lines, &entered)};
+        l.setFormat("{msg}");
+        l.startAsync(16);
+        LINFO(l, "first");
+        while (!entered.load()) {
+                std::this_thread::yield();
+        }
+        // Every thread has a ring of its own, the writer finds them all
+        // in the next batch and nothing in the queue
+        LINFOF(l, "{}", 1);
+        std::thread{[&l]() { LINFOF(l, "{}", 2); }}.join();
+        LINFOF(l, "{}", 3);
+        open = true;
+        l.flush();
+        CHECK(lines == std::vector<std::string>{"first", "1", "2", "3"});
+}
+
+TEST_CASE("messages below the level are not built") {
+        StringDest::reset();
+        logging::Log l{"root", util::make_unique<StringDest>(), logging::Level::Warn | logging::Level::Panic};
+        l.setFormat("{msg}");
+        auto sub = l.sub("sub");
+        int built{0};
+        auto msg = [&](std::string s) {
+                ++built;
+                return s;
+        };
+
+        LINFO(l, msg("info"));
+        LDBG(sub, msg("dbg"));
+        CHECK(built == 0);
+        CHECK(StringDest::contents.empty());
+        CHECK_FALSE(sub->isEnabled(logging::Level::Info));
+
+        LWARN(sub, msg("warn"));
+        CHECK(built == 1);
+        CHECK(StringDest::contents == "warn");
+
+        l.setLevel(logging::Level::Dbg);
+        CHECK(sub->isEnabled(logging::Level::Dbg));
+        LDBG(sub, msg("dbg"));
+        CHECK(StringDest::contents == "warndbg");
+
+        l.info(__LINE__, __FILE__, __func__, "called directly");
+        CHECK(StringDest::contents == "warndbg");
+}
+
+namespace {
+class CountingDest : public logging::Dest {
+public:
+        void write(std::string_view msg) override {
+                bytes += msg.size();
+        }
+
+        std::size_t bytes{0};
+};
+}
+
+TEST_CASE("logging calls don't allocate") {
+        auto dest = util::make_unique<CountingDest>();
+        auto& counting = *dest;
+        logging::Log l{"root", std::move(dest)};
+        l.setFormat("{time} {severity} [{name}] {file}:{line} {func}: {msg}\n");
+        auto sub = l.sub("sub")->sub("nested");
+        std::string msg(100, 'x');
+
+        auto logSome = [&]() {
+                for (int i = 0; i < 100; ++i) {
+                        LINFO(l, "a literal");
+                        LWARN(sub, msg);
+                        LDBG(sub, std::string(1000, 'y'));
+                        LINFOF(sub, "{} of {}: {}", i, 100u, msg);
+                }
+        };
+
+        SUBCASE("synchronous") {
+                logSome();
+                std::size_t before = counting.bytes;
+                countAllocations = true;
+                allocations = 0;
+                logSome();
+                countAllocations = false;
+                CHECK(allocations == 0);
+                CHECK(counting.bytes > before);
+        }
+
+        SUBCASE("asynchronous") {
+                l.startAsync(1024);
+                logSome();
+                l.flush();
+                countAllocations = true;
+                allocations = 0;
+                logSome();
+                countAllocations = false;
+                l.flush();
+                CHECK(allocations == 0);
+        }
+}
+
+TEST_CASE("deferred logging puts the message together later") {
+        StringDest::reset();
+        logging::Log l{"root", util::make_unique<StringDest>()};
+        l.setFormat("[{name}] {msg}\n");
+        auto sub = l.sub("sub");
+
+        SUBCASE("arguments replace the placeholders") {
+                std::string s{"str"};
+                LINFOF(l, "{} {} {} {} {} {} {}", -3, 42u, 1.5, true, 'c', "literal", s);
+                LWARNF(sub, "{}/{} left {}", std::string_view{"view"}, std::uint64_t{7});
+                LINFOF(l, "no arguments");
+                CHECK(StringDest::contents ==
+                      "[root] -3 42 1.5 true c literal str\n"
+                      "[root/sub] view/7 left {}\n"
+                      "[root] no arguments\n");
+        }
+
+        SUBCASE("arguments of disabled messages are not evaluated") {
+                int evaluated{0};
+                LDBGF(l, "{}", ++evaluated);
+                l.disable("sub");
+                LINFOF(sub, "{}", "disabled");
+                CHECK(evaluated == 0);
+                CHECK(StringDest::contents.empty());
+        }
+
+        SUBCASE("the writer thread renders the messages") {
+                l.setFormat("{thread} {msg}\n");
+                l.startAsync(16);
+                std::vector<std::thread> threads;
+                for (int t = 0; t < 4; ++t) {
+                        threads.emplace_back([&l]() {
+                                for (int i = 0; i < 500; ++i) {
+                                        LINFOF(l, "{} {}", i, std::string(i % 100, 'x'));
+                                }
+                        });
+                }
+                for (auto& t : threads) {
+                        t.join();
+                }
+                l.flush();
+                CHECK(l.dropped() == 0);
+
+                // Every thread's messages arrive complete and in order
+                std::map<std::string, int> next;
+                std::istringstream lines{StringDest::contents};
+                std::string thread;
+                int i;
+                std::string xs;
+                std::size_t count{0};
+                while (lines >> thread >> i) {
+                        std::getline(lines, xs);
+                        CHECK(i == next[thread]++);
+                        CHECK(xs.size() == 1 + static_cast<std::size_t>(i % 100));
+                        ++count;
+                }
+                CHECK(count == 4 * 500);
+        }
+}
+
+TEST_CASE("binary logs read back the same as text") {
+        std::string fileName{"logging_binary_test.bin"};
+        std::remove(fileName.c_str());
+        std::string format{"{time} {severity} [{name}] {file}:{line} {func}: {msg}\n"};
+        StringDest::reset();
+        std::string text;
+        {
+                logging::Log l{"root", util::make_unique<logging::BinaryDest>(fileName), logging::Level::Dbg | logging::Level::Info | logging::Level::Warn};
+                logging::Log plain{"root", util::make_unique<StringDest>(), logging::Level::Dbg | logging::Level::Info | logging::Level::Warn};
+                plain.setFormat(format);
+                // The same messages from the same lines to both
+                auto logSome = [](logging::Log& log) {
+                        auto sub = log.sub("sub");
+                        for (int i = 0; i < 200; ++i) {
+                                LINFOF(log, "request {} took {}us", i, 2.5 * i, logging::kv("slow", i > 100));
+                                LDBGF(sub, "{} {} {}", -i, 'c', i % 2 == 0);
+                        }
+                        LWARN(sub, "not deferred");
+                };
+                logSome(l);
+                logSome(plain);
+        }
+        text = StringDest::contents;
+
+        auto read = [&](std::string const& name) {
+                logging::BinaryLogReader reader{name};
+                logging::TemplateFormat fmt{format};
+                logging::Record record;
+                std::string res;
+                std::string msg;
+                while (reader.next(record)) {
+                        msg.clear();
+                        logging::renderMessage(record.site->format, record.args, msg);
+                        record.msg = msg;
+                        fmt.render(record, res);
+                }
+                return res;
+        };
+
+        // The times differ, compare everything after them
+        auto withoutTimes = [](std::string const& s) {
+                std::string res;
+                std::istringstream lines{s};
+                std::string line;
+                while (std::getline(lines, line)) {
+                        res += line.substr(24) + "\n";
+                }
+                return res;
+        };
+        CHECK(withoutTimes(read(fileName)) == withoutTimes(text));
+
+        std::string contents = util::readFile(fileName);
+        CHECK(contents.size() * 4 < text.size());
+
+        SUBCASE("a message cut short ends the log") {
+                std::ofstream{fileName, std::ios::trunc | std::ios::binary}.write(contents.data(), contents.size() - 3);
+                std::string partial = read(fileName);
+                CHECK(std::count(partial.begin(), partial.end(), '\n') == 400);
+        }
+
+        SUBCASE("garbage is an error") {
+                std::ofstream{fileName, std::ios::app | std::ios::binary} << "garbage";
+                CHECK_THROWS_AS(read(fileName), logging::Error const&);
+        }
+
+        SUBCASE("text written directly reads back as info") {
+                {
+                        logging::BinaryDest dest{fileName};
+                        dest.write("written directly");
+                }
+                std::string all = read(fileName);
+                std::string last = all.substr(all.rfind('\n', all.size() - 2) + 1);
+                CHECK(last.substr(24, 7) == "INFO   ");
+                CHECK(last.substr(last.size() - 19) == ": written directly\n");
+        }
+        std::remove(fileName.c_str());
+}
+
+TEST_CASE("file destinations buffer until a flush is due") {
+        std::string fileName{"logging_file_dest_test.log"};
+        std::remove(fileName.c_str());
+        auto contents = [&]() { return util::readFile(fileName); };
+        logging::FlushPolicy policy;
+        policy.interval = std::chrono::milliseconds{0};
+
+        SUBCASE("after a number of messages") {
+                policy.count = 3;
+                logging::Log l{"root", util::make_unique<logging::FileDest>(fileName, policy)};
+                l.setFormat("{msg}\n");
+                LINFO(l, "a");
+                LINFO(l, "b");
+                CHECK(contents().empty());
+                LINFO(l, "c");
+                CHECK(contents() == "a\nb\nc\n");
+        }
+
+        SUBCASE("when the buffer is full") {
+                policy.bytes = 16;
+                logging::Log l{"root", util::make_unique<logging::FileDest>(fileName, policy)};
+                l.setFormat("{msg}\n");
+                LINFO(l, "0123456789");
+                CHECK(contents().empty());
+                LINFO(l, "0123456789");
+                CHECK(contents() == "0123456789\n0123456789\n");
+        }
+
+        SUBCASE("for warnings and when the log is flushed") {
+                logging::Log l{"root", util::make_unique<logging::FileDest>(fileName, policy)};
+                l.setFormat("{msg}\n");
+                LINFO(l, "info");
+                CHECK(contents().empty());
+                LWARN(l, "warn");
+                CHECK(contents() == "info\nwarn\n");
+                LINFO(l, "info");
+                l.flush();
+                CHECK(contents() == "info\nwarn\ninfo\n");
+        }
+
+        SUBCASE("when the log commits") {
+                logging::Log l{"root", util::make_unique<logging::FileDest>(fileName, policy)};
+                l.setFormat("{msg}\n");
+                LINFO(l, "info");
+                CHECK(contents().empty());
+                l.commit();
+                CHECK(contents() == "info\n");
+                CHECK(l.commitStats().syncs == 1);
+        }
+
+        SUBCASE("batches from the writer thread arrive whole") {
+                policy.bytes = 100;
+                {
+                        logging::Log l{"root", util::make_unique<logging::FileDest>(fileName, policy)};
+                        l.setFormat("{msg}\n");
+                        l.startAsync(64);
+                        for (int i = 0; i < 1000; ++i) {
+                                LINFOF(l, "{}", i);
+                        }
+                }
+                std::istringstream lines{contents()};
+                int expected{0};
+                int i;
+                while (lines >> i) {
+                        CHECK(i == expected++);
+                }
+                CHECK(expected == 1000);
+        }
+        std::remove(fileName.c_str());
+}
+
+namespace {
+// Files in `dir` whose name starts with `prefix`, sorted
+std::vector<std::string> filesIn(std::string const& dir, std::string const& prefix) {
+        std::vector<std::string> res;
+        if (DIR* d = opendir(dir.c_str())) {
+                while (dirent* entry = readdir(d)) {
+                        std::string name{entry->d_name};
+                        if (name.compare(0, prefix.size(), prefix) == 0) {
+                                res.push_back(name);
+                        }
+                }
+                closedir(d);
+        }
+        std::sort(res.begin(), res.end());
+        return res;
+}
+
+std::string gunzip(std::string const& fileName) {
+        std::string res;
+        gzFile in = gzopen(fileName.c_str(), "rb");
+        REQUIRE(in);
+        char buf[1024];
+        int n;
+        while ((n = gzread(in, buf, sizeof(buf))) > 0) {
+                res.append(buf, n);
+        }
+        gzclose(in);
+        return res;
+}
+}
+
+namespace {
+// Remembers how many messages it had when it last synced, syncing
+// takes a while
+class SyncDest : public logging::Dest {
+public:
+        void write(std::string_view msg) override {
+                std::lock_guard<std::mutex> lock{mutex};
+                lines.emplace_back(msg);
+        }
+
+        void sync() override {
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+                std::lock_guard<std::mutex> lock{mutex};
+                synced = lines.size();
+        }
+
+        bool isSynced(std::string const& line) {
+                std::lock_guard<std::mutex> lock{mutex};
+                return std::find(lines.begin(), lines.begin() + synced, line) != lines.begin() + synced;
+        }
+
+        std::size_t count(std::string const& line) {
+                std::lock_guard<std::mutex> lock{mutex};
+                return static_cast<std::size_t>(std::count(lines.begin(), lines.end(), line));
+        }
+private:
+        std::mutex mutex;
+        std::vector<std::string> lines;
+        std::size_t synced{0};
+};
+}
+
+TEST_CASE("commits wait for their messages to be synced") {
+        auto owned = util::make_unique<SyncDest>();
+        SyncDest& dest = *owned;
+        logging::Log l{"root", std::move(owned)};
+        l.setFormat("{msg}");
+        auto audit = l.sub("audit");
+
+        SUBCASE("synchronous") {}
+        SUBCASE("asynchronous") {
+                l.startAsync(64);
+        }
+
+        std::atomic<int> unsynced{0};
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+                threads.emplace_back([&, t]() {
+                        for (int i = 0; i < 50; ++i) {
+                                LINFOF(*audit, "{} {}", t, i);
+                                audit->commit();
+                                if (!dest.isSynced(util::format(t, " ", i))) {
+                                        ++unsynced;
+                                }
+                        }
+                });
+        }
+        for (auto& t : threads) {
+                t.join();
+        }
+        CHECK(unsynced.load() == 0);
+        auto stats = l.commitStats();
+        CHECK(stats.commits == 200);
+        // Commits that wait at the same time share a sync
+        CHECK(stats.syncs < stats.commits);
+        CHECK(stats.max >= std::chrono::milliseconds(2));
+        CHECK(stats.total >= stats.max);
+}
+
+TEST_CASE("file destinations rotate") {
+        std::string dir{"logging_rotation_test"};
+        mkdir(dir.c_str(), 0755);
+        for (auto const& f : filesIn(dir, "app.log")) {
+                std::remove((dir + "/" + f).c_str());
+        }
+        std::string fileName{dir + "/app.log"};
+        logging::FlushPolicy flush;
+        flush.count = 1;
+        logging::RotationPolicy rotation;
+
+        SUBCASE("by size, keeping the newest files compressed") {
+                rotation.bytes = 20;
+                rotation.compress = true;
+                rotation.keep = 2;
+                {
+                        logging::Log l{"root", util::make_unique<logging::FileDest>(fileName, flush, rotation)};
+                        l.setFormat("{msg}\n");
+                        for (int i = 0; i < 10; ++i) {
+                                LINFOF(l, "line {}", i);
+                        }
+                }
+                auto files = filesIn(dir, "app.log");
+                REQUIRE(files.size() == 3);
+                CHECK(files[0] == "app.log");
+                // Three lines of seven bytes fill a file
+                CHECK(util::readFile(fileName) == "line 9\n");
+                CHECK(files[1].substr(files[1].size() - 3) == ".gz");
+                std::string rotated = gunzip(dir + "/" + files[1]) + gunzip(dir + "/" + files[2]);
+                CHECK(rotated == "line 3\nline 4\nline 5\nline 6\nline 7\nline 8\n");
+        }
+
+        SUBCASE("more than ten times within a second") {
+                rotation.bytes = 20;
+                rotation.keep = 2;
+                {
+                        logging::Log l{"root", util::make_unique<logging::FileDest>(fileName, flush, rotation)};
+                        l.setFormat("{msg}\n");
+                        for (int i = 0; i < 40; ++i) {
+                                LINFOF(l, "line {}", i);
+                        }
+                }
+                auto files = filesIn(dir, "app.log");
+                REQUIRE(files.size() == 3);
+                std::vector<std::string> rotated{util::readFile(dir + "/" + files[1]), util::readFile(dir + "/" + files[2])};
+                std::sort(rotated.begin(), rotated.end());
+                CHECK(rotated == std::vector<std::string>{"line 33\nline 34\nline 35\n", "line 36\nline 37\nline 38\n"});
+        }
+
+        SUBCASE("commits cover the rotated files") {
+                rotation.bytes = 20;
+                logging::Log l{"root", util::make_unique<logging::FileDest>(fileName, flush, rotation)};
+                l.setFormat("{msg}\n");
+                for (int i = 0; i < 10; ++i) {
+                        LINFOF(l, "line {}", i);
+                }
+                l.commit();
+                CHECK(l.commitStats().syncs == 1);
+                CHECK(filesIn(dir, "app.log").size() == 4);
+                CHECK(util::readFile(fileName) == "line 9\n");
+        }
+
+        SUBCASE("by time") {
+                rotation.interval = std::chrono::seconds{1};
+                // Start early in a second so that "before" isn't
+                // written after the first rotation is due
+                auto now = std::chrono::system_clock::now().time_since_epoch();
+                std::this_thread::sleep_for(std::chrono::seconds{1} - now % std::chrono::seconds{1});
+                logging::Log l{"root", util::make_unique<logging::FileDest>(fileName, flush, rotation)};
+                l.setFormat("{msg}\n");
+                LINFO(l, "before");
+                std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+                LINFO(l, "after");
+                LINFO(l, "new file");
+                auto files = filesIn(dir, "app.log");
+                REQUIRE(files.size() == 2);
+                CHECK(util::readFile(fileName) == "new file\n");
+                CHECK(util::readFile(dir + "/" + files[1]) == "before\nafter\n");
+        }
+
+        for (auto const& f : filesIn(dir, "app.log")) {
+                std::remove((dir + "/" + f).c_str());
+        }
+        rmdir(dir.c_str());
+}
+
+namespace {
+// The messages of a flight recorder dump without the times
+std::vector<std::string> dumped(std::string const& fileName) {
+        std::vector<std::string> res;
+        std::istringstream in{util::readFile(fileName)};
+        std::string line;
+        while (std::getline(in, line)) {
+                res.push_back(line.compare(0, 3, "---") == 0 ? "---" : line.substr(line.find(' ') + 1));
+        }
+        return res;
+}
+}
+
+TEST_CASE("the flight recorder keeps the last messages in memory") {
+        std::string fileName{"logging_recorder_test.log"};
+        std::remove(fileName.c_str());
+        StringDest::reset();
+        logging::Log l{"root", util::make_unique<StringDest>()};
+        l.setFormat("{msg}\n");
+        l.startRecording(fileName, 16);
+        auto sub = l.sub("sub");
+
+        SUBCASE("including levels that aren't written") {
+                LDBG(l, "debug");
+                LINFO(*sub, "info");
+                LDBGF(l, "deferred {} {}", 1, "two");
+                CHECK(StringDest::contents == "info\n");
+                l.dumpRecording();
+                CHECK(dumped(fileName) == std::vector<std::string>{
+                        "---", "[DEBUG   (root) 1]: debug", "[INFO    (root/sub) 1]: info", "[DEBUG   (root) 1]: deferred 1 two"});
+        }
+
+        SUBCASE("from every thread in the order they were logged") {
+                l.startAsync(64);
+                std::vector<std::thread> threads;
+                for (int t = 0; t < 3; ++t) {
+                        threads.emplace_back([&l, t]() {
+                                for (int i = 0; i < 100; ++i) {
+                                        LDBGF(l, "{} {}", t, i);
+                                }
+                        });
+                }
+                for (auto& t : threads) {
+                        t.join();
+                }
+                sub->dumpRecording();
+                auto contents = util::readFile(fileName);
+                std::vector<std::string> lines;
+                std::istringstream in{contents};
+                std::string line;
+                std::getline(in, line);
+                std::string last;
+                std::map<std::string, int> perThread;
+                while (std::getline(in, line)) {
+                        // Times sort as text
+                        CHECK(line.substr(0, 27) >= last);
+                        last = line.substr(0, 27);
+                        ++perThread[line.substr(line.find("]: ") + 3, 1)];
+                }
+                CHECK(perThread == std::map<std::string, int>{{"0", 16}, {"1", 16}, {"2", 16}});
+        }
+
+        SUBCASE("cutting long messages") {
+                LDBG(l, std::string(300, 'x'));
+                LDBGF(l, "{}{}", std::string(150, 'a'), std::string(150, 'b'));
+                l.dumpRecording();
+                auto lines = dumped(fileName);
+                REQUIRE(lines.size() == 3);
+                CHECK(lines[1].size() < 256);
+                CHECK(lines[1].substr(lines[1].size() - 4) == "x...");
+                CHECK(lines[2] == "[DEBUG   (root) 1]: " + std::string(150, 'a') + "{}...");
+        }
+
+        SUBCASE("dumped by panics") {
+                LDBG(l, "before");
+                LPANIC(l, "panic");
+                CHECK(dumped(fileName) == std::vector<std::string>{
+                        "---", "[DEBUG   (root) 1]: before", "[PANIC   (root) 1]: panic"});
+        }
+
+        SUBCASE("dumped on crashes") {
+                pid_t child = fork();
+                REQUIRE(child >= 0);
+                if (child == 0) {
+                        rlimit noCore{0, 0};
+                        setrlimit(RLIMIT_CORE, &noCore);
+                        l.dumpRecordingOnCrash();
+                        LDBG(l, "last words");
+                        std::raise(SIGSEGV);
+                        _exit(0);
                 }
+                int status;
+                waitpid(child, &status, 0);
+                CHECK(WIFSIGNALED(status));
+                CHECK(WTERMSIG(status) == SIGSEGV);
+                auto contents = util::readFile(fileName);
+                CHECK(contents.find("(SIGSEGV)") != std::string::npos);
+                CHECK(contents.find("]: last words\n") != std::string::npos);
+        }
+
+        l.stopRecording();
+        std::remove(fileName.c_str());
+}
+
+TEST_CASE("call sites can be switched on and off") {
+        logging::Sites::reset();
+        StringDest::reset();
+        logging::Log l{"root", util::make_unique<StringDest>()};
+        l.setFormat("{msg}\n");
+        auto net = l.sub("net");
+        int debugLine{0};
+        auto run = [&]() {
+                LDBG(l, "root debug");
+                debugLine = __LINE__ + 1;
+                LDBG(*net, "net debug");
+                LDBGF(*net, "net {}", "deferred");
+                LINFO(*net, "net info");
+        };
+
+        SUBCASE("by file and line") {
+                run();
+                CHECK(StringDest::contents == "net info\n");
+                logging::Sites::Match match;
+                match.file = "logging.cpp";
+                match.line = debugLine;
+                CHECK(logging::Sites::set(match, logging::SiteState::On) == 1);
+                StringDest::reset();
+                run();
+                CHECK(StringDest::contents == "net debug\nnet info\n");
+
+                SUBCASE("even if the logger is disabled") {
+                        l.disable("net");
+                        StringDest::reset();
+                        run();
+                        CHECK(StringDest::contents == "net debug\n");
+                }
+        }
+
+        SUBCASE("by logger and level, for sites that haven't run yet") {
+                logging::Sites::Match on;
+                on.logger = "root/n*";
+                on.levels = logging::Level::Dbg;
+                logging::Sites::set(on, logging::SiteState::On);
+                logging::Sites::Match off;
+                off.file = "log*.cpp";
+                off.levels = logging::Level::Info;
+                logging::Sites::set(off, logging::SiteState::Off);
+                run();
+                // Only runs here, it registers after the switches
+                LDBG(*net, "new site");
+                CHECK(StringDest::contents == "net debug\nnet deferred\nnew site\n");
+
+                SUBCASE("until they are reset") {
+                        logging::Sites::reset();
+                        StringDest::reset();
+                        run();
+                        CHECK(StringDest::contents == "net info\n");
+                }
+        }
+
+        SUBCASE("through JSON commands") {
+                run();
+                CHECK(logging::Sites::command(util::format(
+                        R"([{"state": "on", "file": "logging.cpp", "line": )", debugLine,
+                        R"(}, {"state": "off", "logger": "root/net", "level": "info"}])")) == 2);
+                StringDest::reset();
+                run();
+                CHECK(StringDest::contents == "net debug\n");
+                CHECK_THROWS_AS(logging::Sites::command(R"({"state": "sideways"})"), logging::Error const&);
+                CHECK_THROWS_AS(logging::Sites::command(R"({"state": "on", "line": "one"})"), logging::Error const&);
+                CHECK_THROWS_AS(logging::Sites::command(R"({"file": "x.cpp"})"), logging::Error const&);
+                CHECK_THROWS_AS(logging::Sites::command("{"), logging::Error const&);
+        }
+
+        SUBCASE("and listed") {
+                run();
+                auto sites = logging::Sites::list();
+                auto it = std::find_if(sites.begin(), sites.end(), [&](logging::Sites::Info const& info) {
+                        return info.line == debugLine && std::string{info.file} == "logging.cpp";
+                });
+                REQUIRE(it != sites.end());
+                CHECK(it->logger == "root/net");
+                CHECK(it->level.bits() == logging::Level::Dbg.bits());
+                CHECK(it->state == logging::SiteState::Default);
+        }
+
+        logging::Sites::reset();
+}
+
+TEST_CASE("call sites can be limited") {
+        logging::Sites::reset();
+        auto owned = util::make_unique<SyncDest>();
+        SyncDest& dest = *owned;
+        logging::Log l{"root", std::move(owned)};
+        l.setFormat("{msg}");
+        auto flood = l.sub("flood");
+        logging::Sites::Match match;
+        match.logger = "root/flood";
+        auto eventually = [](auto done) {
+                for (int i = 0; i < 500 && !done(); ++i) {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                }
+                return done();
+        };
+
+        SUBCASE("by rate, with a summary of what was turned away") {
+                logging::Sites::command(R"({"logger": "root/flood", "rate": 0.1, "burst": 5, "summary": 0.2})");
+                int const line = __LINE__ + 2;
+                for (int i = 0; i < 100; ++i) {
+                        LINFO(*flood, "flood");
+                }
+                CHECK(dest.count("flood") == 5);
+                std::string summary = util::format("suppressed 95 messages from logging.cpp:", line);
+                CHECK(eventually([&]() { return dest.count(summary) == 1; }));
+        }
+
+        SUBCASE("by sampling") {
+                logging::Sites::Limit limit;
+                limit.sample = 4;
+                logging::Sites::limit(match, limit);
+                int const line = __LINE__ + 2;
+                for (int i = 0; i < 100; ++i) {
+                        LINFO(*flood, "sampled");
+                }
+                CHECK(dest.count("sampled") == 25);
+                CHECK(eventually([&]() {
+                        auto sites = logging::Sites::list();
+                        return std::any_of(sites.begin(), sites.end(), [&](logging::Sites::Info const& info) {
+                                return info.line == line && info.suppressed == 75;
+                        });
+                }));
+
+                SUBCASE("until the limit is removed") {
+                        logging::Sites::limit(match, logging::Sites::Limit{});
+                        for (int i = 0; i < 10; ++i) {
+                                LINFO(*flood, "unlimited");
+                        }
+                        CHECK(dest.count("unlimited") == 10);
+                }
+
+                SUBCASE("until it is limited again") {
+                        limit.sample = 2;
+                        for (int round = 0; round < 3; ++round) {
+                                logging::Sites::limit(match, limit);
+                                for (int i = 0; i < 10; ++i) {
+                                        LINFO(*flood, "resampled");
+                                }
+                        }
+                        CHECK(dest.count("resampled") == 15);
+                }
+        }
+
+        SUBCASE("only by messages that would be written") {
+                logging::Sites::command(R"({"logger": "root/flood", "rate": 0.1, "burst": 5, "summary": 0.2})");
+                std::string fileName{"logging_limit_test.log"};
+                l.startRecording(fileName, 16);
+                int const line = __LINE__ + 3;
+                auto logFlood = [&](int n) {
+                        for (int i = 0; i < n; ++i) {
+                                LINFO(*flood, "flood");
+                                LDBG(*flood, "recorded");
+                        }
+                };
+                l.disable("flood");
+                logFlood(100);
+                l.enable("flood");
+                logFlood(5);
+                CHECK(dest.count("flood") == 5);
+                CHECK(dest.count("recorded") == 0);
+
+                // Turned away while enabled, but the logger is disabled
+                // by the time the summary is due
+                logFlood(100);
+                l.disable("flood");
+                std::this_thread::sleep_for(std::chrono::milliseconds(500));
+                CHECK(dest.count(util::format("suppressed 100 messages from logging.cpp:", line)) == 0);
+                auto sites = logging::Sites::list();
+                CHECK(std::any_of(sites.begin(), sites.end(), [&](logging::Sites::Info const& info) {
+                        return info.line == line && info.suppressed == 100;
+                }));
+                CHECK(std::none_of(sites.begin(), sites.end(), [&](logging::Sites::Info const& info) {
+                        return info.line == line + 1 && info.suppressed != 0;
+                }));
+                l.stopRecording();
+                std::remove(fileName.c_str());
+        }
+
+        SUBCASE("through JSON commands that are checked") {
+                CHECK_THROWS_AS(logging::Sites::command(R"({"rate": "fast"})"), logging::Error const&);
+                CHECK_THROWS_AS(logging::Sites::command(R"({"summary": true})"), logging::Error const&);
+                CHECK_THROWS_AS(logging::Sites::command(R"({"sample": -1})"), logging::Error const&);
+                CHECK_THROWS_AS(logging::Sites::command(R"({"burst": 1e30})"), logging::Error const&);
+                CHECK_THROWS_AS(logging::Sites::command(R"({"rate": 1e300, "summary": 1})"), logging::Error const&);
+                CHECK_THROWS_AS(logging::Sites::command(R"({"summary": 1e18})"), logging::Error const&);
+        }
+
+        logging::Sites::reset();
+}
+
+TEST_CASE("repeated messages are coalesced") {
+        StringDest::reset();
+        logging::Log l{"root", util::make_unique<StringDest>()};
+        l.setFormat("{name}: {msg}\n");
+        l.setCoalescing(std::chrono::seconds{60});
+        auto net = l.sub("net");
+
+        SUBCASE("until a different message is logged") {
+                for (int i = 0; i < 3; ++i) {
+                        LINFO(l, "flapping");
+                        LINFOF(*net, "link {}", "down");
+                }
+                LWARN(l, "flapping");
+                LINFOF(*net, "link {}", "up");
+                LINFO(l, "flapping");
+                CHECK(StringDest::contents ==
+                      "root: flapping\n"
+                      "root/net: link down\n"
+                      "root: last message repeated 2 times\n"
+                      "root: flapping\n"
+                      "root/net: last message repeated 2 times\n"
+                      "root/net: link up\n"
+                      "root: flapping\n");
+        }
+
+        SUBCASE("until the log is flushed") {
+                LINFO(l, "flapping");
+                LINFO(l, "flapping");
+                l.flush();
+                LINFO(l, "flapping");
+                CHECK(StringDest::contents == "root: flapping\nroot: last message repeated 1 time\n");
+        }
+
+        SUBCASE("but not panics") {
+                LPANIC(l, "oops");
+                LPANIC(l, "oops");
+                CHECK(StringDest::contents == "root: oops\nroot: oops\n");
+        }
+
+        SUBCASE("until the timeout has passed") {
+                l.setCoalescing(std::chrono::milliseconds{1});
+                LINFO(l, "flapping");
+                LINFO(l, "flapping");
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                LINFO(*net, "other");
+                CHECK(StringDest::contents == "root: flapping\nroot: last message repeated 1 time\nroot/net: other\n");
+        }
+
+        SUBCASE("by the writer thread") {
+                auto owned = util::make_unique<SyncDest>();
+                SyncDest& dest = *owned;
+                l.setDest(std::move(owned));
+                l.setFormat("{msg}");
+                l.setCoalescing(std::chrono::milliseconds{20});
+                l.startAsync(64);
+                for (int i = 0; i < 10; ++i) {
+                        LINFO(l, "flapping");
+                }
+                for (int i = 0; i < 500 && !dest.count("last message repeated 9 times"); ++i) {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                }
+                CHECK(dest.count("flapping") == 1);
+                CHECK(dest.count("last message repeated 9 times") == 1);
         }
 }
+
+TEST_CASE("structured messages keep their fields") {
+        StringDest::reset();
+        logging::Log l{"root", util::make_unique<StringDest>()};
+        auto log = [&]() {
+                LINFOF(l, "request {} done", 7, logging::kv("user", "bob \"the\"\n"), logging::kv("ms", 1.5),
+                       logging::kv("ok", true), logging::kv("retries", 2u));
+        };
+
+        SUBCASE("as text") {
+                l.setFormat("{msg}\n");
+                log();
+                CHECK(StringDest::contents == "request 7 done user=bob \"the\"\n ms=1.5 ok=true retries=2\n");
+        }
+
+        SUBCASE("as JSON lines") {
+                l.setFormat(util::make_unique<logging::JsonLinesFormat>());
+                log();
+                LWARN(l, "plain");
+                std::istringstream lines{StringDest::contents};
+                std::string line;
+                REQUIRE(std::getline(lines, line));
+                json::Object first = json::Parser::parse(line);
+                CHECK(first.get<json::Str>({"msg"}) == "request 7 done");
+                CHECK(first.get<json::Str>({"level"}) == "info");
+                CHECK(first.get<json::Str>({"logger"}) == "root");
+                CHECK(first.get<json::Double>({"ms"}) == doctest::Approx(1.5));
+                CHECK(first.get<json::Bool>({"ok"}));
+                CHECK(first.get<json::Int>({"retries"}) == 2);
+                // The parser keeps escapes as they are
+                CHECK(first.get<json::Str>({"user"}) == "bob \\\"the\\\"\\n");
+                CHECK(first.get<json::Str>({"time"}).size() == 27);
+                REQUIRE(std::getline(lines, line));
+                json::Object second = json::Parser::parse(line);
+                CHECK(second.get<json::Str>({"msg"}) == "plain");
+                CHECK(second.get<json::Str>({"level"}) == "warning");
+                CHECK(!std::getline(lines, line));
+        }
+
+        SUBCASE("as JSON lines without repeating a key") {
+                l.setFormat(util::make_unique<logging::JsonLinesFormat>());
+                LINFOF(l, "the message", logging::kv("msg", "a field"), logging::kv("level", 3),
+                       logging::kv("msg", "another"), logging::kv("_msg", "taken"));
+                CHECK(StringDest::contents.find(R"("msg":"the message","_msg":"a field","_level":3,"__msg":"another","___msg":"taken"})") != std::string::npos);
+                json::Object line = json::Parser::parse(StringDest::contents);
+                CHECK(line.get<json::Str>({"msg"}) == "the message");
+                CHECK(line.get<json::Str>({"level"}) == "info");
+                CHECK(line.get<json::Str>({"_msg"}) == "a field");
+                CHECK(line.get<json::Int>({"_level"}) == 3);
+        }
+
+        SUBCASE("for destinations that take records") {
+                class FieldDest : public logging::Dest {
+                public:
+                        void write(std::string_view) override {}
+                        bool writeRecord(logging::Record const& record) override {
+                                logging::ArgReader reader{record.args};
+                                logging::ArgReader::Arg arg;
+                                while (reader.next(arg)) {
+                                        keys.emplace_back(arg.key);
+                                }
+                                return true;
+                        }
+                        std::vector<std::string> keys;
+                };
+                auto owned = util::make_unique<FieldDest>();
+                FieldDest& dest = *owned;
+                l.setDest(std::move(owned));
+                l.startAsync(64);
+                log();
+                l.flush();
+                CHECK(dest.keys == std::vector<std::string>{"", "user", "ms", "ok", "retries"});
+        }
+}
+
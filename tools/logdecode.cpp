@@ -0,0 +1,158 @@
+// Renders binary logs written by logging::BinaryDest as text.
+//
+//   logdecode [options] file...
+//
+//   --format <template>  template for every message, see
+//                        Log::setFormat()
+//   --level <level>      only messages of this level or worse, one of
+//                        debug, info, warning and panic
+//   --logger <name>      only messages of this logger and its
+//                        subloggers
+//   --since <time>       only messages logged at or after `time`
+//   --until <time>       only messages logged before `time`
+//
+// Times are given as "YYYY-MM-DD HH:MM:SS" in local time or as seconds
+// since the epoch.
+
+#include "binary_log.h"
+#include "logging.h"
+#include "util.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <exception>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace {
+        struct Options {
+                std::string format{"{time} [{severity} ({name})]: {msg}\n"};
+                int minLevel{0};
+                std::string logger{};
+                std::optional<std::chrono::system_clock::time_point> since{};
+                std::optional<std::chrono::system_clock::time_point> until{};
+                std::vector<std::string> files{};
+        };
+
+        [[noreturn]] void usage(std::string const& error) {
+                std::cerr << "logdecode: " << error << "\n"
+                          << "usage: logdecode [--format <template>] [--level <level>] [--logger <name>]\n"
+                          << "                 [--since <time>] [--until <time>] file...\n";
+                std::exit(2);
+        }
+
+        int parseLevel(std::string const& name) {
+                if (name == "debug") { return logging::Level::Dbg.bits(); }
+                if (name == "info") { return logging::Level::Info.bits(); }
+                if (name == "warning") { return logging::Level::Warn.bits(); }
+                if (name == "panic") { return logging::Level::Panic.bits(); }
+                usage(util::format("unknown level `", name, "'"));
+        }
+
+        std::chrono::system_clock::time_point parseTime(std::string const& value) {
+                std::tm tm{};
+                char const* end = strptime(value.c_str(), "%Y-%m-%d %H:%M:%S", &tm);
+                if (end && *end == '\0') {
+                        tm.tm_isdst = -1;
+                        return std::chrono::system_clock::from_time_t(std::mktime(&tm));
+                }
+                char* last;
+                long long seconds = std::strtoll(value.c_str(), &last, 10);
+                if (value.empty() || *last != '\0') {
+                        usage(util::format("can't parse time `", value, "'"));
+                }
+                return std::chrono::system_clock::time_point{std::chrono::seconds{seconds}};
+        }
+
+        Options parse(int argc, char** argv) {
+                Options res;
+                for (int i = 1; i < argc; ++i) {
+                        std::string arg{argv[i]};
+                        auto value = [&]() {
+                                if (i + 1 >= argc) {
+                                        usage(util::format(arg, " needs a value"));
+                                }
+                                return std::string{argv[++i]};
+                        };
+                        if (arg == "--format") {
+                                res.format = value();
+                        } else if (arg == "--level") {
+                                res.minLevel = parseLevel(value());
+                        } else if (arg == "--logger") {
+                                res.logger = value();
+                        } else if (arg == "--since") {
+                                res.since = parseTime(value());
+                        } else if (arg == "--until") {
+                                res.until = parseTime(value());
+                        } else if (arg.compare(0, 2, "--") == 0) {
+                                usage(util::format("unknown option `", arg, "'"));
+                        } else {
+                                res.files.push_back(arg);
+                        }
+                }
+                if (res.files.empty()) {
+                        usage("no files given");
+                }
+                return res;
+        }
+
+        bool wanted(Options const& options, logging::Record const& record) {
+                // Levels are single bits, worse ones have higher bits
+                if (record.level.bits() < options.minLevel) {
+                        return false;
+                }
+                if (!options.logger.empty()) {
+                        std::string_view name{record.name};
+                        if (name.compare(0, options.logger.size(), options.logger) != 0 ||
+                            (name.size() > options.logger.size() && name[options.logger.size()] != '/')) {
+                                return false;
+                        }
+                }
+                if (options.since && record.time < *options.since) {
+                        return false;
+                }
+                if (options.until && record.time >= *options.until) {
+                        return false;
+                }
+                return true;
+        }
+}
+
+int main(int argc, char** argv) {
+        Options options = parse(argc, argv);
+        std::string msg;
+        std::string out;
+        try {
+                logging::TemplateFormat format{options.format};
+                for (auto const& file : options.files) {
+                        logging::BinaryLogReader reader{file};
+                        logging::Record record;
+                        while (reader.next(record)) {
+                                if (!wanted(options, record)) {
+                                        continue;
+                                }
+                                msg.clear();
+                                logging::renderMessage(record.site->format, record.args, msg);
+                                record.msg = msg;
+                                out.clear();
+                                format.render(record, out);
+                                std::cout << out;
+                        }
+                }
+        } catch (logging::Error const& e) {
+                std::cout.flush();
+                std::cerr << "logdecode: " << e.what() << "\n";
+                return 1;
+        } catch (std::exception const& e) {
+                // A file that decodes but doesn't render, e.g. a
+                // message with a level no build of the library knows
+                std::cout.flush();
+                std::cerr << "logdecode: " << e.what() << "\n";
+                return 1;
+        }
+        return 0;
+}
@@ -1 +1,104 @@
 #include "util.h"
+
+#include <fstream>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace util {
+
+FileStamp stamp(std::string const& fileName) {
+        struct stat st;
+        if (::stat(fileName.c_str(), &st) != 0) {
+                throw IOError{format("Can't stat `", fileName, "': ", std::strerror(errno))};
+        }
+        FileStamp res;
+        res.device = st.st_dev;
+        res.inode = st.st_ino;
+        res.size = st.st_size;
+        res.mtime = static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        res.ctime = static_cast<std::int64_t>(st.st_ctim.tv_sec) * 1000000000 + st.st_ctim.tv_nsec;
+        return res;
+}
+
+std::string readFile(std::string const& fileName) {
+        std::ifstream f{fileName, std::ios::in | std::ios::binary};
+        if (!f.is_open()) {
+                throw IOError{format("Can't open file `", fileName, "' for reading.")};
+        }
+        std::string contents;
+        f.seekg(0, std::ios::end);
+        auto size = f.tellg();
+        if (size > 0) {
+                contents.resize(static_cast<std::size_t>(size));
+                f.seekg(0, std::ios::beg);
+                f.read(&contents[0], size);
+                contents.resize(static_cast<std::size_t>(f.gcount()));
+        }
+        if (f.bad()) {
+                throw IOError{format("Unknown error while reading file `", fileName, "'.")};
+        }
+        return contents;
+}
+
+void writeFileAtomically(std::string const& fileName, std::string const& contents) {
+        // The temporary name is unique per process so that two
+        // processes writing the same file don't trample each other.
+        std::string tmp = format(fileName, ".", ::getpid(), ".tmp");
+        {
+                std::ofstream f{tmp, std::ios::out | std::ios::binary | std::ios::trunc};
+                if (!f.is_open()) {
+                        throw IOError{format("Can't open file `", tmp, "' for writing.")};
+                }
+                f.write(contents.data(), contents.size());
+                f.flush();
+                if (!f) {
+                        f.close();
+                        ::unlink(tmp.c_str());
+                        throw IOError{format("Unknown error while writing file `", tmp, "'.")};
+                }
+        }
+        if (std::rename(tmp.c_str(), fileName.c_str()) != 0) {
+                int err = errno;
+                ::unlink(tmp.c_str());
+                throw IOError{format("Can't rename `", tmp, "' to `", fileName, "': ", std::strerror(err))};
+        }
+}
+
+MappedFile::MappedFile(std::string const& fileName) {
+        int fd = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                throw IOError{format("Can't open file `", fileName, "' for reading: ", std::strerror(errno))};
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+                int err = errno;
+                ::close(fd);
+                throw IOError{format("Can't stat `", fileName, "': ", std::strerror(err))};
+        }
+        len = static_cast<std::size_t>(st.st_size);
+        if (len > 0) {
+                void* p = ::mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p == MAP_FAILED) {
+                        int err = errno;
+                        ::close(fd);
+                        throw IOError{format("Can't map `", fileName, "': ", std::strerror(err))};
+                }
+                ptr = static_cast<char const*>(p);
+        }
+        // The mapping stays valid without the descriptor
+        ::close(fd);
+}
+
+MappedFile::~MappedFile() {
+        if (ptr) {
+                ::munmap(const_cast<char*>(ptr), len);
+        }
+}
+
+} /* namespace util */